@@ -0,0 +1,516 @@
+/*
+ * Hardware-free benchmark for joy-remap.so.  This uses the shim's test
+ * mode (EV_JOY_REMAP_FAKE) to make a memfd full of recorded events look
+ * like an event (or js) device, and then measures open() (with the
+ * ioctls a typical game does on open), read() and ioctl() for each given
+ * configuration file.  Each configuration is run in a fresh process,
+ * since the shim only reads its configuration at startup.
+ *
+ * To build:
+ *     gcc -s -Wall -O2 -o joy-remap-bench{,.c} -lpthread
+ *
+ * To use:
+ *     LD_PRELOAD=/path/to/joy-remap.so joy-remap-bench [<options>] <conf>...
+ * Options:
+ *     -s <file>  event stream:  raw struct input_event records as read
+ *                from an event device (or struct js_event with -j).  The
+ *                default is 10 seconds of a synthetic 1000Hz stream with
+ *                both sticks moving and buttons changing.
+ *     -d <file>  fake device description (see EV_JOY_REMAP_FAKE in
+ *                joy-remap.c); the default is a generic gamepad.
+ *     -j         benchmark a js device instead of an event device
+ *     -b <n>     events per read() (default 64)
+ *     -r <n>     times to read the stream (default 20)
+ *     -o <n>     opens to do (default 200)
+ *     -l <n>     regular file opens to do, as when a game loads its data
+ *                (default 100000; 0 to skip)
+ *     -t <n>     also run the opens (with a read) in 1, 2, 4, ... n
+ *                threads at once (at most 16, the shim's limit on open
+ *                fake devices)
+ *     -v         show the shim's messages (normally /dev/null)
+ * Sections are selected by EV_JOY_REMAP_ENABLE as usual.
+ *
+ * For each configuration, this prints the time per input event, per
+ * ioctl and per open, and the number of heap allocations and lock
+ * acquisitions per open and per 1000 input events.  It also prints the
+ * time to open and close a regular file (half with absolute paths, half
+ * relative), which is all the shim should cost while a game is loading;
+ * compare with EV_JOY_REMAP_CHECK_ALL set, or without the shim.  Allocations are
+ * counted by wrapping malloc() and friends; locks are counted using the
+ * shim's statistics (EV_JOY_REMAP_STATS).  With -t, it then prints a
+ * line per thread count with the time per open over all threads, and how
+ * often (and how long) the shim's global lock had to be waited for.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <linux/joystick.h>
+#include "joy-remap-stat.h"
+
+/* count allocations, including those made by the shim */
+extern void *__libc_malloc(size_t), *__libc_calloc(size_t, size_t),
+            *__libc_realloc(void *, size_t);
+static unsigned long nalloc = 0;
+
+/* atomic, since -t runs threads */
+#define NALLOC_INC() __atomic_add_fetch(&nalloc, 1, __ATOMIC_RELAXED)
+
+void *malloc(size_t n)
+{
+    NALLOC_INC();
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t s)
+{
+    NALLOC_INC();
+    return __libc_calloc(n, s);
+}
+
+void *realloc(void *p, size_t n)
+{
+    NALLOC_INC();
+    return __libc_realloc(p, n);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* 10 seconds of 1000Hz:  both sticks move every ms, a button changes
+ * every 50ms, and the hat every 200ms */
+/* js numbers assume the default fake device:  buttons start at BTN_SOUTH,
+ * and the axes are x y z rx ry rz hat0x hat0y */
+#define SYNTH_MS 10000
+static char *synth_stream(int is_js, size_t *len)
+{
+    size_t n = 0, sz = SYNTH_MS * (is_js ? 6 * sizeof(struct js_event) :
+				               7 * sizeof(struct input_event));
+    char *s = malloc(sz);
+    int ms, i;
+    if(!s)
+	return NULL;
+    for(ms = 0; ms < SYNTH_MS; ms++) {
+	int tri = ms % 512 < 256 ? ms % 256 : 511 - ms % 512;
+	int type[6], code[6], val[6], nv = 0;
+	for(i = 0; i < 4; i++) {
+	    type[nv] = EV_ABS;
+	    code[nv] = i < 2 ? ABS_X + i : ABS_RX + i - 2;
+	    val[nv++] = (tri + i * 64) % 256;
+	}
+	if(!(ms % 50)) {
+	    type[nv] = EV_KEY;
+	    code[nv] = BTN_SOUTH + ms / 50 % 4;
+	    val[nv++] = ms / 200 % 2;
+	}
+	if(!(ms % 200)) {
+	    type[nv] = EV_ABS;
+	    code[nv] = ABS_HAT0X;
+	    val[nv++] = ms / 200 % 3 - 1;
+	}
+	if(!is_js) {
+	    type[nv] = EV_SYN;
+	    code[nv] = SYN_REPORT;
+	    val[nv++] = 0;
+	}
+	for(i = 0; i < nv; i++) {
+	    if(is_js) {
+		struct js_event js = { .time = ms };
+		if(type[i] == EV_KEY) {
+		    js.type = JS_EVENT_BUTTON;
+		    js.number = code[i] - BTN_SOUTH;
+		    js.value = val[i];
+		} else {
+		    js.type = JS_EVENT_AXIS;
+		    js.number = code[i] == ABS_HAT0X ? 6 : code[i];
+		    js.value = code[i] == ABS_HAT0X ? val[i] * 32767 :
+			                              (val[i] - 128) * 256;
+		}
+		memcpy(s + n, &js, sizeof(js));
+		n += sizeof(js);
+	    } else {
+		struct input_event ev = {
+		    .time = { ms / 1000, ms % 1000 * 1000 },
+		    .type = type[i], .code = code[i], .value = val[i]
+		};
+		memcpy(s + n, &ev, sizeof(ev));
+		n += sizeof(ev);
+	    }
+	}
+    }
+    *len = n;
+    return s;
+}
+
+static char *read_file(const char *fn, size_t *len)
+{
+    struct stat st;
+    char *s;
+    int fd = open(fn, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) || !(s = malloc(st.st_size + 1)) ||
+       read(fd, s, st.st_size) != st.st_size) {
+	perror(fn);
+	exit(1);
+    }
+    close(fd);
+    *len = st.st_size;
+    return s;
+}
+
+/* what a typical game (e.g. SDL) does on open */
+static void probe(int fd, int is_js)
+{
+    char name[128];
+    unsigned long bits[KEY_MAX / 8 / sizeof(long) + 1];
+    struct input_absinfo ai;
+    struct input_id id;
+    __u8 n;
+    int i;
+    if(is_js) {
+	ioctl(fd, JSIOCGNAME(sizeof(name)), name);
+	ioctl(fd, JSIOCGAXES, &n);
+	ioctl(fd, JSIOCGBUTTONS, &n);
+	return;
+    }
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    ioctl(fd, EVIOCGID, &id);
+    ioctl(fd, EVIOCGBIT(0, sizeof(bits)), bits);
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits);
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(bits)), bits);
+    for(i = 0; i < ABS_CNT; i++)
+	if(bits[i / 8 / sizeof(long)] & (1UL << i % (8 * sizeof(long))))
+	    ioctl(fd, EVIOCGABS(i), &ai);
+    ioctl(fd, EVIOCGKEY(sizeof(bits)), bits);
+}
+
+/* benchmark one configuration; runs in its own process */
+/* open and close n regular files; returns ns per file, or -1 on error */
+static double load_files(int n)
+{
+    char dir[] = "/tmp/joy-remap-files.XXXXXX", path[100], cwd[4096];
+    double t0, t;
+    int fd, i;
+
+    if(!n)
+	return 0;
+    if(!mkdtemp(dir) || !getcwd(cwd, sizeof(cwd)) || chdir(dir)) {
+	perror(dir);
+	return -1;
+    }
+    for(i = 0; i < 100; i++) {
+	sprintf(path, "file%d", i);
+	if((fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0) {
+	    perror(path);
+	    return -1;
+	}
+	close(fd);
+    }
+    t0 = now();
+    for(i = 0; i < n; i++) {
+	if(i & 1)
+	    sprintf(path, "file%d", i % 100);
+	else
+	    sprintf(path, "%s/file%d", dir, i % 100);
+	if((fd = open(path, O_RDONLY)) < 0) {
+	    perror(path);
+	    return -1;
+	}
+	close(fd);
+    }
+    t = now() - t0;
+    for(i = 0; i < 100; i++) {
+	sprintf(path, "file%d", i);
+	unlink(path);
+    }
+    if(chdir(cwd) || rmdir(dir))
+	perror(dir);
+    return t / n;
+}
+
+/* one thread of the -t stress:  open, probe, read a block, close */
+struct stress {
+    const char *path;
+    int is_js, bs, ev_size, opens;
+    int err;
+};
+
+static void *stress_thread(void *arg)
+{
+    struct stress *s = arg;
+    char *buf = malloc(s->bs * s->ev_size);
+    int fd, i;
+    for(i = 0; buf && i < s->opens; i++) {
+	if((fd = open(s->path, O_RDONLY)) < 0) {
+	    s->err = errno;
+	    break;
+	}
+	probe(fd, s->is_js);
+	if(read(fd, buf, s->bs * s->ev_size) < 0)
+	    s->err = errno;
+	close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* run opens in 1, 2, 4, ... nthreads threads at once */
+static int stress(const struct jrstat *st, const char *path, int is_js,
+		  int bs, int opens, int nthreads)
+{
+    pthread_t tid[16];
+    struct stress s[16];
+    int n, i, ret = 0;
+    unsigned w0, u0;
+    double t0, t;
+
+    for(n = 1; ; n = n * 2 < nthreads ? n * 2 : nthreads) {
+	w0 = st->lock_wait;
+	u0 = st->lock_wait_us;
+	t0 = now();
+	for(i = 0; i < n; i++) {
+	    s[i] = (struct stress){ path, is_js, bs,
+		is_js ? sizeof(struct js_event) : sizeof(struct input_event),
+		opens };
+	    if(pthread_create(&tid[i], NULL, stress_thread, &s[i])) {
+		perror("pthread_create");
+		return 1;
+	    }
+	}
+	for(i = 0; i < n; i++) {
+	    pthread_join(tid[i], NULL);
+	    if(s[i].err) {
+		errno = s[i].err;
+		perror(path);
+		ret = 1;
+	    }
+	}
+	t = now() - t0;
+	printf("  %2d threads %9.2f us/open %7.3f waits/open %9.2f us waited/open\n",
+	       n, t / (n * opens) / 1000, (double)(st->lock_wait - w0) / (n * opens),
+	       (double)(st->lock_wait_us - u0) / (n * opens));
+	if(ret || n == nthreads)
+	    break;
+    }
+    return ret;
+}
+
+static int bench(const char *cfn, const char *dir, const char *sfn, int is_js,
+		 int bs, int reps, int opens, int files, int nthreads)
+{
+    char path[300], target[64];
+    struct jrstat *st;
+    size_t len;
+    char *stream = sfn ? read_file(sfn, &len) : synth_stream(is_js, &len);
+    int ev_size = is_js ? sizeof(struct js_event) : sizeof(struct input_event);
+    int fd, mfd, i;
+    unsigned long a0, nin;
+    unsigned l0;
+    double t0, t_open, t_read, t_ioctl, t_file;
+    char *buf = malloc(bs * ev_size);
+
+    sprintf(path, JRSTAT_PATH, (int)getpid());
+    if((fd = open(path, O_RDONLY)) < 0) {
+	fprintf(stderr, "%s: shim not loaded; use LD_PRELOAD=joy-remap.so\n", cfn);
+	return 1;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(st == MAP_FAILED || st->version != JRSTAT_VERSION) {
+	fprintf(stderr, "%s: incompatible shim\n", cfn);
+	return 1;
+    }
+    /* the device is a memfd holding the stream; it's linked into the
+     * fake device directory so it can be opened by name */
+    if(!stream || !buf || (mfd = memfd_create("joy-remap-bench", 0)) < 0 ||
+       write(mfd, stream, len) != len) {
+	perror("stream");
+	return 1;
+    }
+    /* js devices also need their event device, but only for ioctls */
+    sprintf(target, "/proc/%d/fd/%d", (int)getpid(), mfd);
+    for(i = 0; i <= is_js; i++) {
+	sprintf(path, "%s/%s", dir, i ? "js0" : "event0");
+	unlink(path);
+	if(symlink(target, path)) {
+	    perror(path);
+	    return 1;
+	}
+    }
+
+    /* open + probe + close */
+    a0 = nalloc;
+    l0 = st->lock_acq;
+    t0 = now();
+    for(i = 0; i < opens; i++) {
+	if((fd = open(path, O_RDONLY)) < 0) {
+	    perror(path);
+	    return 1;
+	}
+	probe(fd, is_js);
+	close(fd);
+    }
+    t_open = now() - t0;
+    /* after the device, so the configuration has been loaded */
+    if((t_file = load_files(files)) < 0)
+	return 1;
+    printf("%-20.20s %9.2f %7.2f %7.2f %9.1f", strrchr(cfn, '/') ? strrchr(cfn, '/') + 1 : cfn,
+	   t_open / opens / 1000, (double)(nalloc - a0) / opens,
+	   (double)(st->lock_acq - l0) / opens, t_file);
+    if(!st->captured) {
+	printf("  (not captured)\n");
+	return 0;
+    }
+
+    /* read the whole stream, reps times */
+    fd = open(path, O_RDONLY);
+    a0 = nalloc;
+    l0 = st->lock_acq;
+    nin = 0;
+    t0 = now();
+    for(i = 0; i < reps; i++) {
+	lseek(fd, 0, SEEK_SET);
+	while(read(fd, buf, bs * ev_size) > 0);
+	nin += len / ev_size;
+    }
+    t_read = now() - t0;
+    printf(" %9.1f %7.3f %7.3f", t_read / nin, (nalloc - a0) * 1000.0 / nin,
+	   (st->lock_acq - l0) * 1000.0 / nin);
+
+    /* state queries some games do instead of reading events */
+    t0 = now();
+    for(i = 0; i < 100000; i++) {
+	if(is_js)
+	    ioctl(fd, JSIOCGAXES, buf);
+	else {
+	    ioctl(fd, EVIOCGKEY(KEY_MAX / 8 + 1), buf);
+	    ioctl(fd, EVIOCGABS(ABS_X), buf);
+	}
+    }
+    t_ioctl = now() - t0;
+    printf(" %9.1f\n", t_ioctl / (is_js ? 100000 : 200000));
+    close(fd);
+    fflush(stdout);
+    return nthreads ? stress(st, path, is_js, bs, opens, nthreads) : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *sfn = NULL, *dfn = NULL, *child = NULL;
+    char dir[] = "/tmp/joy-remap-bench.XXXXXX", path[300];
+    int is_js = 0, bs = 64, reps = 20, opens = 200, files = 100000;
+    int verbose = 0, usage = 0, nthreads = 0;
+    int opt, ret = 0, i;
+    size_t len;
+
+    while((opt = getopt(argc, argv, "s:d:jb:r:o:l:t:vC:")) != -1)
+	switch(opt) {
+	  case 's': sfn = optarg; break;
+	  case 'd': dfn = optarg; break;
+	  case 'j': is_js = 1; break;
+	  case 'b': bs = atoi(optarg); break;
+	  case 'r': reps = atoi(optarg); break;
+	  case 'o': opens = atoi(optarg); break;
+	  case 'l': files = atoi(optarg); break;
+	  case 't': nthreads = atoi(optarg); break;
+	  case 'v': verbose = 1; break;
+	  case 'C': child = optarg; break; /* internal:  fake dir */
+	  default: usage = 1;
+	}
+    if(usage || optind >= argc || bs < 1 || reps < 1 || opens < 1 || files < 0 ||
+       nthreads < 0 || nthreads > 16) {
+	fprintf(stderr, "usage: LD_PRELOAD=joy-remap.so joy-remap-bench [-s stream] "
+		"[-d desc] [-j] [-b n] [-r n] [-o n] [-l n] [-t n] [-v] conf...\n");
+	return 1;
+    }
+    if(child)
+	return bench(argv[optind], child, sfn, is_js, bs, reps, opens, files,
+		     nthreads);
+    if(!mkdtemp(dir)) {
+	perror(dir);
+	return 1;
+    }
+    if(dfn) {
+	char *d = read_file(dfn, &len);
+	FILE *f;
+	sprintf(path, "%s/event0.desc", dir);
+	if(!(f = fopen(path, "w")) || fwrite(d, len, 1, f) != 1 || fclose(f)) {
+	    perror(path);
+	    return 1;
+	}
+    }
+    printf("%-20s %9s %7s %7s %9s %9s %7s %7s %9s\n", "", "us/open", "allocs", "locks",
+	   "ns/file", "ns/event", "al/kev", "lk/kev", "ns/ioctl");
+    fflush(stdout);
+    for(i = optind; i < argc; i++) {
+	pid_t pid = fork();
+	int status;
+	if(pid < 0) {
+	    perror("fork");
+	    ret = 1;
+	    break;
+	}
+	if(!pid) {
+	    char *args[22], bss[12], rs[12], os[12], ls[12], ts[12];
+	    int n = 0;
+	    setenv("EV_JOY_REMAP_CONFIG", argv[i], 1);
+	    setenv("EV_JOY_REMAP_FAKE", dir, 1);
+	    setenv("EV_JOY_REMAP_STATS", "1", 1);
+	    if(!verbose)
+		setenv("EV_JOY_REMAP_LOG", "/dev/null", 1);
+	    sprintf(bss, "%d", bs);
+	    sprintf(rs, "%d", reps);
+	    sprintf(os, "%d", opens);
+	    sprintf(ls, "%d", files);
+	    sprintf(ts, "%d", nthreads);
+	    args[n++] = argv[0];
+	    args[n++] = "-C";
+	    args[n++] = dir;
+	    args[n++] = "-b";
+	    args[n++] = bss;
+	    args[n++] = "-r";
+	    args[n++] = rs;
+	    args[n++] = "-o";
+	    args[n++] = os;
+	    args[n++] = "-l";
+	    args[n++] = ls;
+	    args[n++] = "-t";
+	    args[n++] = ts;
+	    if(is_js)
+		args[n++] = "-j";
+	    if(sfn) {
+		args[n++] = "-s";
+		args[n++] = (char *)sfn;
+	    }
+	    args[n++] = argv[i];
+	    args[n] = NULL;
+	    execv("/proc/self/exe", args);
+	    perror("exec");
+	    _exit(1);
+	}
+	if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+	    ret = 1;
+    }
+    for(i = 0; i < 3; i++) {
+	sprintf(path, "%s/%s", dir, i == 0 ? "event0" : i == 1 ? "js0" : "event0.desc");
+	unlink(path);
+    }
+    rmdir(dir);
+    return ret;
+}
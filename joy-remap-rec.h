@@ -0,0 +1,72 @@
+/*
+ * Input recording format shared by joy-remap.so and joy-remap-replay.
+ * If EV_JOY_REMAP_RECORD names a file, the shim writes JRREC_MAGIC to
+ * it, followed by records, each of which starts with one of the REC_*
+ * tags below and a device number (one byte, in order of capture).
+ *
+ * Numbers marked uv are unsigned LEB128 varints (7 bits per byte, least
+ * significant first, high bit set on all but the last); sv are signed
+ * ones, zigzag encoded first.  Event times (dt) are the change since the
+ * previous event of the same device (starting from 0), in microseconds
+ * for event devices and milliseconds for js devices.  A 0 tag (e.g. from
+ * a program that was killed) ends the recording.
+ */
+#ifndef JOY_REMAP_REC_H
+#define JOY_REMAP_REC_H
+
+#define JRREC_MAGIC "JRREC1\n" /* 8 bytes, including the NUL */
+#define JRREC_MAXDEV 256
+
+enum {
+    /* dev, name length (uv), name, bustype vendor product version (uv),
+     * key bits (KEY_CNT / 8 bytes), pressed keys (same), abs bits (8 bytes),
+     * and for each set abs bit, value min max fuzz flat resolution (sv) */
+    REC_DEV = 1,
+    REC_JS,	/* dev:  the device is read as a js device from now on */
+    REC_EV,	/* dev, dt (sv), type (byte), code (uv), value (sv) */
+    REC_SYN,	/* dev, dt (sv):  SYN_REPORT */
+    REC_JSEV,	/* dev, dt (sv), type (byte), number (byte), value (sv) */
+    REC_CLOSE	/* dev */
+};
+
+static inline unsigned char *rec_uv(unsigned char *p, unsigned long long v)
+{
+    while(v >= 0x80) {
+	*p++ = v | 0x80;
+	v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline unsigned char *rec_sv(unsigned char *p, long long v)
+{
+    return rec_uv(p, ((unsigned long long)v << 1) ^ (v >> 63));
+}
+
+/* decoders return NULL if the varint runs past e */
+static inline const unsigned char *rec_guv(const unsigned char *p,
+					   const unsigned char *e,
+					   unsigned long long *v)
+{
+    int sh = 0;
+    *v = 0;
+    do {
+	if(p >= e || sh > 63)
+	    return NULL;
+	*v |= (unsigned long long)(*p & 0x7f) << sh;
+	sh += 7;
+    } while(*p++ & 0x80);
+    return p;
+}
+
+static inline const unsigned char *rec_gsv(const unsigned char *p,
+					   const unsigned char *e, long long *v)
+{
+    unsigned long long u;
+    if((p = rec_guv(p, e, &u)))
+	*v = (long long)(u >> 1) ^ -(long long)(u & 1);
+    return p;
+}
+
+#endif
@@ -0,0 +1,560 @@
+/*
+ * Play back input recorded by joy-remap.so (EV_JOY_REMAP_RECORD) through
+ * the shim again.  This uses the shim's test mode (EV_JOY_REMAP_FAKE):
+ * each recorded device becomes a FIFO with a description matching what
+ * the device reported when it was recorded (including which buttons were
+ * held and where the axes were), and the recorded events are fed into it
+ * and read back through the shim.  This makes it possible to debug a
+ * configuration against real input from a device that isn't there, or to
+ * see how a change to the shim or configuration affects its output.
+ *
+ * To build:
+ *     gcc -s -Wall -O2 -o joy-remap-replay{,.c}
+ *
+ * To use:
+ *     LD_PRELOAD=/path/to/joy-remap.so joy-remap-replay [-f] [-q] [-v] <file>
+ * Options:
+ *     -f  play back as fast as possible, keeping the recorded time stamps.
+ *         Otherwise, events are played back at the recorded pace, and are
+ *         stamped with the current time, so autofire and chords behave as
+ *         they did originally.
+ *     -q  only print the summary
+ *     -v  show the shim's messages (normally /dev/null)
+ * The configuration is found as usual (EV_JOY_REMAP_CONFIG, etc.).
+ *
+ * Every event returned by the shim is printed as:
+ *     <device> <type> <code> <value>
+ * where device is the number it was given in the recording (the order
+ * in which devices were captured), and for js devices, type, code and
+ * value are those of the struct js_event.  A line starting with # is
+ * printed as each device is opened.  The summary goes to stderr.  With
+ * -f, the output only depends on the recording and the configuration,
+ * except that autofire and held back chord presses depend on timers.
+ *
+ * Only 32 different device descriptions (16 for js) can be played back.
+ * The recording doesn't include what the program did to the devices,
+ * other than reading them, so e.g. EVIOCSCLOCKID is not replayed.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <linux/joystick.h>
+#include "joy-remap-rec.h"
+
+#define NSLOT 32 /* fake event devices; the shim's EVDEV_NMINOR */
+#define NJSSLOT 16 /* fake js devices; the shim's JSDEV_NMINOR */
+#define BATCH 64
+
+/* device description from a REC_DEV record */
+struct devinfo {
+    char name[256];
+    unsigned long long id[4];
+    unsigned char keys[KEY_CNT / 8], down[KEY_CNT / 8], abs[ABS_CNT / 8];
+    long long ai[ABS_CNT][6]; /* value min max fuzz flat res */
+};
+
+struct rec {
+    int tag, dev;
+    long long dt;
+    int type, code, value;
+    struct devinfo di; /* only for REC_DEV */
+};
+
+#define ISSET(b, i) ((b)[(i) / 8] & (1 << (i) % 8))
+
+#define get_uv(v) do { \
+    unsigned long long _u; \
+    if(!(p = rec_guv(p, e, &_u))) \
+	return NULL; \
+    v = _u; \
+} while(0)
+#define get_sv(v) do { \
+    long long _s; \
+    if(!(p = rec_gsv(p, e, &_s))) \
+	return NULL; \
+    v = _s; \
+} while(0)
+#define get_byte(v) do { \
+    if(p >= e) \
+	return NULL; \
+    v = *p++; \
+} while(0)
+
+/* decode one record; returns NULL at the end, or if it's corrupt */
+static const unsigned char *rec_get(const unsigned char *p, const unsigned char *e,
+				    struct rec *r)
+{
+    unsigned long long l;
+    int i, j;
+    if(e - p < 2 || !*p)
+	return NULL;
+    r->tag = *p++;
+    r->dev = *p++;
+    switch(r->tag) {
+      case REC_DEV:
+	get_uv(l);
+	if(l > e - p)
+	    return NULL;
+	i = l < sizeof(r->di.name) ? l : sizeof(r->di.name) - 1;
+	memcpy(r->di.name, p, i);
+	r->di.name[i] = 0;
+	/* the description is line-based */
+	for(j = 0; j < i; j++)
+	    if(r->di.name[j] == '\n')
+		r->di.name[j] = ' ';
+	p += l;
+	for(i = 0; i < 4; i++)
+	    get_uv(r->di.id[i]);
+	if(e - p < sizeof(r->di.keys) * 2 + sizeof(r->di.abs))
+	    return NULL;
+	memcpy(r->di.keys, p, sizeof(r->di.keys));
+	p += sizeof(r->di.keys);
+	memcpy(r->di.down, p, sizeof(r->di.down));
+	p += sizeof(r->di.down);
+	memcpy(r->di.abs, p, sizeof(r->di.abs));
+	p += sizeof(r->di.abs);
+	for(i = 0; i < ABS_CNT; i++)
+	    if(ISSET(r->di.abs, i))
+		for(j = 0; j < 6; j++)
+		    get_sv(r->di.ai[i][j]);
+	return p;
+      case REC_JS:
+      case REC_CLOSE:
+	return p;
+      case REC_EV:
+	get_sv(r->dt);
+	get_byte(r->type);
+	get_uv(r->code);
+	get_sv(r->value);
+	return p;
+      case REC_SYN:
+	get_sv(r->dt);
+	r->type = EV_SYN;
+	r->code = SYN_REPORT;
+	r->value = 0;
+	return p;
+      case REC_JSEV:
+	get_sv(r->dt);
+	get_byte(r->type);
+	get_byte(r->code);
+	get_sv(r->value);
+	return p;
+    }
+    return NULL;
+}
+
+static struct rdev {
+    int slot; /* fake device #, or -1 if not being played back */
+    int is_js, wfd, rfd;
+    long long t; /* recorded time of last event (us, or ms for js) */
+    long long t0; /* recorded time of first event */
+    double w0; /* when the first event was played back */
+    int nb; /* events waiting to be written */
+    union {
+	struct input_event ev[BATCH];
+	struct js_event js[BATCH];
+    } b;
+} dev[JRREC_MAXDEV];
+
+static char *slot_desc[NSLOT]; /* description each fake device was given */
+static int slot_used[NSLOT];
+static const char *dir;
+static int fast = 0, quiet = 0;
+static unsigned long nin = 0, nout = 0;
+static double t_read = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* description in the shim's EV_JOY_REMAP_FAKE format */
+static char *make_desc(const struct devinfo *di)
+{
+    char *s;
+    size_t len;
+    FILE *f = open_memstream(&s, &len);
+    int i;
+    if(!f)
+	return NULL;
+    fprintf(f, "name %s\nid %llx %llx %llx %llx\n", di->name, di->id[0],
+	    di->id[1], di->id[2], di->id[3]);
+    for(i = 0; i < KEY_CNT; i++) {
+	if(ISSET(di->keys, i))
+	    fprintf(f, "key %d\n", i);
+	if(ISSET(di->down, i))
+	    fprintf(f, "down %d\n", i);
+    }
+    for(i = 0; i < ABS_CNT; i++)
+	if(ISSET(di->abs, i))
+	    fprintf(f, "abs %d %lld %lld %lld %lld %lld %lld\n", i, di->ai[i][1],
+		    di->ai[i][2], di->ai[i][3], di->ai[i][4], di->ai[i][5],
+		    di->ai[i][0]);
+    fclose(f);
+    return s;
+}
+
+/* Find a fake device for a recorded one.  The shim only reads a fake
+ * device's description once, so devices can only be reused for the same
+ * description. */
+static int get_slot(const struct devinfo *di, int is_js)
+{
+    char *desc = make_desc(di), path[300];
+    int i, n = is_js ? NJSSLOT : NSLOT;
+    FILE *f;
+    if(!desc) {
+	perror("desc");
+	return -1;
+    }
+    for(i = 0; i < n; i++)
+	if(!slot_used[i] && slot_desc[i] && !strcmp(slot_desc[i], desc)) {
+	    free(desc);
+	    slot_used[i] = 1;
+	    return i;
+	}
+    for(i = 0; i < n; i++)
+	if(!slot_desc[i])
+	    break;
+    if(i == n) {
+	free(desc);
+	return -1;
+    }
+    /* the data goes to fifoN; eventN and jsN are both links to it, so
+     * that only the program's opens are seen as fake devices */
+    sprintf(path, "%s/event%d.desc", dir, i);
+    if(!(f = fopen(path, "w")) || fputs(desc, f) == EOF || fclose(f)) {
+	perror(path);
+	free(desc);
+	return -1;
+    }
+    sprintf(path, "%s/fifo%d", dir, i);
+    if(mkfifo(path, 0600)) {
+	perror(path);
+	free(desc);
+	return -1;
+    }
+    for(n = 0; n < 2 && (!n || i < NJSSLOT); n++) {
+	char link[300];
+	sprintf(path, "fifo%d", i);
+	sprintf(link, "%s/%s%d", dir, n ? "js" : "event", i);
+	if(symlink(path, link)) {
+	    perror(link);
+	    free(desc);
+	    return -1;
+	}
+    }
+    slot_desc[i] = desc;
+    slot_used[i] = 1;
+    return i;
+}
+
+/* print whatever the shim has for a device */
+static void drain(struct rdev *rd)
+{
+    union {
+	struct input_event ev[BATCH];
+	struct js_event js[BATCH];
+    } b;
+    int ev_size = rd->is_js ? sizeof(struct js_event) : sizeof(struct input_event);
+    int n, i;
+    while(1) {
+	double t0 = now();
+	n = read(rd->rfd, &b, sizeof(b));
+	t_read += now() - t0;
+	if(n <= 0)
+	    break;
+	n /= ev_size;
+	nout += n;
+	if(quiet)
+	    continue;
+	for(i = 0; i < n; i++)
+	    if(rd->is_js)
+		printf("%d %d %d %d\n", (int)(rd - dev), b.js[i].type,
+		       b.js[i].number, b.js[i].value);
+	    else
+		printf("%d %d %d %d\n", (int)(rd - dev), b.ev[i].type,
+		       b.ev[i].code, b.ev[i].value);
+    }
+}
+
+/* feed waiting events to the device, and print what comes out */
+static void flush(struct rdev *rd)
+{
+    int ev_size = rd->is_js ? sizeof(struct js_event) : sizeof(struct input_event);
+    int i;
+    if(!rd->nb)
+	return;
+    if(!fast) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	for(i = 0; i < rd->nb; i++)
+	    if(rd->is_js)
+		rd->b.js[i].time = now() / 1e6;
+	    else
+		rd->b.ev[i].time = tv;
+    }
+    /* the FIFO holds far more than a batch, and is always drained */
+    if(write(rd->wfd, &rd->b, rd->nb * ev_size) != rd->nb * ev_size)
+	perror("write");
+    nin += rd->nb;
+    rd->nb = 0;
+    drain(rd);
+}
+
+/* wait until time t (from now()), printing anything generated meanwhile
+ * (e.g. autofire) */
+static void wait_until(double t)
+{
+    struct pollfd pfd[JRREC_MAXDEV];
+    struct rdev *pd[JRREC_MAXDEV];
+    double left;
+    int n, i;
+    while((left = t - now()) > 0) {
+	for(i = n = 0; i < JRREC_MAXDEV; i++)
+	    if(dev[i].slot >= 0) {
+		pfd[n].fd = dev[i].rfd;
+		pfd[n].events = POLLIN;
+		pd[n++] = &dev[i];
+	    }
+	if(poll(pfd, n, left / 1e6 + 1) <= 0)
+	    continue;
+	for(i = 0; i < n; i++)
+	    if(pfd[i].revents & POLLIN)
+		drain(pd[i]);
+    }
+}
+
+static void close_dev(struct rdev *rd)
+{
+    flush(rd);
+    close(rd->rfd);
+    close(rd->wfd);
+    slot_used[rd->slot] = 0;
+    rd->slot = -1;
+}
+
+/* start playing back a device; is_js if it was opened as a js device */
+static void open_dev(int d, const struct devinfo *di, int is_js)
+{
+    struct rdev *rd = &dev[d];
+    char path[300];
+    memset(rd, 0, sizeof(*rd));
+    if((rd->slot = get_slot(di, is_js)) < 0) {
+	fprintf(stderr, "device %d (%s):  too many devices; ignored\n", d, di->name);
+	return;
+    }
+    rd->is_js = is_js;
+    /* O_RDWR so the FIFO never blocks or reports EOF */
+    sprintf(path, "%s/fifo%d", dir, rd->slot);
+    if((rd->wfd = open(path, O_RDWR | O_NONBLOCK)) < 0) {
+	perror(path);
+	slot_used[rd->slot] = 0;
+	rd->slot = -1;
+	return;
+    }
+    sprintf(path, "%s/%s%d", dir, is_js ? "js" : "event", rd->slot);
+    if((rd->rfd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
+	/* e.g. rejected by a filter */
+	if(!quiet)
+	    printf("# %d: %s: %s\n", d, di->name, strerror(errno));
+	close(rd->wfd);
+	slot_used[rd->slot] = 0;
+	rd->slot = -1;
+	return;
+    }
+    if(!quiet)
+	printf("# %d: %s%s\n", d, di->name, is_js ? " (js)" : "");
+}
+
+/* was device d opened as a js device?  The shim records the switch just
+ * after the device, but other threads' events may come in between. */
+static int is_js_dev(const unsigned char *p, const unsigned char *e, int d)
+{
+    static struct rec r;
+    while((p = rec_get(p, e, &r)))
+	if(r.dev == d)
+	    return r.tag == REC_JS;
+    return 0;
+}
+
+static int replay(const char *fn)
+{
+    static struct rec r;
+    const unsigned char *m, *p, *e, *np;
+    struct rdev *rd, *cur = NULL;
+    struct stat st;
+    int fd, i;
+    double t;
+
+    if((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st) || !st.st_size ||
+       (m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+	perror(fn);
+	return 1;
+    }
+    close(fd);
+    if(st.st_size < sizeof(JRREC_MAGIC) || memcmp(m, JRREC_MAGIC, sizeof(JRREC_MAGIC))) {
+	fprintf(stderr, "%s: not a recording\n", fn);
+	return 1;
+    }
+    e = m + st.st_size;
+    for(i = 0; i < JRREC_MAXDEV; i++)
+	dev[i].slot = -1;
+    for(p = m + sizeof(JRREC_MAGIC); (np = rec_get(p, e, &r)); p = np) {
+	rd = &dev[r.dev];
+	if(r.tag == REC_DEV) {
+	    if(rd->slot >= 0)
+		close_dev(rd);
+	    open_dev(r.dev, &r.di, is_js_dev(np, e, r.dev));
+	    continue;
+	}
+	if(rd->slot < 0 || r.tag == REC_JS)
+	    continue;
+	if(r.tag == REC_CLOSE) {
+	    close_dev(rd);
+	    if(cur == rd)
+		cur = NULL;
+	    continue;
+	}
+	/* events; r.tag matches rd->is_js unless the file is corrupt */
+	if(cur && cur != rd)
+	    flush(cur);
+	cur = rd;
+	if(rd->is_js)
+	    rd->t = (__u32)(rd->t + r.dt);
+	else
+	    rd->t += r.dt;
+	if(!fast) {
+	    if(!rd->w0) {
+		rd->t0 = rd->t;
+		rd->w0 = now();
+	    }
+	    t = rd->w0 + (rd->t - rd->t0) * (rd->is_js ? 1e6 : 1e3);
+	    if(t > now()) {
+		flush(rd);
+		wait_until(t);
+	    }
+	}
+	if(rd->is_js) {
+	    struct js_event *js = &rd->b.js[rd->nb++];
+	    js->time = rd->t;
+	    js->type = r.type;
+	    js->number = r.code;
+	    js->value = r.value;
+	} else {
+	    struct input_event *ev = &rd->b.ev[rd->nb++];
+	    ev->time.tv_sec = rd->t / 1000000;
+	    ev->time.tv_usec = rd->t % 1000000;
+	    ev->type = r.type;
+	    ev->code = r.code;
+	    ev->value = r.value;
+	}
+	if(rd->nb == BATCH || (!rd->is_js && r.tag == REC_SYN))
+	    flush(rd);
+    }
+    if(p < e && *p)
+	fprintf(stderr, "%s: corrupt at offset %ld\n", fn, (long)(p - m));
+    /* give timers (chords, autofire) a chance to finish */
+    if(cur)
+	flush(cur);
+    for(i = 0; i < 10; i++) {
+	unsigned long n = nout;
+	wait_until(now() + 100e6);
+	if(n == nout)
+	    break;
+    }
+    for(i = 0; i < JRREC_MAXDEV; i++)
+	if(dev[i].slot >= 0)
+	    close_dev(&dev[i]);
+    fflush(stdout);
+    fprintf(stderr, "%lu events in, %lu out, %.1f ns/event read\n", nin, nout,
+	    nin ? t_read / nin : 0);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char tmpl[] = "/tmp/joy-remap-replay.XXXXXX", path[300];
+    const char *child = NULL;
+    int verbose = 0, usage = 0, opt, status;
+    struct dirent *de;
+    pid_t pid;
+    DIR *d;
+
+    while((opt = getopt(argc, argv, "fqvC:")) != -1)
+	switch(opt) {
+	  case 'f': fast = 1; break;
+	  case 'q': quiet = 1; break;
+	  case 'v': verbose = 1; break;
+	  case 'C': child = optarg; break; /* internal:  fake dir */
+	  default: usage = 1;
+	}
+    if(usage || optind != argc - 1) {
+	fprintf(stderr, "usage: LD_PRELOAD=joy-remap.so joy-remap-replay [-f] [-q] [-v] file\n");
+	return 1;
+    }
+    if(child) {
+	dir = child;
+	return replay(argv[optind]);
+    }
+    /* the shim only looks at the environment at startup, so re-exec */
+    if(!(dir = mkdtemp(tmpl))) {
+	perror(tmpl);
+	return 1;
+    }
+    if((pid = fork()) < 0) {
+	perror("fork");
+	return 1;
+    }
+    if(!pid) {
+	char *args[8];
+	int n = 0;
+	setenv("EV_JOY_REMAP_FAKE", dir, 1);
+	/* don't record the playback, possibly over the recording */
+	unsetenv("EV_JOY_REMAP_RECORD");
+	if(!verbose)
+	    setenv("EV_JOY_REMAP_LOG", "/dev/null", 1);
+	args[n++] = argv[0];
+	args[n++] = "-C";
+	args[n++] = (char *)dir;
+	if(fast)
+	    args[n++] = "-f";
+	if(quiet)
+	    args[n++] = "-q";
+	args[n++] = argv[optind];
+	args[n] = NULL;
+	execv("/proc/self/exe", args);
+	perror("exec");
+	_exit(1);
+    }
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+	status = 1;
+    else
+	status = WEXITSTATUS(status);
+    if((d = opendir(dir))) {
+	while((de = readdir(d)))
+	    if(de->d_name[0] != '.') {
+		sprintf(path, "%s/%.200s", dir, de->d_name);
+		unlink(path);
+	    }
+	closedir(d);
+    }
+    rmdir(dir);
+    return status;
+}
@@ -0,0 +1,108 @@
+/*
+ * Exhaustive check of joy-remap's axis rescaling (joy-remap-rescale.h).
+ * The fixed-point path must give exactly what the plain formula
+ *   (v - omin) * nrange / orange + nmin
+ * gives, for every value.  This runs both over every input value of a
+ * set of typical and awkward input and output ranges, plus 4096 values
+ * either side, with and without inversion, and reports any mismatch.
+ * Values for which the plain formula itself overflows are skipped.
+ *
+ * To build:
+ *     gcc -s -Wall -O2 -o joy-remap-rescale-check{,.c}
+ *
+ * To use:
+ *     joy-remap-rescale-check [-w]
+ * Options:
+ *     -w  also sweep [INT_MIN / 2, INT_MAX / 2] for the first few ranges
+ *         (8-bit, 10-bit and 16-bit pads); this takes several minutes
+ *
+ * It prints the number of values checked, the number of mismatches (and
+ * the first few), and how many of the range pairs take the fixed-point
+ * path.  The exit status is 1 if anything mismatched.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "joy-remap-rescale.h"
+
+#define NEL(a) (sizeof(a) / sizeof((a)[0]))
+
+/* input ranges as reported by devices */
+static const int in[][2] = {
+    { 0, 255 }, { 0, 1023 }, { -32768, 32767 }, /* swept with -w */
+    { -1, 1 }, { 0, 65535 }, { -(1 << 20), 1 << 20 }, { 0, 4095 },
+    { -512, 511 }, { 0, 1 }, { -128, 127 }, { 0, (1 << 24) - 1 },
+    { -100000, 100000 }
+};
+#define NWIDE 3
+/* output ranges as given in configurations */
+static const int out[][2] = {
+    { -32768, 32767 }, { 0, 255 }, { -1, 1 }, { 0, 1 },
+    { -(1 << 30), 1 << 30 }, { 0, 1000000 }, { -127, 127 }, { 0, 65535 },
+    { -2147483647, 2147483647 }, { 5, 6 }, { -7, 1000 }
+};
+
+/* the plain formula, as the shim would do it without mul; returns 0 if
+ * it overflows for v (or, in the shim, would) */
+static int plain(const struct jrscale *x, int v, int *res)
+{
+    long long dv = (long long)v - x->omin;
+    if(dv > INT_MAX || dv < INT_MIN ||
+       dv > LONG_MAX / x->nrange || dv < LONG_MIN / x->nrange)
+	return 0;
+    v = (v - x->omin) * x->nrange / x->orange + x->nmin;
+    if(x->invert)
+	v = x->nsum - v;
+    *res = v;
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long n = 0, bad = 0;
+    int wide = 0, nfast = 0, opt, a, b, inv;
+
+    while((opt = getopt(argc, argv, "w")) != -1)
+	switch(opt) {
+	  case 'w': wide = 1; break;
+	  default:
+	    fprintf(stderr, "usage: joy-remap-rescale-check [-w]\n");
+	    return 1;
+	}
+    for(a = 0; a < NEL(in); a++)
+	for(b = 0; b < NEL(out); b++)
+	    for(inv = 0; inv < 2; inv++) {
+		struct jrscale x;
+		long long v, lo, hi;
+		int r, want;
+		memset(&x, 0, sizeof(x));
+		x.omin = in[a][0];
+		x.orange = (long)in[a][1] - in[a][0] + 1;
+		x.nmin = out[b][0];
+		x.nrange = (long)out[b][1] - out[b][0] + 1;
+		x.nsum = out[b][0] + out[b][1];
+		x.invert = inv;
+		rescale_setup(&x);
+		nfast += !!x.mul;
+		lo = (long long)in[a][0] - 4096;
+		hi = (long long)in[a][1] + 4096;
+		if(wide && a < NWIDE && b < NWIDE) {
+		    lo = INT_MIN / 2;
+		    hi = INT_MAX / 2;
+		}
+		for(v = lo; v <= hi; v++) {
+		    if(!plain(&x, v, &want))
+			continue;
+		    n++;
+		    if((r = rescale(&x, v)) != want && bad++ < 10)
+			printf("in %d..%d out %d..%d%s: %lld -> %d, not %d\n",
+			       in[a][0], in[a][1], out[b][0], out[b][1],
+			       inv ? " inverted" : "", v, r, want);
+		}
+	    }
+    printf("%llu values checked, %llu mismatches; %d of %d range pairs "
+	   "use fixed point\n", n, bad, nfast, (int)(2 * NEL(in) * NEL(out)));
+    return !!bad;
+}
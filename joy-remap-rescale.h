@@ -0,0 +1,59 @@
+/*
+ * Axis rescaling shared by joy-remap.so and joy-remap-rescale-check.
+ * Rescaling is (v - omin) * nrange / orange + nmin.  Rather than doing
+ * a 64-bit divide per event (a libgcc call on 32-bit), in-range values
+ * use a fixed-point reciprocal:  for 0 <= q < orange,
+ *   q * nrange / orange == (q * mul) >> shift
+ * exactly, if mul = ceil(nrange * 2^shift / orange) and
+ * 2^shift >= orange^2 (the rounding error q * (mul * orange -
+ * nrange * 2^shift) / 2^shift is then less than 1 / orange, which can't
+ * carry into the integer part).  Out-of-range values, and ranges too
+ * large for this to fit in 64 bits, still divide, so results are
+ * always identical to the plain formula.  joy-remap-rescale-check
+ * verifies that; run it after changing anything here.
+ */
+#ifndef JOY_REMAP_RESCALE_H
+#define JOY_REMAP_RESCALE_H
+
+struct jrscale {
+    int omin, nmin; /* input and output minimum */
+    long orange, nrange; /* input and output max - min + 1 */
+    int nsum; /* output min + max */
+    char invert; /* invert after scaling? */
+    char shift; /* fixed-point scale is mul >> shift */
+    unsigned long long mul; /* 0 if always dividing */
+};
+
+/* fill in mul and shift; the rest must be set already */
+static void rescale_setup(struct jrscale *x)
+{
+    unsigned long long d = x->orange, nr = x->nrange;
+    int s = 0;
+    x->mul = 0;
+    /* also make sure plain long math (32 bits on i386) wouldn't overflow
+     * in range, or results could differ from the formula */
+    if(x->orange <= 0 || x->nrange <= 0 || (d - 1) * nr > (unsigned long)-1 / 2)
+	return;
+    while(s < 63 && (1ULL << s) < d * d)
+	s++;
+    /* q * mul < nr * 2^s + d must not overflow */
+    if(s >= 63 || nr > (~0ULL - d) >> s)
+	return;
+    x->shift = s;
+    x->mul = ((nr << s) + d - 1) / d;
+}
+
+/* rescale and invert value */
+static inline int rescale(const struct jrscale *x, int v)
+{
+    unsigned long long q = (unsigned)v - (unsigned)x->omin;
+    if(q < x->orange && x->mul)
+	v = (int)((q * x->mul) >> x->shift) + x->nmin;
+    else
+	v = (v - x->omin) * x->nrange / x->orange + x->nmin;
+    if(x->invert)
+	v = x->nsum - v;
+    return v;
+}
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Watch the live statistics of a program running with joy-remap.so, in
+ * the style of vmstat.  The program must have been started with
+ * EV_JOY_REMAP_STATS set (to anything).  Nothing is written to disk by
+ * the shim; the counters live in /dev/shm/joy-remap.<pid>.
+ *
+ * To build:
+ *     gcc -s -Wall -O2 -o joy-remap-stat{,.c}
+ *
+ * To use:
+ *     joy-remap-stat [-i] [<pid> [<delay> [<count>]]]
+ *
+ * If no pid is given, and only one program is running with statistics
+ * enabled, that one is used.  The first line is totals since the program
+ * started; after that, each line is the change over <delay> seconds
+ * (default 1), until <count> lines have been printed or the program
+ * exits.  -i instead prints the totals, including ioctls on captured
+ * devices by request, and exits.
+ *
+ * Columns:
+ *   reads   read()s of captured devices
+ *   in/out  events read from the devices, and returned to the program
+ *   mod     events changed by a mapping
+ *   drop    events dropped (or turned into SYN_DROPPED)
+ *   inj     events added (axis to buttons, autofire, chords)
+ *   open/cap/rej  opens of input devices, intercepted, and refused
+ *   ioctl   ioctls on captured devices
+ *   lock/wait/us  global lock acquisitions, contended ones, and the
+ *           time spent waiting in microseconds
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "joy-remap-stat.h"
+
+/* names for ioctl request numbers; gets and sets often share one */
+static const char *ev_ioctl_name(int nr)
+{
+    static char nm[20];
+    switch(nr) {
+      case 0x01: return "GVERSION";
+      case 0x02: return "GID";
+      case 0x03: return "GREP/SREP";
+      case 0x04: return "GKEYCODE/SKEYCODE";
+      case 0x06: return "GNAME";
+      case 0x07: return "GPHYS";
+      case 0x08: return "GUNIQ";
+      case 0x09: return "GPROP";
+      case 0x0a: return "GMTSLOTS";
+      case 0x18: return "GKEY";
+      case 0x19: return "GLED";
+      case 0x1a: return "GSND";
+      case 0x1b: return "GSW";
+      case 0x80: return "SFF";
+      case 0x81: return "RMFF";
+      case 0x84: return "GEFFECTS";
+      case 0x90: return "GRAB";
+      case 0x91: return "REVOKE";
+      case 0x92: return "GMASK";
+      case 0x93: return "SMASK";
+      case 0xa0: return "SCLOCKID";
+    }
+    if(nr >= 0x20 && nr < 0x40)
+	sprintf(nm, "GBIT(%d)", nr - 0x20);
+    else if(nr >= 0x40 && nr < 0x80)
+	sprintf(nm, "GABS(%d)", nr - 0x40);
+    else if(nr >= 0xc0)
+	sprintf(nm, "SABS(%d)", nr - 0xc0);
+    else
+	sprintf(nm, "0x%02x", nr);
+    return nm;
+}
+
+static const char *js_ioctl_name(int nr)
+{
+    static char nm[8];
+    switch(nr) {
+      case 0x01: return "GVERSION";
+      case 0x11: return "GAXES";
+      case 0x12: return "GBUTTONS";
+      case 0x13: return "GNAME";
+      case 0x21: return "SCORR";
+      case 0x22: return "GCORR";
+      case 0x31: return "SAXMAP";
+      case 0x32: return "GAXMAP";
+      case 0x33: return "SBTNMAP";
+      case 0x34: return "GBTNMAP";
+    }
+    sprintf(nm, "0x%02x", nr);
+    return nm;
+}
+
+/* find the only running program with statistics enabled */
+static int find_pid(void)
+{
+    DIR *d = opendir("/dev/shm");
+    struct dirent *de;
+    int pid[16], p, n = 0, i;
+    if(!d) {
+	perror("/dev/shm");
+	exit(1);
+    }
+    while((de = readdir(d)))
+	if(sscanf(de->d_name, "joy-remap.%d", &p) == 1 &&
+	   (!kill(p, 0) || errno != ESRCH) && n < 16)
+	    pid[n++] = p;
+    closedir(d);
+    if(n == 1)
+	return pid[0];
+    if(!n)
+	fprintf(stderr, "no programs running with EV_JOY_REMAP_STATS\n");
+    else {
+	fprintf(stderr, "multiple programs; pick one of:");
+	for(i = 0; i < n; i++)
+	    fprintf(stderr, " %d", pid[i]);
+	fputc('\n', stderr);
+    }
+    exit(1);
+}
+
+static uint32_t ioctl_total(const struct jrstat *s)
+{
+    uint32_t n = 0;
+    int i, j;
+    for(i = 0; i < 2; i++)
+	for(j = 0; j < 256; j++)
+	    n += s->ioctl[i][j];
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int info = 0, pid, fd, delay = 1, count = 0, line, i, j;
+    char fn[40];
+    struct jrstat *st, cur, prev = {};
+
+    if(argc > 1 && !strcmp(argv[1], "-i")) {
+	info = 1;
+	argv++;
+	argc--;
+    }
+    if(argc > 4 || (argc > 1 && argv[1][0] == '-')) {
+	fprintf(stderr, "usage: joy-remap-stat [-i] [<pid> [<delay> [<count>]]]\n");
+	return 1;
+    }
+    pid = argc > 1 ? atoi(argv[1]) : find_pid();
+    if(argc > 2 && (delay = atoi(argv[2])) < 1)
+	delay = 1;
+    if(argc > 3)
+	count = atoi(argv[3]);
+    sprintf(fn, JRSTAT_PATH, pid);
+    if((fd = open(fn, O_RDONLY)) < 0) {
+	perror(fn);
+	return 1;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(st == MAP_FAILED) {
+	perror(fn);
+	return 1;
+    }
+    if(__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) != JRSTAT_MAGIC ||
+       st->version != JRSTAT_VERSION || st->size != sizeof(*st)) {
+	fprintf(stderr, "%s: not a compatible statistics file\n", fn);
+	return 1;
+    }
+    if(info) {
+	cur = *st;
+	printf("reads %u\nevents in %u out %u modified %u dropped %u injected %u\n"
+	       "opens %u captured %u rejected %u\n"
+	       "lock acquired %u contended %u waited %uus\n",
+	       cur.reads, cur.ev_in, cur.ev_out, cur.ev_mod, cur.ev_drop,
+	       cur.ev_inject, cur.opens, cur.captured, cur.rejected,
+	       cur.lock_acq, cur.lock_wait, cur.lock_wait_us);
+	for(i = 0; i < 2; i++)
+	    for(j = 0; j < 256; j++)
+		if(cur.ioctl[i][j])
+		    printf("%s%s %u\n", i ? "JSIOC" : "EVIOC",
+			   i ? js_ioctl_name(j) : ev_ioctl_name(j), cur.ioctl[i][j]);
+	return 0;
+    }
+    /* differences are unsigned 32-bit, so counters may wrap */
+    for(line = 0; !count || line < count; line++) {
+	if(!(line % 20))
+	    printf("%8s %8s %8s %7s %7s %7s %4s %4s %4s %6s %7s %5s %7s\n",
+		   "reads", "in", "out", "mod", "drop", "inj", "open", "cap",
+		   "rej", "ioctl", "lock", "wait", "us");
+	cur = *st;
+	printf("%8u %8u %8u %7u %7u %7u %4u %4u %4u %6u %7u %5u %7u\n",
+	       cur.reads - prev.reads, cur.ev_in - prev.ev_in,
+	       cur.ev_out - prev.ev_out, cur.ev_mod - prev.ev_mod,
+	       cur.ev_drop - prev.ev_drop, cur.ev_inject - prev.ev_inject,
+	       cur.opens - prev.opens, cur.captured - prev.captured,
+	       cur.rejected - prev.rejected, ioctl_total(&cur) - ioctl_total(&prev),
+	       cur.lock_acq - prev.lock_acq, cur.lock_wait - prev.lock_wait,
+	       cur.lock_wait_us - prev.lock_wait_us);
+	fflush(stdout);
+	prev = cur;
+	if(count && line + 1 >= count)
+	    break;
+	sleep(delay);
+	/* the file is removed at exit, but crashes leave it behind */
+	if(access(fn, F_OK) || (kill(pid, 0) && errno == ESRCH)) {
+	    printf("process %d exited\n", pid);
+	    break;
+	}
+    }
+    return 0;
+}
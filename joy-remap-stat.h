@@ -0,0 +1,39 @@
+/*
+ * Live statistics shared between joy-remap.so and joy-remap-stat.
+ * If EV_JOY_REMAP_STATS is set, the shim creates JRSTAT_PATH (with its
+ * PID filled in) and updates the counters below in place with relaxed
+ * atomic adds.  It removes the file at exit.
+ *
+ * All counters only ever increase, and are 32 bits so that they are
+ * atomic and laid out the same in 32-bit and 64-bit processes.  Readers
+ * should only look at differences, which survive wrapping.
+ */
+#ifndef JOY_REMAP_STAT_H
+#define JOY_REMAP_STAT_H
+
+#include <stdint.h>
+
+#define JRSTAT_PATH "/dev/shm/joy-remap.%d"
+#define JRSTAT_MAGIC 0x4a525354 /* "JRST" */
+#define JRSTAT_VERSION 1
+
+struct jrstat {
+    uint32_t magic, version, size; /* size is sizeof(struct jrstat) */
+    int32_t pid;
+    uint32_t reads; /* read()s of captured fds */
+    uint32_t ev_in; /* events read from devices */
+    uint32_t ev_out; /* events returned to the program */
+    uint32_t ev_mod; /* events changed by a mapping */
+    uint32_t ev_drop; /* events dropped or turned into SYN_DROPPED */
+    uint32_t ev_inject; /* events added (axis->buttons, autofire, chords) */
+    uint32_t opens; /* opens of input devices */
+    uint32_t captured; /* opens which were intercepted */
+    uint32_t rejected; /* opens which were refused (filtered devices) */
+    uint32_t lock_acq; /* acquisitions of the global lock */
+    uint32_t lock_wait; /* acquisitions which had to wait */
+    uint32_t lock_wait_us; /* total time spent waiting */
+    /* ioctls on captured fds, by _IOC_NR(); [0] is evdev, [1] is js */
+    uint32_t ioctl[2][256];
+};
+
+#endif
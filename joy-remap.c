@@ -6,32 +6,72 @@
  * using uinput.  It's very simplistic, intended to map exactly one
  * controller to what one program expects to see.  Since it supports multiple
  * opens of multiple devices, it should work with multiple controllers and
- * in-game hotplugging.  Internal support for hot-plugging, or at least
- * persistence in the face of temporary disconnects, really requires uinput,
- * since every possible use of the file descriptor would otherwise have to be
- * intercepted.  It is also unable to merge multiple devices into one, such
- * as mapping the Dualshock 3+ motion sensors into the main controller.
- * It also doesn't support adding autofire and chording.  Since it happens
- * at the user level, js devices associated with the same gamepad will not
- * be affected, unless they use the built-in jsremap feature.  I used to say
- * to use jscal for that, but jscal has global effect and doesn't support
- * e.g. axis-to-button or vice-versa.  I also support only overriding the
- * name of a js device in case a game uses name-based heuristics.  Really,
- * given that js devices have never supported force feedback, and likely
- * never will, new programs should not be using them, in the first place.
- * Of course Linux doesn't exactly make it easy to figure out which event
- * device(s) to use, either.  Don't even get me started on LEDs.
+ * in-game hotplugging.  Internal support for hot-plugging really requires
+ * uinput, since every possible use of the file descriptor would otherwise
+ * have to be intercepted.  Persistence in the face of temporary
+ * disconnects is possible, though, by handing the program a socket
+ * instead of the device (see persist below).  It can also merge other
+ * devices into a captured one, such as the Dualshock 3+ motion sensors
+ * into the main controller.
+ * Autofire and chords can be added as well (see autofire and chord
+ * below).  Since it happens at the user level, js devices associated with
+ * the same gamepad will not be affected, unless they use the built-in
+ * jsremap feature.  I used to say to use jscal for that, but jscal has
+ * global effect and doesn't support e.g. axis-to-button or vice-versa.
+ * I also support only overriding the name of a js device in case a game
+ * uses name-based heuristics.  Really, given that js devices have never
+ * supported force feedback, and likely never will, new programs should
+ * not be using them, in the first place.  Of course Linux doesn't exactly
+ * make it easy to figure out which event device(s) to use, either.  Don't
+ * even get me started on LEDs.
  *
  * Some messages are normally printed to stderr.  In order to catch them
  * even if the program redirects stderr, or if you just want them stored
  * elsewhere, set EV_JOY_REMAP_LOG to something else.  To hide, just set
- * to /dev/null.  To see even if redirected, set to /dev/tty.
+ * to /dev/null.  To see even if redirected, set to /dev/tty.  Messages
+ * are written by a separate thread, so they may show up a little late.
+ * Any one message is printed at most 64 times a second; the rest are
+ * counted and reported.  EV_JOY_REMAP_LOG_LEVEL can be set to 0 (errors
+ * only), 1 (and warnings), 2 (and opens, closes and other events), or 3
+ * (and altered ioctl results, the default).
+ *
+ * To find out whether input lag comes from this shim or from the program,
+ * set EV_JOY_REMAP_LATENCY.  Every event returned by read() is then
+ * compared against its kernel time stamp (in whatever clock was selected
+ * with EVIOCSCLOCKID), and a log2 histogram per device and event type is
+ * printed to the log when the device is closed or the program exits.  If
+ * the value is a number of seconds, the histograms are also printed that
+ * often (cumulatively) while events are being read.  This does not work
+ * for js devices, whose time stamps can't be compared to any clock.
+ *
+ * To watch what the shim is doing in a running program without any file
+ * I/O in its hot paths, set EV_JOY_REMAP_STATS.  Counters for events,
+ * opens, ioctls and lock contention are then kept in
+ * /dev/shm/joy-remap.<pid>, which joy-remap-stat (built from
+ * joy-remap-stat.c) displays.  See joy-remap-stat.h for what is counted.
+ *
+ * For testing without hardware, EV_JOY_REMAP_FAKE can name a directory
+ * whose eventN and jsN files (e.g. FIFOs) are treated as devices; see
+ * fake_open() below.  joy-remap-bench.c uses this to benchmark
+ * configurations.  To capture real input for later, set
+ * EV_JOY_REMAP_RECORD to a file name.  Everything read from captured
+ * devices is written there, and joy-remap-replay (built from
+ * joy-remap-replay.c) can play it back through any configuration, either
+ * at the original speed or as fast as possible.
  *
  * There are many ways an event device can be accessed.  Following the
  * open, the only methods supported are read and ioctl.  The actual
  * method of opening is expected to be open/open64, finished by close.
+ * Since a single input event may produce more than one output event,
+ * events which do not fit into the read buffer are queued, and poll,
+ * ppoll, select, pselect, epoll_wait and epoll_pwait are intercepted
+ * to report the device as readable while anything is queued.
  * The CAP_* defines below can also be used to enable other methods:
- * openat/openat64, fopen/fclose, and syscall(open,openat).  There are
+ * openat/openat64, fopen/fclose, and syscall(open,openat).  Only opens
+ * of paths in /dev, /proc or the EV_JOY_REMAP_FAKE directory (or relative
+ * paths while the current directory is one of those) are checked for
+ * being devices, so a device reached through a symlink elsewhere is
+ * missed unless EV_JOY_REMAP_CHECK_ALL is set.  There are
  * also many ways this entire shim can be disabled.  For example:
  * explicit symbol lookups from libc, forking after unsetting LD_PRELOAD,
  * use of an unsupported access method, and explicitly dlopen()ing libc.
@@ -56,6 +96,20 @@
  * enabled sections' disabled devices (i.e., if any section enables it,
  * it is enabled).
  *
+ * The configuration is not read (nor the log opened) until the program
+ * first opens an input device, so processes which never do (and wine
+ * alone starts dozens) pay almost nothing for the shim.  Sections
+ * disabled by EV_JOY_REMAP_ENABLE never have their patterns compiled,
+ * so errors in them are not reported.  Since every process which does
+ * open a device still reads the configuration, the parsed configuration
+ * is cached in $XDG_CACHE_HOME (or ~/.cache) as ev_joy_remap.<hash>, one
+ * file per configuration file.  It is only parsed again if the file's
+ * contents, size or time stamp change.  Which section (if any) matched
+ * each event device is kept next to it in ev_joy_remap.<hash>.match, so
+ * that the patterns need not be run again every time the same device is
+ * opened, by this process or any other.  EV_JOY_REMAP_CACHE names a
+ * different directory for the cache; set it to nothing to disable it.
+ *
  * Keywords are:
  *
  * section <name>
@@ -92,6 +146,46 @@
  *   either name matches the accept pattern, it is allowed.  Otherwise, it
  *   is rejected.
  *
+ * merge <pattern>
+ *   Merge other event devices into the captured one.  When a device is
+ *   captured by this section, every other event device either of whose
+ *   names (as for match) matches this regular expression is opened as
+ *   well, up to 3 of them.  Their events are returned by the captured
+ *   device's read()s, a SYN_REPORT-terminated frame at a time in time
+ *   stamp order, and the poll() family reports the captured device as
+ *   readable when any of them is.  Their buttons and axes are added to
+ *   what EVIOCGBIT, EVIOCGKEY and EVIOCGABS report, except for ones the
+ *   captured device (or an earlier merged one) already has, whose events
+ *   still get through.  Each merged device is first remapped by the
+ *   section which matches it, if any, so that conflicting axes and
+ *   buttons can be moved out of the way there; autofire and chords do
+ *   not apply to it, though, nor is it recorded.  Only devices present
+ *   when the captured device is opened are merged, and they are not
+ *   hidden from the program (filter does that for devices no section
+ *   matches).
+ *
+ * persist
+ *   Keep the captured device across disconnects, such as a wireless pad
+ *   going to sleep or out of range.  The program gets one end of a socket
+ *   pair instead of the device, and a private thread copies events from
+ *   the device to it and anything the program writes (force feedback,
+ *   LEDs) back.  When the device goes away, held buttons are released
+ *   and axes return to where they were at open, and ioctls are answered
+ *   from what the device reported at open.  As soon as a device with the
+ *   same name, ID and unique ID shows up again, it is read instead, and a
+ *   SYN_DROPPED tells the program to query the state again.  Uploaded
+ *   force feedback effects are lost, though, and a child process can't
+ *   read the socket after fork().  Programs which fstat() the device will
+ *   see a socket.
+ *
+ * feed
+ *   Like persist, give the program a socket fed by a private thread, but
+ *   have that thread do the remapping (and autofire and chords) as well,
+ *   so that none of it happens in the program's read()s.  This helps
+ *   programs which read input in their rendering thread.  Without
+ *   persist, the program reads end-of-file when the device goes away.
+ *   This is ignored for sections which merge devices.
+ *
  * name <name>
  *   Replace the advertised name of the device.  There is no way to change
  *   the version number right now, as I don't know of any software that
@@ -225,6 +319,41 @@
  * syn_drop
  *   When dropping events, rather than just removing them from the stream,
  *   send SYN_DROP events.
+ *
+ * autofire <list>
+ *   While the given output buttons are held, repeatedly release and press
+ *   them.  Each comma-separated list entry is an output button, as for the
+ *   buttons keyword, followed by an equals sign, followed by the rate in
+ *   presses per second (Hz, 0.1 to 500, fractions allowed).  The first
+ *   press is sent immediately, the following release half a period later,
+ *   and so on.  Only button-to-button mappings (including pass-through)
+ *   are affected.  At most 8 buttons per section may have autofire.  The
+ *   timing is done with a private timerfd, which the poll() family treats
+ *   as part of the device, so no signals or threads are involved.
+ *
+ * chord <list>
+ *   Map combinations of buttons to a separate output button.  Each
+ *   comma-separated list entry is an output button, followed by an equals
+ *   sign, followed by 2 to 4 buttons separated by plus signs, e.g.
+ *   mode=tl+a.  All buttons are output buttons, as for the buttons keyword,
+ *   so chords apply after remapping.  Presses of buttons used in chords
+ *   are held back until a chord is complete, or until the chord window has
+ *   passed (measured using event time stamps).  If it completes, the chord's
+ *   output is pressed instead, and released as soon as any of its buttons
+ *   is released.  Otherwise, the held back presses are sent as is.  A chord
+ *   whose buttons are all part of a larger chord is only sent at the end
+ *   of the window, or when one of its buttons is released.  A section may
+ *   have up to 8 chords using up to 32 distinct buttons.  Chord buttons do
+ *   not autofire.
+ *
+ * chord_window <ms>
+ *   The maximum time between the first and last press of a chord, and thus
+ *   the delay added to presses of buttons used in chords, in milliseconds
+ *   (fractions allowed).  The default is 5.  The window is measured from
+ *   the first press's time stamp, but held back presses are only sent
+ *   when the program reads again or a timer fires, so on a busy system
+ *   they may come a few milliseconds later than that.
+ *   joy-remap-chord-test measures it.
  * 
  * Note that for button-to-axis and axis-to-button mappings, the button press
  * or release event will not occur unless the state changes.  All buttons
@@ -268,21 +397,15 @@
  * generate no events, but allow one to insert dummy inputs for games that
  * ignore labels.  e.g. [axis=]none or [button=]none
  *
- * There is no chording support.
+ * It's possible to produce the same output from multiple inputs, but
+ * the only way to produce multiple outputs from the same input is an axis
+ * mapped to two buttons crossing both thresholds at once.  The per-fd event
+ * queue and poll(2) family interception are there for more, though.
  *
- * It's possible to produce the same output from multiple inputs, but not
- * to produce multiple outputs from the same input.  This might require
- * intercepting poll(2) and select(2).
+ * It's not possible to get inputs from sources other than event devices.
  *
- * It's not possible to get inputs from other sources.  This definitely
- * requires interception of poll(2) and select(2) for event injection.
- *
- * There is no auto-repeat (auto-fire) mode.  This would require event
- * injection, definitely requiring interception of poll(2) and select(2).
- * The timeouts for those two functions could be used to do the timing, but
- * the most reliable would require creating a timer as well, and hopefully
- * not having that timer interfere with the parent process in any way (e.g.
- * spurious signals).
+ * Autofire and chords only apply to button-to-button mappings, and there
+ * is no way to toggle them on and off while running.
  *
  * It's not possible to generate or intercept keyboard events.  This requires
  * interception of the input stream, which is generally standard input or
@@ -340,6 +463,18 @@
 #define read internal_read
 #include <unistd.h>
 #undef read
+/* same for poll() and ppoll() */
+#define poll internal_poll
+#define ppoll internal_ppoll
+#include <poll.h>
+#undef poll
+#undef ppoll
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <fcntl.h>
@@ -352,9 +487,18 @@
 #include <stddef.h>
 #include <regex.h>
 #include <dirent.h>
+#include <limits.h>
 /* why would you be scanning for devices in parallel?  Oh well, some
  * jackass will try and screw this up, so may as well support it */
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <stdint.h>
+#include "joy-remap-stat.h"
+#include "joy-remap-rec.h"
+#include "joy-remap-rescale.h"
 
 /* These numbers are not exported, and may change in the future */
 /* see linux/drivers/input/evdev.c and linux/drivers/input/joydev.c */
@@ -365,6 +509,26 @@
 #define JSDEV_NMINOR 16
 
 static FILE *logf;
+/* message levels; EV_JOY_REMAP_LOG_LEVEL hides everything above it */
+enum { JL_ERR, JL_WARN, JL_INFO, JL_DBG };
+static int log_level = JL_DBG;
+/* rate limit state for one jlog() call site (see log_put()) */
+struct logsite {
+    long sec; /* second (CLOCK_MONOTONIC_COARSE) being counted */
+    unsigned n; /* messages in that second */
+    unsigned dropped; /* suppressed since the last one that got through */
+    const char *fmt; /* for reporting drops at exit */
+    struct logsite *next; /* list of sites which ever dropped anything */
+    int listed;
+};
+static void log_put(struct logsite *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+/* messages are queued for a writer thread, so this never blocks on I/O */
+#define jlog(lvl, ...) do { \
+    static struct logsite _site; \
+    if((lvl) <= log_level) \
+	log_put(&_site, __VA_ARGS__); \
+} while(0)
 
 /* macros for accessing bits in arrays of unsigned longs */
 /* stupid kernel doesn't export its bitops, so everybody has to reimplement */
@@ -392,9 +556,9 @@ struct axmap {
 #define AXFL_MAP      (1<<0)  /* does this need processing? */
 #define AXFL_BUTTON   (1<<1)  /* is this a button map? else ax map */
 #define AXFL_INVERT   (1<<2)  /* invert before sending on? */
-                              /* onthresh is min+max if AXFL_INVERT */
 #define AXFL_RESCALE  (1<<3)  /* rescale using ai? */
 #define AXFL_NINVERT  (1<<4)  /* invert ntarget before sending out */
+/* the rest are only used in struct xlabs' per-device state */
 #define AXFL_PRESSED  (1<<5)  /* is the button currently pressed? */
                               /* defaults to no, even if axis says otherwise */
 #define AXFL_NPRESSED (1<<6)  /* is the neg button pressed? */
@@ -410,6 +574,50 @@ struct butmap {
 #define BTFL_AXIS     (1<<1)  /* is this an axis map?  else bt map */
 #define BTFL_INVERT   (1<<2)  /* invert before sending on? */
 
+/* The above maps are compiled by init_evdev() into flat per-device tables
+ * indexed by input code, so that read() does one lookup and one switch
+ * per event rather than testing ranges and flags in the above.
+ * Pass-through, renumbering and inversion are all the same operation
+ * (XL_MAP), applied without further branching:  the new value is
+ * (value ^ neg) - neg + add, where neg is -1 to invert and 0 otherwise. */
+enum xlop {
+    XL_MAP,       /* renumber and maybe invert (including pass-through) */
+    XL_DROP,      /* drop */
+    XL_KEY_AX,    /* key -> axis value */
+    XL_ABS_SCALE, /* axis -> rescaled (and maybe inverted) axis */
+    XL_ABS_KEY,   /* axis -> key(s) */
+    XL_KEY_AF,    /* XL_MAP, but with autofire */
+    XL_KEY_CHORD  /* XL_MAP, but part of a chord */
+};
+
+/* translation for one input key code */
+struct xlkey {
+    unsigned char op;
+    unsigned char mod; /* does this modify the event? */
+    signed char onax, offax, onval, offval; /* XL_KEY_AX */
+                                            /* onax is autofire # for XL_KEY_AF */
+                                            /* and chmember # for XL_KEY_CHORD */
+    unsigned short code; /* output code */
+    int neg, add; /* XL_MAP */
+};
+
+/* translation for one input axis */
+struct xlabs {
+    unsigned char op;
+    unsigned char mod; /* does this modify the event? */
+    unsigned short code, ncode; /* output code; XL_ABS_KEY: target, ntarget */
+    int neg, add; /* XL_MAP:  add is input min + max if inverting */
+    struct jrscale sc; /* XL_ABS_SCALE; see joy-remap-rescale.h */
+    int onthresh, offthresh, nonthresh, noffthresh; /* XL_ABS_KEY */
+    int state; /* XL_ABS_KEY:  AXFL_[N]PRESSED flags */
+};
+
+#define MAX_AUTOFIRE 8 /* per section; must fit in an int bit mask */
+#define MAX_CHORD 8 /* per section; must fit in an int bit mask */
+#define MAX_CHORD_KEYS 4 /* buttons per chord */
+#define MAX_CHORD_MEMBERS 32 /* per section; must fit in an unsigned bit mask */
+#define MAX_MERGE 3 /* devices merged into one captured device */
+
 /* all config combined into one structure for multiple sections */
 static struct evjrconf {
     char *name;
@@ -417,8 +625,13 @@ static struct evjrconf {
     struct butmap *bt_map;
     char *repl_name, *repl_id, *repl_uniq;
     /* since there is no regcopy() or equiv., need strings for KW_USE */
-    char *match_str, *reject_str;
-    regex_t match, reject; /* compiled matching regexes */
+    char *match_str, *reject_str, *merge_str;
+    regex_t match, reject, merge; /* compiled regexes, unless literal */
+    struct litpat {
+	char type; /* PAT_*; PAT_RE uses the regex */
+	int len;
+	char *lit; /* pattern with anchors and escapes removed */
+    } match_lit, reject_lit, merge_lit;
     __u8 *jsaxmap; /* jscal -u-like remapping; 1st element is len */
     __u16 *jsbtmap; /* jscal -u-like remapping; 1st element is len */
     /* stuff below this is safe to copy on USE */
@@ -430,6 +643,20 @@ static struct evjrconf {
     char jsrename; /* rename js device associated with event device? */
     char jsremap; /* do full js remapping? */
     char syn_drop; /* use SYN_DROP instead of deleting drops? */
+    char persist; /* feed program from a socket, surviving disconnects? */
+    char feed; /* translate in the feeder thread instead of read()? */
+    int nautofire;
+    struct afconf {
+	int code; /* output button */
+	long half_ns; /* half of the period */
+    } autofire[MAX_AUTOFIRE];
+    int nchord, nchmember;
+    int chord_window; /* in microseconds */
+    int chmember[MAX_CHORD_MEMBERS]; /* output buttons used in chords */
+    struct chordconf {
+	int code; /* output button */
+	unsigned mask; /* chmember bits */
+    } chord[MAX_CHORD];
 } *conf;
 static int nconf = 0;
 
@@ -437,22 +664,110 @@ static int nconf = 0;
 /* also other per-device info */
 
 struct js_extra;
+/* an event as returned to the caller, which depends on the device type */
+union xev {
+    struct input_event ev;
+    struct js_event js;
+};
+#define PENDQ_SZ 128 /* must be a power of 2, and hold a merge_fill() */
+#define MAX_EPOLL 4 /* epoll instances one captured fd can be registered with */
+/* log2 histogram of time from event time stamp to read() return */
+#define LAT_NB 24 /* bucket b counts < 2^b us; the last counts the rest */
+enum { LAT_SYN, LAT_KEY, LAT_ABS, LAT_OTHER, LAT_NT };
+struct lathist {
+    unsigned cnt[LAT_NT][LAT_NB];
+    unsigned early; /* time stamps after read() (clock mismatch) */
+};
+/* where EVIOCGABS(target axis) gets its answer; see gabs_build() */
+enum { GABS_NONE, GABS_PASS, GABS_AX, GABS_BT, GABS_MERGED };
+struct gabs {
+    unsigned char how;
+    unsigned char src; /* GABS_AX: input axis; GABS_MERGED: merged[] index */
+};
 static struct evfdcap {
-    struct evfdcap *next; /* linked list is less thread-unsafe */
+    struct evfdcap *next; /* free list link */
+    /* the above and below survive recycling; see cap_alloc() */
+    struct evfdcap *lnext; /* list of all captures ever allocated */
+    pthread_mutex_t lk; /* for ep[] and merged[] changes */
     const struct evjrconf *conf;
     struct js_extra *js_extra;  /* only there if jsremap */
     unsigned long absout[MINBITS(ABS_MAX)]; /* sent GBITS(EV_ABS) */
     int axval[ABS_MAX]; /* value for key-generated axes */
     /* FIXME:  do I need to support EVIOC[GS]KEYCODE*? */
     unsigned long keysout[MINBITS(KEY_MAX)],  /* sent GBITS(EV_KEY) */
-	          keystates[MINBITS(KEY_MAX)], /* sent GKEY */
+	          keystates[MINBITS(KEY_MAX)], /* sent GKEY; see ks_note() */
 	          keystates_in[MINBITS(KEY_MAX)];  /* device GKEY */
+    int ks_stale; /* keystates needs ev_gkey() (SYN_DROPPED) */
     struct input_id repl_id_val;
+    struct xlkey xl_key[KEY_CNT]; /* compiled bt_map */
+    struct xlabs xl_abs[ABS_CNT]; /* compiled ax_map */
+    int xl_grow; /* most events one input event can turn into; see xl_room() */
+    struct gabs gabs[ABS_MAX]; /* reverse ax_map/bt_map, for EVIOCGABS */
     int fd;
-    char ebuf[sizeof(struct input_event)];
-    char excess_read;
+    union xev ebuf; /* translated event only partially returned by read() */
+    /* synthetic events which didn't fit into the caller's read() buffer */
+    union xev pendq[PENDQ_SZ];
+    unsigned pendq_head, pendq_tail; /* free-running; tail only set w/ release */
+    struct capep {
+	int fd; /* epoll instance fd was added to, or -1 */
+	struct epoll_event ev; /* what it was added with */
+    } ep[MAX_EPOLL];
+    int tfd; /* autofire/chord timer, or -1 */
+    int tmr_on; /* is tfd armed? */
+    /* merged devices (see merge_open()); their captures are only here */
+    struct evfdcap *merged[MAX_MERGE];
+    int nmerged;
+    int mfd; /* epoll fd with the merged devices and tfd, or -1 */
+    struct persist *pst; /* feeder, if fd is a persistent or fed capture's socket */
+    int fed; /* feeder translates, so read() and poll() leave fd alone */
+    clockid_t clkid; /* clock for event time stamps; -1 for js (unknown) */
+    int af_held; /* bit mask of held autofire buttons */
+    struct afstate {
+	char out; /* currently reported as pressed? */
+	struct timespec next; /* next toggle (CLOCK_MONOTONIC) */
+    } af[MAX_AUTOFIRE];
+    int ch_npend; /* # of held back chord member presses */
+    unsigned ch_pend; /* chmember bits of held back presses */
+    unsigned ch_held; /* chmember bits consumed by pressed chords */
+    int ch_active; /* bit mask of pressed chords */
+    struct input_event ch_ev[MAX_CHORD_KEYS]; /* held back presses */
+    struct timespec ch_deadline; /* when to give up on chords (CLOCK_MONOTONIC) */
+    struct lathist lat; /* only updated if lat_on */
+    time_t lat_next; /* next periodic dump (event clock seconds) */
+    int rec_dev; /* device # in EV_JOY_REMAP_RECORD file, or -1 */
+    char excess_read; /* # of bytes at end of ebuf not yet returned */
     char is_js;
-} *ev_fd = NULL, *free_ev_fd = NULL;
+} *free_ev_fd = NULL, *cap_list = NULL;
+
+/* Captured fds are looked up by fd number in a two-level table.  Every
+ * read(), ioctl() and close() in the process does this lookup, so it is
+ * done without locking:  pages and entries are only ever published with
+ * release stores, and readers use acquire loads.  Entries are only
+ * changed with the lock held.  Since capture structures are recycled via
+ * free_ev_fd rather than freed, a stale pointer is never invalid memory,
+ * which is no worse than the old linked list.  ncap counts captured fds,
+ * so that processes which have nothing captured (i.e., most of them)
+ * never look past a single atomic load.  The top level grows to fit the
+ * highest captured fd (Wine raises RLIMIT_NOFILE); readers may still be
+ * using the old one, so it is never freed, but each is only half the
+ * size of the next. */
+#define CAPTAB_BITS 8
+#define CAPTAB_PGSZ (1 << CAPTAB_BITS)
+#define CAPTAB_NPG  256 /* initial top level size:  fds up to 65535 */
+static struct captab {
+    unsigned npg;
+    struct evfdcap **pg[];
+} *cap_tab = NULL;
+static int ncap = 0;
+/* Number of captures with a non-empty pendq, and with an armed timer
+ * (autofire or chords) or merged devices.  This keeps the poll() family
+ * down to two atomic loads when nothing is going on. */
+static int npend = 0, ntmr = 0;
+/* number of ep[] entries in use, so close() can skip looking for them */
+static int nepoll = 0;
+/* EV_JOY_REMAP_LATENCY:  keep latency histograms, and maybe dump them
+ * every lat_period seconds as well as at close/exit */
+static int lat_on = 0, lat_period = 0;
 
 struct js_extra {
     /* in:  index = js-code, value = ev-code */
@@ -461,12 +776,43 @@ struct js_extra {
     /* out:  index = ev-code, value = js-code (0xff/0xffff == no map) */
     __u8 out_ax_map[ABS_MAX];
     __u16 out_btn_map[KEY_MAX - BTN_MISC + 1];
+    /* JSIOCGAXES/JSIOCGBUTTONS and JSIOCGAXMAP/JSIOCGBTNMAP answers:
+     * the inverse of the out maps */
+    int nax, nbtn;
+    __u8 ax_list[ABS_CNT];
+    __u16 btn_list[KEY_MAX - BTN_MISC + 1];
 };
 
-static char buf[1024]; /* generic large buffer to reduce stack usage */
-/* in case of threads; used to just be access lock for buf[] */
+/* for free_ev_fd, cap_list additions, capture table entries and such
+ * rarely changed global state; per-capture state has its own lock */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* live statistics (see joy-remap-stat.h); NULL unless EV_JOY_REMAP_STATS */
+static struct jrstat *stats = NULL;
+#define STAT_ADD(f, n) do { \
+    if(stats) \
+	__atomic_add_fetch(&stats->f, (n), __ATOMIC_RELAXED); \
+} while(0)
+
+/* take the lock, timing how long it takes if it's contended */
+static void take_lock(void)
+{
+    struct timespec t0, t1;
+    if(!stats) {
+	pthread_mutex_lock(&lock);
+	return;
+    }
+    STAT_ADD(lock_acq, 1);
+    if(!pthread_mutex_trylock(&lock))
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    STAT_ADD(lock_wait, 1);
+    STAT_ADD(lock_wait_us, (t1.tv_sec - t0.tv_sec) * 1000000 +
+	                   (t1.tv_nsec - t0.tv_nsec) / 1000);
+}
+
 /* array must be alphabetized */
 static const struct bname {
     const char *nm;
@@ -544,16 +890,22 @@ static int bnum(char **s)
 
 /* array and enum must be alphabetized */
 static const char * const kws[] = {
+    "autofire",
     "axes",
     "buttons",
+    "chord",
+    "chord_window",
+    "feed",
     "filter",
     "id",
     "jsremap",
     "jsrename",
     "match",
+    "merge",
     "name",
     "pass_axes",
     "pass_buttons",
+    "persist",
     "reject",
     "rescale",
     "section",
@@ -563,8 +915,8 @@ static const char * const kws[] = {
 };
 
 enum kw {
-    KW_AXES, KW_BUTTONS, KW_FILTER, KW_ID, KW_JSREMAP, KW_JSRENAME, KW_MATCH,
-    KW_NAME, KW_PASS_AX, KW_PASS_BT, KW_REJECT, KW_RESCALE, KW_SECTION,
+    KW_AUTOFIRE, KW_AXES, KW_BUTTONS, KW_CHORD, KW_CHORD_WINDOW, KW_FEED, KW_FILTER, KW_ID, KW_JSREMAP, KW_JSRENAME, KW_MATCH,
+    KW_MERGE, KW_NAME, KW_PASS_AX, KW_PASS_BT, KW_PERSIST, KW_REJECT, KW_RESCALE, KW_SECTION,
     KW_SYN_DROP, KW_UNIQ, KW_USE
 };
 
@@ -575,6 +927,15 @@ static int kwcmp(const void *_a, const void *_b)
 }
 
 static void free_conf(struct evjrconf *sec);
+/* set if conf is in a mapped cache file (see conf_load()) */
+static char *conf_map = NULL;
+static size_t conf_maplen;
+/* the config is loaded on the first input device open (see ev_open()) */
+static void load_conf(void);
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+static int conf_loaded = 0;
+/* EV_JOY_REMAP_CHECK_ALL:  check all opens for devices (see maybe_dev()) */
+static int check_all = 0;
 
 #if CAP_SYSCALL
 static long (*real_syscall)(long number, ...);
@@ -584,6 +945,18 @@ static int (*real_open64)(const char *pathname, int flags, ...);
 static int (*real_ioctl)(int fd, unsigned long request, ...);
 static ssize_t (*real_read)(int, void *, size_t);
 static int (*real_close)(int fd);
+static int (*real_chdir)(const char *);
+static int (*real_fchdir)(int);
+static int (*real_poll)(struct pollfd *, nfds_t, int);
+static int (*real_ppoll)(struct pollfd *, nfds_t, const struct timespec *,
+			 const sigset_t *);
+static int (*real_select)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+static int (*real_pselect)(int, fd_set *, fd_set *, fd_set *,
+			   const struct timespec *, const sigset_t *);
+static int (*real_epoll_ctl)(int, int, int, struct epoll_event *);
+static int (*real_epoll_wait)(int, struct epoll_event *, int, int);
+static int (*real_epoll_pwait)(int, struct epoll_event *, int, int,
+			       const sigset_t *);
 #if CAP_OPENAT
 static int (*real_openat)(int dirfd, const char *pathname, int flags, ...);
 static int (*real_openat64)(int dirfd, const char *pathname, int flags, ...);
@@ -601,136 +974,1334 @@ static int (*real_dup2)(int, int);
 static void *(*real_dlopen)(const char *, int);
 #endif
 
-/* parse config file */
-/* is this too early for file I/O?  apparently not */
-/* dlopen() docs say this must be exported, but again, apparently not */
-/* note that this attribute works with clang as well */
+/* Test mode:  if EV_JOY_REMAP_FAKE names a directory, anything opened as
+ * <dir>/eventN or <dir>/jsN which isn't a device (e.g. a FIFO, or a
+ * symlink to a memfd) is treated as an input device, so that the shim can
+ * be exercised and benchmarked without hardware.  The program (usually
+ * joy-remap-bench) supplies the events.  ioctls on such fds are answered
+ * by fake_ioctl() from <dir>/eventN.desc, one item per line:
+ *   name <name>
+ *   id <bus> <vendor> <product> <version>     (hex)
+ *   key <button>[-<button>]                   (names as in the config)
+ *   down <button>[-<button>]                  (pressed at open; for GKEY)
+ *   abs <axis>[-<axis>] <min> <max> [<fuzz> [<flat> [<res> [<value>]]]]
+ * If that file is missing, it's a generic gamepad.  jsN uses eventN's
+ * description.  Axes start out centered unless <value> is given. */
+struct fakedev {
+    char name[256];
+    struct input_id id;
+    unsigned long keybits[MINBITS(KEY_MAX)], absbits[MINBITS(ABS_MAX)],
+                  keydown[MINBITS(KEY_MAX)];
+    struct input_absinfo ai[ABS_CNT];
+    int parsed;
+};
+#define FAKE_MAX 16 /* simultaneously open fake devices */
+static char *fake_dir = NULL;
+static size_t fake_len;
+static struct fakedev fake_desc[EVDEV_NMINOR];
+static struct fakefd {
+    int fd; /* -1 if free */
+    int is_js;
+    const struct fakedev *dev;
+} fake_fds[FAKE_MAX];
+static int (*libc_ioctl)(int fd, unsigned long request, ...);
 
-__attribute__((constructor))
-static void init(void)
+/* read eventN.desc; must be called with lock held */
+static void fake_parse(struct fakedev *d, int evno)
 {
-#if CAP_SYSCALL
-    real_syscall = dlsym(RTLD_NEXT, "syscall");  /* needs to be first! */
-#endif
-    real_open = dlsym(RTLD_NEXT, "open");
-    real_open64 = dlsym(RTLD_NEXT, "open64");
-    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
-    real_read = dlsym(RTLD_NEXT, "read");
-    real_close = dlsym(RTLD_NEXT, "close");
-#if CAP_OPENAT
-    real_openat = dlsym(RTLD_NEXT, "openat");
-    real_openat64 = dlsym(RTLD_NEXT, "openat64");
-#endif
-#if CAP_FOPEN
-    real_fopen = dlsym(RTLD_NEXT, "fopen");
-    real_fopen64 = dlsym(RTLD_NEXT, "fopen64");
-    real_fclose = dlsym(RTLD_NEXT, "fclose");
-#endif
-#if 0
-    real_dup = dlsym(RTLD_NEXT, "dup");
-    real_dup2 = dlsym(RTLD_NEXT, "dup2");
-    real_dlopen = dlsym(RTLD_NEXT, "dlopen");
-#endif
-    const char *fname = getenv("EV_JOY_REMAP_CONFIG"),
-	       *logn = getenv("EV_JOY_REMAP_LOG");
+    char ln[300], *s;
     FILE *f;
-    long fsize;
-    char *cfg;
-    struct evjrconf *sec;
+    int i, lo, hi;
+    sprintf(ln, "%.100s/event%d.desc", fake_dir, evno);
+    d->parsed = 1;
+    if(!(f = fopen(ln, "r"))) {
+	strcpy(d->name, "Fake Gamepad");
+	d->id.bustype = BUS_VIRTUAL;
+	for(i = BTN_SOUTH; i <= BTN_THUMBR; i++)
+	    ULSET(d->keybits, i);
+	for(i = ABS_X; i <= ABS_HAT0Y; i++) {
+	    if(i > ABS_RZ && i < ABS_HAT0X)
+		continue;
+	    ULSET(d->absbits, i);
+	    d->ai[i].minimum = i < ABS_HAT0X ? 0 : -1;
+	    d->ai[i].maximum = i < ABS_HAT0X ? 255 : 1;
+	    d->ai[i].value = i < ABS_HAT0X ? 128 : 0;
+	    d->ai[i].flat = i < ABS_HAT0X ? 15 : 0;
+	}
+	return;
+    }
+    while(fgets(ln, sizeof(ln), f)) {
+	for(s = ln + strlen(ln); s > ln && isspace(s[-1]); *--s = 0);
+	if(!strncmp(ln, "name ", 5))
+	    sprintf(d->name, "%.255s", ln + 5);
+	else if(!strncmp(ln, "id ", 3)) {
+	    unsigned b, v, p, r;
+	    if(sscanf(ln + 3, "%x %x %x %x", &b, &v, &p, &r) == 4) {
+		d->id.bustype = b;
+		d->id.vendor = v;
+		d->id.product = p;
+		d->id.version = r;
+	    }
+	} else if(!strncmp(ln, "key ", 4) || !strncmp(ln, "abs ", 4) ||
+		  !strncmp(ln, "down ", 5)) {
+	    int is_abs = *ln == 'a', is_down = *ln == 'd';
+	    s = ln + 4 + is_down;
+	    lo = hi = is_abs ? strtol(s, &s, 0) : bnum(&s);
+	    if(*s == '-') {
+		s++;
+		hi = is_abs ? strtol(s, &s, 0) : bnum(&s);
+	    }
+	    if(lo < 0 || hi < lo || hi >= (is_abs ? ABS_CNT : KEY_CNT)) {
+		jlog(JL_ERR, "event%d.desc: bad line %s\n", evno, ln);
+		continue;
+	    }
+	    for(i = lo; i <= hi; i++) {
+		if(!is_abs) {
+		    ULSET(is_down ? d->keydown : d->keybits, i);
+		    continue;
+		}
+		ULSET(d->absbits, i);
+		memset(&d->ai[i], 0, sizeof(d->ai[i]));
+		if(sscanf(s, "%d %d %d %d %d %d", &d->ai[i].minimum, &d->ai[i].maximum,
+			  &d->ai[i].fuzz, &d->ai[i].flat, &d->ai[i].resolution,
+			  &d->ai[i].value) < 6)
+		    d->ai[i].value = (d->ai[i].minimum + d->ai[i].maximum) / 2;
+	    }
+	}
+    }
+    fclose(f);
+}
 
-    if(logn) {
-	logf = fopen(logn, "w");
-	if(!logf)
-	    perror(logn);
-	else
-	    setbuf(logf, NULL);
+/* if pathname is a fake device, remember fd and set *mn to its minor # */
+static int fake_open(int fd, const char *pathname, const struct stat *st, int *mn)
+{
+    size_t l = strlen(fake_dir);
+    const char *b = pathname + l + 1;
+    int n, is_js, i;
+    if(S_ISCHR(st->st_mode) || strncmp(pathname, fake_dir, l) || b[-1] != '/')
+	return 0;
+    if((is_js = !memcmp(b, "js", 2)))
+	b += 2;
+    else if(!memcmp(b, "event", 5))
+	b += 5;
+    else
+	return 0;
+    if(!isdigit(*b) || (n = atoi(b)) >= (is_js ? JSDEV_NMINOR : EVDEV_NMINOR))
+	return 0;
+    take_lock();
+    if(!fake_desc[n].parsed)
+	fake_parse(&fake_desc[n], n);
+    for(i = 0; i < FAKE_MAX; i++)
+	if(fake_fds[i].fd < 0) {
+	    fake_fds[i].dev = &fake_desc[n];
+	    fake_fds[i].is_js = is_js;
+	    __atomic_store_n(&fake_fds[i].fd, fd, __ATOMIC_RELEASE);
+	    break;
+	}
+    pthread_mutex_unlock(&lock);
+    if(i == FAKE_MAX) {
+	jlog(JL_WARN, "too many fake devices; %s ignored\n", pathname);
+	return 0;
     }
-    if(!logf)
-	logf = stderr;
-    if(fname && *fname)
-	f = fopen(fname, "r");
-    else if(!(f = fopen((fname = "ev_joy_remap.conf"), "r"))) {
-	if((fname = getenv("HOME")) && *fname) {
-	    sprintf(buf, "%.200s/.config/ev_joy_remap.conf", fname);
-	    f = fopen((fname = buf), "r");
+    *mn = is_js ? JSDEV_MINOR0 + n : EVDEV_MINOR0 + n;
+    return 1;
+}
+
+static struct fakefd *fake_of(int fd)
+{
+    int i;
+    if(fake_dir && fd >= 0)
+	for(i = 0; i < FAKE_MAX; i++)
+	    if(__atomic_load_n(&fake_fds[i].fd, __ATOMIC_ACQUIRE) == fd)
+		return &fake_fds[i];
+    return NULL;
+}
+
+static void fake_close(int fd)
+{
+    struct fakefd *f = fake_of(fd);
+    if(f)
+	__atomic_store_n(&f->fd, -1, __ATOMIC_RELEASE);
+}
+
+/* the fake device open as fd is now open as nfd instead */
+static void fake_move(int fd, int nfd)
+{
+    struct fakefd *f = fake_of(fd);
+    if(f)
+	__atomic_store_n(&f->fd, nfd, __ATOMIC_RELEASE);
+}
+
+/* copy a string or bit mask for an ioctl; returns bytes copied */
+static int fake_cp(void *argp, int len, const void *m, int mlen)
+{
+    if(len > mlen)
+	len = mlen;
+    memcpy(argp, m, len);
+    return len;
+}
+
+/* replaces real_ioctl in test mode */
+static int fake_ioctl(int fd, unsigned long request, ...)
+{
+    va_list va;
+    va_start(va, request);
+    void *argp = va_arg(va, void *);
+    va_end(va);
+    struct fakefd *f = fake_of(fd);
+    if(!f)
+	return libc_ioctl(fd, request, argp);
+    const struct fakedev *d = f->dev;
+    int len = _IOC_SIZE(request), nr = _IOC_NR(request), i, j, n;
+    if(!f->is_js && _IOC_TYPE(request) == 'E') {
+	unsigned long bits[MINBITS(KEY_MAX)] = {};
+	switch(nr) {
+	  case _IOC_NR(EVIOCGVERSION):
+	    *(int *)argp = EV_VERSION;
+	    return 0;
+	  case _IOC_NR(EVIOCGID):
+	    memcpy(argp, &d->id, sizeof(d->id));
+	    return 0;
+	  case _IOC_NR(EVIOCGNAME(0)):
+	    return fake_cp(argp, len, d->name, strlen(d->name) + 1);
+	  case _IOC_NR(EVIOCGBIT(0, 0)):
+	    ULSET(bits, EV_SYN);
+	    ULSET(bits, EV_KEY);
+	    ULSET(bits, EV_ABS);
+	    return fake_cp(argp, len, bits, MINBITS(EV_MAX) * sizeof(long));
+	  case _IOC_NR(EVIOCGBIT(EV_KEY, 0)):
+	    return fake_cp(argp, len, d->keybits, sizeof(d->keybits));
+	  case _IOC_NR(EVIOCGBIT(EV_ABS, 0)):
+	    return fake_cp(argp, len, d->absbits, sizeof(d->absbits));
+	  case _IOC_NR(EVIOCGKEY(0)):
+	    return fake_cp(argp, len, d->keydown, sizeof(d->keydown));
+	  case _IOC_NR(EVIOCGPROP(0)):
+	    return fake_cp(argp, len, bits, sizeof(bits));
+	  case _IOC_NR(EVIOCSCLOCKID):
+	  case _IOC_NR(EVIOCGRAB):
+	    return 0;
+	}
+	if(nr >= _IOC_NR(EVIOCGABS(0)) && nr < _IOC_NR(EVIOCGABS(ABS_CNT)) &&
+	   ULISSET(d->absbits, nr - _IOC_NR(EVIOCGABS(0)))) {
+	    memcpy(argp, &d->ai[nr - _IOC_NR(EVIOCGABS(0))], sizeof(d->ai[0]));
+	    return 0;
+	}
+    } else if(f->is_js && _IOC_TYPE(request) == 'j') {
+	switch(nr) {
+	  case _IOC_NR(JSIOCGVERSION):
+	    *(__u32 *)argp = JS_VERSION;
+	    return 0;
+	  case _IOC_NR(JSIOCGNAME(0)):
+	    return fake_cp(argp, len, d->name, strlen(d->name) + 1);
+	  case _IOC_NR(JSIOCGAXES):
+	  case _IOC_NR(JSIOCGAXMAP):
+	    for(i = n = 0; i < ABS_CNT; i++)
+		if(ULISSET(d->absbits, i)) {
+		    if(nr == _IOC_NR(JSIOCGAXMAP) && n < len)
+			((__u8 *)argp)[n] = i;
+		    n++;
+		}
+	    if(nr == _IOC_NR(JSIOCGAXES))
+		*(__u8 *)argp = n;
+	    return 0;
+	  case _IOC_NR(JSIOCGBUTTONS):
+	  case _IOC_NR(JSIOCGBTNMAP):
+	    /* joydev puts joystick buttons first */
+	    for(j = n = 0; j <= KEY_MAX - BTN_MISC; j++) {
+		i = BTN_MISC + (j + BTN_JOYSTICK - BTN_MISC) % (KEY_MAX - BTN_MISC + 1);
+		if(!ULISSET(d->keybits, i))
+		    continue;
+		if(nr == _IOC_NR(JSIOCGBTNMAP) && n < len / 2)
+		    ((__u16 *)argp)[n] = i;
+		n++;
+	    }
+	    if(nr == _IOC_NR(JSIOCGBUTTONS))
+		*(__u8 *)argp = n;
+	    return 0;
 	}
-	if(!f)
-	    f = fopen("/etc/ev_joy_remap.conf", "r");
     }
-    if(!f) {
-	fprintf(logf, "%s: %s\n", fname, strerror(errno));
-	return;
+    errno = EINVAL;
+    return -1;
+}
+
+/* Recording:  if EV_JOY_REMAP_RECORD names a file, every event read from
+ * a captured device is appended to it as it came from the device, after
+ * a snapshot of the device's capabilities and state taken when it was
+ * captured.  joy-remap-replay (built from joy-remap-replay.c) feeds such
+ * a file back through the shim using the fake devices above, so that
+ * configurations can be debugged and benchmarked against real input
+ * without the hardware.  See joy-remap-rec.h for the format.  The file
+ * is mapped and only grown (by ftruncate) every REC_GROW bytes, so
+ * recording costs no more than encoding the events in the common case.
+ * The file is only created when the first device is captured, so that
+ * wrapper scripts and launchers started with the same environment don't
+ * overwrite it.  Only the first JRREC_MAXDEV captures are recorded, and
+ * children stop recording when they fork. */
+#define REC_MAX (256 << 20) /* recording is cut off at this size */
+#define REC_GROW (1 << 20)
+static const char *rec_fn = NULL; /* set if recording is enabled */
+static unsigned char *rec_map = NULL; /* set once the file is created */
+static size_t rec_off, rec_size; /* reserved and allocated bytes */
+static int rec_fd = -1, rec_ndev = 0;
+static long long rec_last[JRREC_MAXDEV]; /* time of last event per device */
+/* growing can't use lock, since init_evdev() holds it */
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void rec_fork(void)
+{
+    rec_fn = NULL;
+    rec_map = NULL;
+}
+
+/* create the file; called w/ lock held */
+static int rec_init(void)
+{
+    void *m = MAP_FAILED;
+    if((rec_fd = real_open(rec_fn, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+       ftruncate(rec_fd, (rec_size = REC_GROW)) ||
+       (m = mmap(NULL, REC_MAX, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_NORESERVE, rec_fd, 0)) == MAP_FAILED) {
+	jlog(JL_ERR, "%s: %s\n", rec_fn, strerror(errno));
+	if(rec_fd >= 0)
+	    real_close(rec_fd);
+	rec_fn = NULL;
+	return -1;
     }
-    /* config should be short enough to fit in memory */
-    /* this eliminates the need for line read gymnastics */
-    if(fseek(f, 0, SEEK_END) || (fsize = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) ||
-       !(cfg = malloc(fsize + 1))) {
-	fprintf(logf, "%s: %s\n", fname, strerror(errno));
-	fclose(f);
+    memcpy(m, JRREC_MAGIC, sizeof(JRREC_MAGIC));
+    rec_off = sizeof(JRREC_MAGIC);
+    rec_map = m;
+    return 0;
+}
+
+/* append a record (or several) */
+/* space is reserved atomically, so threads may write at the same time */
+static void rec_put(const unsigned char *r, size_t len)
+{
+    size_t off = __atomic_fetch_add(&rec_off, len, __ATOMIC_RELAXED);
+    if(off + len > REC_MAX) {
+	/* everything after this fails as well */
+	if(off <= REC_MAX)
+	    jlog(JL_WARN, "recording full; stopped\n");
 	return;
     }
-    if(fread(cfg, fsize, 1, f) != 1) {
-	fprintf(logf, "%s: %s\n", fname, strerror(errno));
-	fclose(f);
-	free(cfg);
-	errno = 0;
-	return;
+    if(off + len > __atomic_load_n(&rec_size, __ATOMIC_ACQUIRE)) {
+	pthread_mutex_lock(&rec_lock);
+	while(off + len > rec_size) {
+	    if(ftruncate(rec_fd, rec_size + REC_GROW)) {
+		jlog(JL_ERR, "recording: %s\n", strerror(errno));
+		/* leaves a hole of 0s, which ends the recording */
+		__atomic_store_n(&rec_off, REC_MAX + 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&rec_lock);
+		return;
+	    }
+	    __atomic_store_n(&rec_size, rec_size + REC_GROW, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&rec_lock);
     }
-    fclose(f);
-    sec = conf = calloc(sizeof(*conf), (nconf = 1));
-    if(!conf) {
-	fprintf(logf, "%s: %s\n", "conf", strerror(errno));
-	free(cfg);
-	nconf = 0;
-	errno = 0;
+    memcpy(rec_map + off, r, len);
+}
+
+/* bit i of bits goes into bit i % 8 of byte i / 8 */
+static unsigned char *rec_bits(unsigned char *p, const unsigned long *bits, int nbits)
+{
+    int i;
+    memset(p, 0, nbits / 8);
+    for(i = 0; i < nbits; i++)
+	if(ULISSET(bits, i))
+	    p[i / 8] |= 1 << i % 8;
+    return p + nbits / 8;
+}
+
+/* record what the device looked like when captured; called w/ lock held */
+static void rec_snapshot(struct evfdcap *cap, int fd)
+{
+    unsigned char r[2 + 5 + 256 + 4 * 3 + KEY_CNT / 4 + ABS_CNT / 8 +
+			   ABS_CNT * 6 * 5];
+    unsigned long keys[MINBITS(KEY_MAX)] = {}, down[MINBITS(KEY_MAX)] = {},
+                  abs[MINBITS(ABS_MAX)] = {};
+    struct input_id id = {};
+    struct input_absinfo ai;
+    unsigned char *p = r;
+    char name[256] = "";
+    int i, l, en = errno;
+    if(rec_ndev >= JRREC_MAXDEV || (!rec_map && rec_init() < 0))
 	return;
+    cap->rec_dev = rec_ndev++;
+    rec_last[cap->rec_dev] = 0;
+    /* errors just leave things blank */
+    real_ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+    real_ioctl(fd, EVIOCGID, &id);
+    real_ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys);
+    real_ioctl(fd, EVIOCGKEY(sizeof(down)), down);
+    real_ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs)), abs);
+    *p++ = REC_DEV;
+    *p++ = cap->rec_dev;
+    p = rec_uv(p, (l = strlen(name)));
+    memcpy(p, name, l);
+    p += l;
+    p = rec_uv(p, id.bustype);
+    p = rec_uv(p, id.vendor);
+    p = rec_uv(p, id.product);
+    p = rec_uv(p, id.version);
+    p = rec_bits(p, keys, KEY_CNT);
+    p = rec_bits(p, down, KEY_CNT);
+    p = rec_bits(p, abs, ABS_CNT);
+    for(i = 0; i < ABS_CNT; i++)
+	if(ULISSET(abs, i)) {
+	    memset(&ai, 0, sizeof(ai));
+	    real_ioctl(fd, EVIOCGABS(i), &ai);
+	    p = rec_sv(p, ai.value);
+	    p = rec_sv(p, ai.minimum);
+	    p = rec_sv(p, ai.maximum);
+	    p = rec_sv(p, ai.fuzz);
+	    p = rec_sv(p, ai.flat);
+	    p = rec_sv(p, ai.resolution);
+	}
+    rec_put(r, p - r);
+    errno = en;
+}
+
+/* record a device's switch to js events, or its close */
+static void rec_tag(struct evfdcap *cap, int tag)
+{
+    unsigned char r[2] = { tag, cap->rec_dev };
+    rec_last[cap->rec_dev] = 0;
+    rec_put(r, 2);
+}
+
+/* record n events just read from the device */
+static void rec_events(struct evfdcap *cap, const char *rbuf, int n)
+{
+    unsigned char r[1024], *p = r, *tag;
+    int d = cap->rec_dev;
+    long long t;
+    for(; n > 0; n--) {
+	tag = p;
+	*p++ = REC_EV;
+	*p++ = d;
+	if(cap->js_extra) {
+	    const struct js_event *js = (const struct js_event *)rbuf;
+	    rbuf += sizeof(*js);
+	    /* ms since who knows when; only the difference matters */
+	    *tag = REC_JSEV;
+	    p = rec_sv(p, (int)(js->time - (__u32)rec_last[d]));
+	    rec_last[d] = js->time;
+	    *p++ = js->type;
+	    *p++ = js->number;
+	    p = rec_sv(p, js->value);
+	} else {
+	    const struct input_event *ev = (const struct input_event *)rbuf;
+	    rbuf += sizeof(*ev);
+	    t = ev->time.tv_sec * 1000000LL + ev->time.tv_usec;
+	    p = rec_sv(p, t - rec_last[d]);
+	    rec_last[d] = t;
+	    if(ev->type == EV_SYN && ev->code == SYN_REPORT && !ev->value)
+		*tag = REC_SYN;
+	    else {
+		*p++ = ev->type;
+		p = rec_uv(p, ev->code);
+		p = rec_sv(p, ev->value);
+	    }
+	}
+	/* largest record is 21 bytes */
+	if(p > r + sizeof(r) - 32) {
+	    rec_put(r, p - r);
+	    p = r;
+	}
     }
-    cfg[fsize] = 0;
-    char *ln = cfg, *e, c;
-    sec->ax_map = calloc((sec->max_ax = 18), sizeof(*sec->ax_map));
-    sec->bt_map = calloc((sec->max_bt = 15), sizeof(*sec->bt_map));
-    if(!sec->ax_map || !sec->bt_map) {
-	fprintf(logf, "%s: %s\n", "mapping", strerror(errno));
-	free(cfg);
-	if(sec->ax_map)
-	    free(sec->ax_map);
-	if(sec->bt_map)
-	    free(sec->bt_map);
-	errno = 0;
+    if(p > r)
+	rec_put(r, p - r);
+}
+
+/* forked children share the parent's statistics mapping; stop using it */
+static void stat_fork(void)
+{
+    stats = NULL;
+}
+
+/* create the live statistics region for this process */
+static void stat_init(void)
+{
+    char fn[40];
+    struct jrstat *st;
+    int fd;
+    sprintf(fn, JRSTAT_PATH, (int)getpid());
+    if((fd = real_open(fn, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0 ||
+       ftruncate(fd, sizeof(*st)) ||
+       (st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED,
+		  fd, 0)) == MAP_FAILED) {
+	jlog(JL_ERR, "%s: %s\n", fn, strerror(errno));
+	if(fd >= 0) {
+	    real_close(fd);
+	    unlink(fn);
+	}
 	return;
     }
-    sec->auto_ax = -1;
-    sec->auto_bt = BTN_A - 1;
-    int lno = 1;
-#define abort_parse(msg) do { \
-    fprintf(logf, "error parsing map on line %d: " msg "\n", lno); \
-    goto err; \
+    real_close(fd);
+    st->version = JRSTAT_VERSION;
+    st->size = sizeof(*st);
+    st->pid = getpid();
+    __atomic_store_n(&st->magic, JRSTAT_MAGIC, __ATOMIC_RELEASE);
+    stats = st;
+    pthread_atfork(NULL, NULL, stat_fork);
+}
+
+/* Configuration cache:  the sections as parsed, followed by everything
+ * they point to, with pointers replaced by file offsets (0 is NULL).
+ * Regexes can't be saved; they are compiled by conf_regcomp() after
+ * EV_JOY_REMAP_ENABLE has been applied, as they are for a parsed file. */
+#define CONF_CACHE_MAGIC "JRCONF1\n"
+struct conf_cache {
+    char magic[8];
+    unsigned confsize; /* sizeof(struct evjrconf); also 32 vs. 64 bit */
+    unsigned nconf;
+    unsigned long long hash; /* of the configuration's contents */
+    unsigned long long sum; /* hash of the rest of the cache */
+    long long mtime, mtime_ns, size;
+    unsigned path_off, conf_off, len; /* path is the configuration file */
+};
+
+/* FNV-1a; just to notice changes */
+static unsigned long long conf_hash(const char *s, long len)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    while(len-- > 0)
+	h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* name of the cache for configuration file fname; returns 0 if none */
+static int conf_cache_name(const char *fname, char *cname, char *path)
+{
+    const char *dir = getenv("EV_JOY_REMAP_CACHE"), *sub = "";
+    if(!dir && (!(dir = getenv("XDG_CACHE_HOME")) || !*dir)) {
+	if(!(dir = getenv("HOME")))
+	    return 0;
+	sub = "/.cache";
+    }
+    if(!*dir || strlen(dir) > PATH_MAX - 40 || !realpath(fname, path))
+	return 0;
+    sprintf(cname, "%s%s/ev_joy_remap.%016llx", dir, sub,
+	    conf_hash(path, strlen(path)));
+    return 1;
+}
+
+/* append n bytes to the cache being built, 8-byte aligned */
+/* returns offset, or 0 if out of memory */
+static size_t conf_cache_add(char **b, size_t *len, const void *p, size_t n)
+{
+    size_t off = (*len + 7) & ~7UL;
+    char *nb = realloc(*b, off + n);
+    if(!nb)
+	return 0;
+    *b = nb;
+    memset(nb + *len, 0, off - *len);
+    memcpy(nb + off, p, n);
+    *len = off + n;
+    return off;
+}
+
+/* save the freshly parsed configuration; failure is silent */
+static void conf_save(const char *cname, const char *path,
+		      const struct stat *st, unsigned long long hash)
+{
+    struct conf_cache h = { CONF_CACHE_MAGIC, sizeof(struct evjrconf), nconf,
+			    hash, 0, st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+			    st->st_size };
+    char *b = malloc(sizeof(h)), tmp[PATH_MAX + 20];
+    size_t len = sizeof(h), o; /* header is filled in last */
+    int i, fd, ok = !!b;
+    ok = ok && (h.path_off = conf_cache_add(&b, &len, path, strlen(path) + 1));
+    ok = ok && (h.conf_off = conf_cache_add(&b, &len, conf, nconf * sizeof(*conf)));
+    for(i = 0; ok && i < nconf; i++) {
+	struct evjrconf s = conf[i];
+#define cache_ptr(f, n) do { \
+    o = 0; \
+    if(ok && s.f) \
+	ok = !!(o = conf_cache_add(&b, &len, s.f, n)); \
+    s.f = (void *)o; \
 } while(0)
-#define map_resize(what, sz) do { \
-    if(sec->max_##what < sz) { \
-	int old_max = sec->max_##what; \
-	void *old_map = sec->what##_map; \
-	if(!old_max) \
-	    sec->max_##what = sz < 18 ? 18 : sz; \
-	while(sec->max_##what < sz) \
-	    sec->max_##what *= 2; \
-	sec->what##_map = realloc(sec->what##_map, sec->max_##what * sizeof(*sec->what##_map)); \
-	if(!sec->what##_map) { \
-	    sec->what##_map = old_map; \
-	    abort_parse(#what " map too large"); \
-	} \
-	memset(sec->what##_map + old_max, 0, (sec->max_##what - old_max) * sizeof(*sec->what##_map)); \
+	cache_ptr(name, strlen(s.name) + 1);
+	cache_ptr(ax_map, s.nax * sizeof(*s.ax_map));
+	cache_ptr(bt_map, s.nbt * sizeof(*s.bt_map));
+	cache_ptr(repl_name, strlen(s.repl_name) + 1);
+	cache_ptr(repl_id, strlen(s.repl_id) + 1);
+	cache_ptr(repl_uniq, strlen(s.repl_uniq) + 1);
+	cache_ptr(match_str, strlen(s.match_str) + 1);
+	cache_ptr(reject_str, strlen(s.reject_str) + 1);
+	cache_ptr(merge_str, strlen(s.merge_str) + 1);
+	cache_ptr(jsaxmap, (s.jsaxmap[0] + 1) * sizeof(*s.jsaxmap));
+	cache_ptr(jsbtmap, (s.jsbtmap[0] + 1) * sizeof(*s.jsbtmap));
+	memset(&s.match, 0, sizeof(s.match));
+	memset(&s.reject, 0, sizeof(s.reject));
+	memset(&s.merge, 0, sizeof(s.merge));
+	if(ok)
+	    memcpy(b + h.conf_off + i * sizeof(s), &s, sizeof(s));
+    }
+    if(ok) {
+	h.len = len;
+	h.sum = conf_hash(b + sizeof(h), len - sizeof(h));
+	memcpy(b, &h, sizeof(h));
+	/* other processes may be loading or saving it right now */
+	sprintf(tmp, "%s.%d", cname, (int)getpid());
+	if((fd = real_open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) >= 0) {
+	    ok = write(fd, b, len) == len;
+	    real_close(fd);
+	    if(!ok || rename(tmp, cname))
+		unlink(tmp);
+	}
+    }
+    free(b);
+}
+
+/* map the cache if it's up to date; returns 0 if it isn't */
+static int conf_load(const char *cname, const char *path,
+		     const struct stat *st, unsigned long long hash)
+{
+    const struct conf_cache *h;
+    struct stat cst;
+    char *m;
+    int fd, i;
+    if((fd = real_open(cname, O_RDONLY | O_CLOEXEC)) < 0)
+	return 0;
+    if(fstat(fd, &cst) || cst.st_size < sizeof(*h) ||
+       (m = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+		 0)) == MAP_FAILED) {
+	real_close(fd);
+	return 0;
+    }
+    real_close(fd);
+    h = (const struct conf_cache *)m;
+    if(memcmp(h->magic, CONF_CACHE_MAGIC, sizeof(h->magic)) ||
+       h->confsize != sizeof(struct evjrconf) || h->len != cst.st_size ||
+       h->hash != hash || h->size != st->st_size ||
+       h->mtime != st->st_mtim.tv_sec || h->mtime_ns != st->st_mtim.tv_nsec ||
+       h->path_off >= h->len || h->len - h->path_off <= strlen(path) ||
+       memcmp(m + h->path_off, path, strlen(path) + 1) ||
+       h->conf_off % 8 || h->conf_off > h->len ||
+       h->nconf > (h->len - h->conf_off) / sizeof(struct evjrconf) ||
+       h->sum != conf_hash(m + sizeof(*h), h->len - sizeof(*h)))
+	goto bad;
+    /* point everything into the mapping, checking the offsets anyway */
+    for(i = 0; i < h->nconf; i++) {
+	struct evjrconf *s = (struct evjrconf *)(m + h->conf_off) + i;
+	size_t o;
+#define cache_rel(f, n) do { \
+    if((o = (size_t)s->f)) { \
+	if(o >= h->len) \
+	    goto bad; \
+	s->f = (void *)(m + o); \
+	if((n) > h->len - o) \
+	    goto bad; \
     } \
 } while(0)
-    int i, ret;
-    int has_conf = 0;
-    while(1) {
-	while(isspace(*ln)) {
-	    if(*ln == '\n')
-		lno++;
-	    ln++;
-	}
-	if(!*ln)
+#define cache_str(f) cache_rel(f, (memchr(m + o, 0, h->len - o) ? 0 : h->len))
+	if(s->nax < 0 || s->nax > ABS_CNT || s->nbt < 0 || s->bt_low < 0 ||
+	   s->bt_low + s->nbt > KEY_CNT || (unsigned)s->nautofire > MAX_AUTOFIRE ||
+	   (unsigned)s->nchord > MAX_CHORD || (unsigned)s->nchmember > MAX_CHORD_MEMBERS)
+	    goto bad;
+	cache_str(name);
+	cache_rel(ax_map, s->nax * sizeof(*s->ax_map));
+	cache_rel(bt_map, s->nbt * sizeof(*s->bt_map));
+	cache_str(repl_name);
+	cache_str(repl_id);
+	cache_str(repl_uniq);
+	cache_str(match_str);
+	cache_str(reject_str);
+	cache_str(merge_str);
+	/* the first element is the length */
+	cache_rel(jsaxmap, (*(__u8 *)(m + o) + 1) * sizeof(__u8));
+	cache_rel(jsbtmap, h->len - o < 2 ? 2 : (*(__u16 *)(m + o) + 1) * sizeof(__u16));
+	if(!s->match_str)
+	    goto bad;
+    }
+    conf = (struct evjrconf *)(m + h->conf_off);
+    nconf = h->nconf;
+    conf_map = m;
+    conf_maplen = cst.st_size;
+    return 1;
+bad:
+    munmap(m, cst.st_size);
+    return 0;
+}
+
+/* Device match cache:  SDL and wine rescan every event device over and
+ * over, and allowed_sec() would run up to 4 regexes per section for each
+ * one.  Instead, the verdict is remembered per event device number, along
+ * with the name and ID it was made for.  If the configuration cache is
+ * enabled, the table is a shared file next to it, so that all processes
+ * using the same configuration share it.  Entries are tagged with a hash
+ * of the configuration and EV_JOY_REMAP_ENABLE, so a changed (or
+ * differently enabled) configuration just ignores the old ones. */
+#define MATCH_CACHE_MAGIC "JRMATCH1"
+struct match_ent {
+    unsigned seq; /* odd while being written */
+    int sec; /* index into conf; -1 if rejected */
+    struct input_id id;
+    unsigned long long name; /* conf_hash() of the name */
+    unsigned long long key; /* match_key; 0 is never valid */
+};
+struct match_cache {
+    char magic[8];
+    struct match_ent ent[EVDEV_NMINOR];
+};
+static struct match_cache match_local, *match = &match_local;
+static unsigned long long match_key;
+
+/* set up the match cache once the configuration is final */
+static void match_init(const char *cname, unsigned long long hash)
+{
+    const char *ens = getenv("EV_JOY_REMAP_ENABLE");
+    char mname[PATH_MAX + 30];
+    struct match_cache *m;
+    struct stat st;
+    int fd;
+
+    if(ens && *ens)
+	hash ^= conf_hash(ens, strlen(ens)) * 31;
+    match_key = hash | 1;
+    if(!cname)
+	return;
+    sprintf(mname, "%s.match", cname);
+    if((fd = real_open(mname, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+	return;
+    /* a new file is all 0; the magic is just to catch other versions */
+    if(fstat(fd, &st) || (st.st_size < sizeof(*m) && ftruncate(fd, sizeof(*m)))) {
+	real_close(fd);
+	return;
+    }
+    m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    real_close(fd);
+    if(m == MAP_FAILED)
+	return;
+    if(!st.st_size)
+	memcpy(m->magic, MATCH_CACHE_MAGIC, sizeof(m->magic));
+    else if(memcmp(m->magic, MATCH_CACHE_MAGIC, sizeof(m->magic))) {
+	munmap(m, sizeof(*m));
+	return;
+    }
+    match = m;
+}
+
+/* return cached section index for device, -1 if rejected, -2 if unknown */
+static int match_get(int evno, const struct input_id *id, unsigned long long name)
+{
+    struct match_ent *e = &match->ent[evno], c;
+    unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+    if(seq & 1)
+	return -2;
+    memcpy(&c, e, sizeof(c));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq ||
+       c.key != match_key || c.name != name || memcmp(&c.id, id, sizeof(*id)) ||
+       c.sec < -1 || c.sec >= nconf)
+	return -2;
+    return c.sec;
+}
+
+/* other processes may be writing as well; if so, just don't bother */
+static void match_put(int evno, const struct input_id *id, unsigned long long name,
+		      int sec)
+{
+    struct match_ent *e = &match->ent[evno];
+    unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+
+    if((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0,
+						 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->sec = sec;
+    e->id = *id;
+    e->name = name;
+    e->key = match_key;
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Patterns which are just a device name or ID (or a prefix, suffix or
+ * substring thereof) are compared directly instead of using regexec().
+ * Sections whose match is an exact name and which have no reject pattern
+ * are also found through a hash table rather than being checked in turn;
+ * with a section for every game that's the bulk of them. */
+enum { PAT_RE, PAT_SUB, PAT_PREFIX, PAT_SUFFIX, PAT_EXACT };
+#define PAT_META ".[]()*+?{}|^$\\"
+
+/* classify pattern; returns 0 if it needs to be a regex */
+static int pat_lit(struct litpat *lp, const char *s)
+{
+    int head = *s == '^', tail = 0;
+    char *d;
+
+    lp->type = PAT_RE;
+    s += head;
+    if(!(lp->lit = d = malloc(strlen(s) + 1)))
+	return 0;
+    for(; *s; s++) {
+	if(*s == '$' && !s[1]) {
+	    tail = 1;
+	    break;
+	}
+	if(*s == '\\' && s[1] && strchr(PAT_META, s[1]))
+	    s++;
+	else if(strchr(PAT_META, *s))
+	    break;
+	*d++ = *s;
+    }
+    if(*s && !tail) {
+	free(lp->lit);
+	lp->lit = NULL;
+	return 0;
+    }
+    *d = 0;
+    lp->len = d - lp->lit;
+    lp->type = head ? tail ? PAT_EXACT : PAT_PREFIX : tail ? PAT_SUFFIX : PAT_SUB;
+    return 1;
+}
+
+static int pat_match(const struct litpat *lp, const regex_t *re, const char *s, int len)
+{
+    switch(lp->type) {
+      case PAT_SUB:
+	return memmem(s, len, lp->lit, lp->len) != NULL;
+      case PAT_PREFIX:
+	return len >= lp->len && !memcmp(s, lp->lit, lp->len);
+      case PAT_SUFFIX:
+	return len >= lp->len && !memcmp(s + len - lp->len, lp->lit, lp->len);
+      case PAT_EXACT:
+	return len == lp->len && !memcmp(s, lp->lit, len);
+    }
+    return !regexec(re, s, 0, NULL, 0);
+}
+#define sec_match(sec, t, s, l) pat_match(&(sec)->t##_lit, &(sec)->t, s, l)
+
+/* exact names -> last section with that name; -1 is empty */
+static int *exact_tab, exact_mask;
+/* all other sections, in order */
+static int *slow_sec, nslow;
+
+static int exact_find(const char *s, int len)
+{
+    unsigned h;
+    int i;
+
+    if(!exact_tab)
+	return -1;
+    for(h = conf_hash(s, len); (i = exact_tab[h & exact_mask]) >= 0; h++)
+	if(conf[i].match_lit.len == len && !memcmp(conf[i].match_lit.lit, s, len))
+	    return i;
+    return -1;
+}
+
+static void exact_add(int sec)
+{
+    const struct litpat *lp = &conf[sec].match_lit;
+    unsigned h;
+    int i;
+
+    for(h = conf_hash(lp->lit, lp->len); (i = exact_tab[h & exact_mask]) >= 0; h++)
+	if(conf[i].match_lit.len == lp->len && !memcmp(conf[i].match_lit.lit, lp->lit, lp->len))
+	    break;
+    exact_tab[h & exact_mask] = sec;
+}
+
+/* compile the patterns of the enabled sections; 0 on error */
+static int conf_regcomp(void)
+{
+    struct evjrconf *sec;
+    regex_t *re = NULL;
+    int ret, i, nexact = 0;
+    char msg[256];
+
+#define free_pat(t) do { \
+    if(sec->t##_lit.type == PAT_RE) \
+	regfree(&sec->t); \
+    else \
+	free(sec->t##_lit.lit); \
+} while(0)
+    for(sec = conf; sec < conf + nconf; sec++) {
+	if(!pat_lit(&sec->match_lit, sec->match_str) &&
+	   (ret = regcomp((re = &sec->match), sec->match_str, REG_EXTENDED | REG_NOSUB)))
+	    break;
+	if(sec->reject_str && !pat_lit(&sec->reject_lit, sec->reject_str) &&
+	   (ret = regcomp((re = &sec->reject), sec->reject_str, REG_EXTENDED | REG_NOSUB))) {
+	    free_pat(match);
+	    break;
+	}
+	if(sec->merge_str && !pat_lit(&sec->merge_lit, sec->merge_str) &&
+	   (ret = regcomp((re = &sec->merge), sec->merge_str, REG_EXTENDED | REG_NOSUB))) {
+	    free_pat(match);
+	    if(sec->reject_str)
+		free_pat(reject);
+	    break;
+	}
+	nexact += sec->match_lit.type == PAT_EXACT && !sec->reject_str;
+    }
+    if(sec == conf + nconf) {
+	if(!(slow_sec = malloc(nconf * sizeof(*slow_sec)))) {
+	    jlog(JL_ERR, "%s: %s\n", "sections", strerror(errno));
+	    goto err;
+	}
+	/* if there's no memory for the table, everything is slow */
+	for(i = 4; i < nexact * 2; i *= 2);
+	if(nexact && (exact_tab = malloc(i * sizeof(*exact_tab)))) {
+	    memset(exact_tab, 0xff, i * sizeof(*exact_tab));
+	    exact_mask = i - 1;
+	}
+	for(i = 0; i < nconf; i++)
+	    if(exact_tab && conf[i].match_lit.type == PAT_EXACT && !conf[i].reject_str)
+		exact_add(i);
+	    else
+		slow_sec[nslow++] = i;
+	return 1;
+    }
+    regerror(ret, re, msg, sizeof(msg));
+    jlog(JL_ERR, "section %s: %s pattern error: %s\n",
+	 sec->name ? sec->name : "[unnamed]", re == &sec->match ? "match" :
+	 re == &sec->reject ? "reject" : "merge", msg);
+    regfree(re);
+err:
+    while(--sec >= conf) {
+	free_pat(match);
+	if(sec->reject_str)
+	    free_pat(reject);
+	if(sec->merge_str)
+	    free_pat(merge);
+    }
+    return 0;
+}
+
+/* The log:  jlog() formats each message into a slot of log_ring and
+ * a writer thread, started by the first message, writes them out in
+ * batches.  Producers claim slots by advancing log_head with a CAS; a
+ * slot's seq is 2 * lap while free and 2 * lap + 1 once filled, so the
+ * (zeroed) ring needs no initialization.  If the ring is full, the message
+ * is dropped and counted.  Each call site is also limited to LOG_BURST
+ * messages per second, so a message in a per-event or per-ioctl path
+ * can't flood the log.  fini() writes out whatever is left. */
+#define LOG_SLOTS 128 /* must be a power of 2 */
+#define LOG_LEN 512 /* enough for a lat_dump() line */
+#define LOG_BURST 64
+static struct logslot {
+    unsigned seq;
+    unsigned len;
+    char msg[LOG_LEN];
+} log_ring[LOG_SLOTS];
+static unsigned log_head, log_tail; /* free-running; tail only in log_drain() */
+static unsigned log_lost; /* messages dropped due to a full ring */
+static struct logsite *log_sites; /* rate-limited sites, for log_flush() */
+static int log_state; /* 0: no writer yet, 1: writer running, -1: no writer */
+static int log_efd = -1; /* eventfd to wake the writer */
+static int log_sleeping; /* writer is (about to be) waiting on log_efd */
+/* held while writing, so fini() and the writer don't interleave */
+static pthread_mutex_t log_wlock = PTHREAD_MUTEX_INITIALIZER;
+
+#define log_lap(pos) ((pos) / LOG_SLOTS * 2)
+
+static void log_write(const char *s, size_t len)
+{
+    ssize_t r;
+    while(len > 0) {
+	r = write(fileno(logf), s, len);
+	if(r < 0 && errno == EINTR)
+	    continue;
+	if(r <= 0)
+	    return;
+	s += r;
+	len -= r;
+    }
+}
+
+/* write out all filled slots in order; must be called with log_wlock held */
+static void log_drain(void)
+{
+    char out[4096];
+    size_t n = 0;
+    unsigned lost;
+    struct logslot *s;
+
+    for(;; log_tail++) {
+	s = &log_ring[log_tail % LOG_SLOTS];
+	if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != log_lap(log_tail) + 1)
+	    break;
+	if(n + s->len > sizeof(out)) {
+	    log_write(out, n);
+	    n = 0;
+	}
+	memcpy(out + n, s->msg, s->len);
+	n += s->len;
+	__atomic_store_n(&s->seq, log_lap(log_tail) + 2, __ATOMIC_RELEASE);
+    }
+    if((lost = __atomic_exchange_n(&log_lost, 0, __ATOMIC_RELAXED))) {
+	if(n + 60 > sizeof(out)) {
+	    log_write(out, n);
+	    n = 0;
+	}
+	n += sprintf(out + n, "(log full; %u messages lost)\n", lost);
+    }
+    if(n)
+	log_write(out, n);
+}
+
+static int log_pending(void)
+{
+    return __atomic_load_n(&log_ring[log_tail % LOG_SLOTS].seq, __ATOMIC_SEQ_CST) ==
+	   log_lap(log_tail) + 1 || __atomic_load_n(&log_lost, __ATOMIC_RELAXED);
+}
+
+static void *log_writer(void *arg)
+{
+    uint64_t v;
+    (void)arg;
+    while(1) {
+	pthread_mutex_lock(&log_wlock);
+	log_drain();
+	__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+	/* anything queued before the flag was visible didn't wake us */
+	if(log_pending()) {
+	    __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&log_wlock);
+	    continue;
+	}
+	pthread_mutex_unlock(&log_wlock);
+	if(real_read(log_efd, &v, sizeof(v)) < 0 && errno != EINTR)
+	    return NULL;
+    }
+}
+
+static void log_prefork(void)
+{
+    pthread_mutex_lock(&log_wlock);
+}
+
+static void log_parent(void)
+{
+    pthread_mutex_unlock(&log_wlock);
+}
+
+/* the writer doesn't survive fork(); what's queued is the parent's to write */
+static void log_child(void)
+{
+    memset(log_ring, 0, sizeof(log_ring));
+    log_head = log_tail = log_lost = 0;
+    log_sleeping = 0;
+    if(log_efd >= 0)
+	real_close(log_efd);
+    log_efd = -1;
+    log_state = 0;
+    pthread_mutex_init(&log_wlock, NULL);
+}
+
+/* start the writer; without one, messages are written synchronously */
+static void log_start(void)
+{
+    static int atfork = 0;
+    sigset_t all, old;
+    pthread_t t;
+    int r;
+    pthread_mutex_lock(&log_wlock);
+    if(log_state) {
+	pthread_mutex_unlock(&log_wlock);
+	return;
+    }
+    log_state = -1;
+    if((log_efd = eventfd(0, EFD_CLOEXEC)) >= 0) {
+	/* signals are for the program's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&t, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(!r) {
+	    pthread_detach(t);
+	    log_state = 1;
+	} else {
+	    real_close(log_efd);
+	    log_efd = -1;
+	}
+    }
+    if(!atfork++)
+	pthread_atfork(log_prefork, log_parent, log_child);
+    pthread_mutex_unlock(&log_wlock);
+}
+
+static void log_put(struct logsite *site, const char *fmt, ...)
+{
+    struct timespec ts;
+    struct logslot *s;
+    unsigned pos, dropped, seq;
+    va_list ap;
+    int len = 0, r;
+    uint64_t one = 1;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    if(__atomic_load_n(&site->sec, __ATOMIC_RELAXED) != ts.tv_sec) {
+	/* a few extra may get through if threads race here; that's OK */
+	__atomic_store_n(&site->sec, ts.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&site->n, 0, __ATOMIC_RELAXED);
+    }
+    if(__atomic_add_fetch(&site->n, 1, __ATOMIC_RELAXED) > LOG_BURST) {
+	if(!__atomic_fetch_add(&site->dropped, 1, __ATOMIC_RELAXED) &&
+	   !__atomic_exchange_n(&site->listed, 1, __ATOMIC_RELAXED)) {
+	    site->fmt = fmt;
+	    site->next = __atomic_load_n(&log_sites, __ATOMIC_RELAXED);
+	    while(!__atomic_compare_exchange_n(&log_sites, &site->next, site, 1,
+					       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	return;
+    }
+    if(!__atomic_load_n(&log_state, __ATOMIC_ACQUIRE))
+	log_start();
+    pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    while(1) {
+	s = &log_ring[pos % LOG_SLOTS];
+	seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+	if(seq == log_lap(pos)) {
+	    if(__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	} else if((int)(seq - log_lap(pos)) < 0) {
+	    /* still holds a message from the previous lap */
+	    __atomic_add_fetch(&log_lost, 1, __ATOMIC_RELAXED);
+	    return;
+	} else
+	    pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    }
+    if((dropped = __atomic_exchange_n(&site->dropped, 0, __ATOMIC_RELAXED)))
+	len = snprintf(s->msg, LOG_LEN, "(%u more \"%.*s\" suppressed)\n", dropped,
+		       (int)strcspn(fmt, "\n"), fmt);
+    va_start(ap, fmt);
+    r = vsnprintf(s->msg + len, LOG_LEN - len, fmt, ap);
+    va_end(ap);
+    if(r < 0)
+	r = 0;
+    else if(len + r >= LOG_LEN) {
+	r = LOG_LEN - len - 1;
+	s->msg[LOG_LEN - 2] = '\n';
+    }
+    s->len = len + r;
+    __atomic_store_n(&s->seq, log_lap(pos) + 1, __ATOMIC_SEQ_CST);
+    if(log_state < 0) {
+	pthread_mutex_lock(&log_wlock);
+	log_drain();
+	pthread_mutex_unlock(&log_wlock);
+    } else if(__atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST) &&
+	      write(log_efd, &one, sizeof(one)) < 0) {
+	/* nothing to be done about it */
+    }
+}
+
+/* write out everything queued so far, and what's been suppressed (at exit) */
+static void log_flush(void)
+{
+    struct logsite *site;
+    unsigned dropped;
+    char ln[200];
+    if(!logf)
+	return;
+    pthread_mutex_lock(&log_wlock);
+    log_drain();
+    for(site = __atomic_load_n(&log_sites, __ATOMIC_ACQUIRE); site; site = site->next)
+	if((dropped = __atomic_exchange_n(&site->dropped, 0, __ATOMIC_RELAXED)))
+	    log_write(ln, snprintf(ln, sizeof(ln), "(%u more \"%.*s\" suppressed)\n",
+				   dropped, (int)strcspn(site->fmt, "\n"), site->fmt));
+    pthread_mutex_unlock(&log_wlock);
+}
+
+/* open the log; not done until something might be printed */
+static void log_open(void)
+{
+    const char *logn;
+
+    if(logf)
+	return;
+    if((logn = getenv("EV_JOY_REMAP_LOG_LEVEL")) && *logn)
+	log_level = atoi(logn);
+    logn = getenv("EV_JOY_REMAP_LOG");
+    if(logn) {
+	/* only written with write(2) by log_drain() */
+	logf = fopen(logn, "w");
+	if(!logf)
+	    perror(logn);
+    }
+    if(!logf)
+	logf = stderr;
+}
+
+/* resolve the real functions */
+/* is this too early for file I/O?  apparently not */
+/* dlopen() docs say this must be exported, but again, apparently not */
+/* note that this attribute works with clang as well */
+
+__attribute__((constructor))
+static void init(void)
+{
+#if CAP_SYSCALL
+    real_syscall = dlsym(RTLD_NEXT, "syscall");  /* needs to be first! */
+#endif
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_open64 = dlsym(RTLD_NEXT, "open64");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_chdir = dlsym(RTLD_NEXT, "chdir");
+    real_fchdir = dlsym(RTLD_NEXT, "fchdir");
+    real_poll = dlsym(RTLD_NEXT, "poll");
+    real_ppoll = dlsym(RTLD_NEXT, "ppoll");
+    real_select = dlsym(RTLD_NEXT, "select");
+    real_pselect = dlsym(RTLD_NEXT, "pselect");
+    real_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+    real_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+    real_epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+#if CAP_OPENAT
+    real_openat = dlsym(RTLD_NEXT, "openat");
+    real_openat64 = dlsym(RTLD_NEXT, "openat64");
+#endif
+#if CAP_FOPEN
+    real_fopen = dlsym(RTLD_NEXT, "fopen");
+    real_fopen64 = dlsym(RTLD_NEXT, "fopen64");
+    real_fclose = dlsym(RTLD_NEXT, "fclose");
+#endif
+#if 0
+    real_dup = dlsym(RTLD_NEXT, "dup");
+    real_dup2 = dlsym(RTLD_NEXT, "dup2");
+    real_dlopen = dlsym(RTLD_NEXT, "dlopen");
+#endif
+    const char *s;
+
+    /* everything else waits for the first input device (see load_conf()), */
+    /* except for modes which need to be in place before that */
+    check_all = (s = getenv("EV_JOY_REMAP_CHECK_ALL")) && *s;
+    if((s = getenv("EV_JOY_REMAP_STATS")) && *s) {
+	log_open();
+	stat_init();
+    }
+    if((s = getenv("EV_JOY_REMAP_FAKE")) && *s && (fake_dir = strdup(s))) {
+	int i;
+	log_open();
+	for(i = strlen(fake_dir); i > 1 && fake_dir[i - 1] == '/'; i--)
+	    fake_dir[i - 1] = 0;
+	fake_len = i;
+	for(i = 0; i < FAKE_MAX; i++)
+	    fake_fds[i].fd = -1;
+	libc_ioctl = real_ioctl;
+	real_ioctl = fake_ioctl;
+    }
+}
+
+/* parse config file */
+/* this is only done once the first input device is opened, via */
+/* pthread_once() in ev_open(), since most processes never open one */
+static void load_conf(void)
+{
+    const char *fname = getenv("EV_JOY_REMAP_CONFIG"), *logn;
+    FILE *f;
+    long fsize;
+    char *cfg;
+    struct evjrconf *sec;
+    struct stat st;
+    char cname[PATH_MAX + 20], cpath[PATH_MAX], home[256];
+    int cache;
+    unsigned long long hash;
+
+    log_open();
+    if((logn = getenv("EV_JOY_REMAP_LATENCY")) && *logn) {
+	lat_on = 1;
+	lat_period = atoi(logn);
+    }
+    if((logn = getenv("EV_JOY_REMAP_RECORD")) && *logn) {
+	rec_fn = logn;
+	pthread_atfork(NULL, NULL, rec_fork);
+    }
+    if(fname && *fname)
+	f = fopen(fname, "r");
+    else if(!(f = fopen((fname = "ev_joy_remap.conf"), "r"))) {
+	if((fname = getenv("HOME")) && *fname) {
+	    sprintf(home, "%.200s/.config/ev_joy_remap.conf", fname);
+	    f = fopen((fname = home), "r");
+	}
+	if(!f)
+	    f = fopen("/etc/ev_joy_remap.conf", "r");
+    }
+    if(!f) {
+	jlog(JL_ERR, "%s: %s\n", fname, strerror(errno));
+	return;
+    }
+    /* config should be short enough to fit in memory */
+    /* this eliminates the need for line read gymnastics */
+    if(fseek(f, 0, SEEK_END) || (fsize = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) ||
+       !(cfg = malloc(fsize + 1))) {
+	jlog(JL_ERR, "%s: %s\n", fname, strerror(errno));
+	fclose(f);
+	return;
+    }
+    if(fread(cfg, fsize, 1, f) != 1 || fstat(fileno(f), &st)) {
+	jlog(JL_ERR, "%s: %s\n", fname, strerror(errno));
+	fclose(f);
+	free(cfg);
+	errno = 0;
+	return;
+    }
+    fclose(f);
+    hash = conf_hash(cfg, fsize);
+    if((cache = conf_cache_name(fname, cname, cpath)) &&
+       conf_load(cname, cpath, &st, hash)) {
+	free(cfg);
+	cfg = NULL;
+	goto enable;
+    }
+    sec = conf = calloc(sizeof(*conf), (nconf = 1));
+    if(!conf) {
+	jlog(JL_ERR, "%s: %s\n", "conf", strerror(errno));
+	free(cfg);
+	nconf = 0;
+	errno = 0;
+	return;
+    }
+    cfg[fsize] = 0;
+    char *ln = cfg, *e, c;
+    sec->ax_map = calloc((sec->max_ax = 18), sizeof(*sec->ax_map));
+    sec->bt_map = calloc((sec->max_bt = 15), sizeof(*sec->bt_map));
+    if(!sec->ax_map || !sec->bt_map) {
+	jlog(JL_ERR, "%s: %s\n", "mapping", strerror(errno));
+	free(cfg);
+	if(sec->ax_map)
+	    free(sec->ax_map);
+	if(sec->bt_map)
+	    free(sec->bt_map);
+	errno = 0;
+	return;
+    }
+    sec->auto_ax = -1;
+    sec->auto_bt = BTN_A - 1;
+    int lno = 1;
+#define abort_parse(msg) do { \
+    jlog(JL_ERR, "error parsing map on line %d: " msg "\n", lno); \
+    goto err; \
+} while(0)
+#define map_resize(what, sz) do { \
+    if(sec->max_##what < sz) { \
+	int old_max = sec->max_##what; \
+	void *old_map = sec->what##_map; \
+	if(!old_max) \
+	    sec->max_##what = sz < 18 ? 18 : sz; \
+	while(sec->max_##what < sz) \
+	    sec->max_##what *= 2; \
+	sec->what##_map = realloc(sec->what##_map, sec->max_##what * sizeof(*sec->what##_map)); \
+	if(!sec->what##_map) { \
+	    sec->what##_map = old_map; \
+	    abort_parse(#what " map too large"); \
+	} \
+	memset(sec->what##_map + old_max, 0, (sec->max_##what - old_max) * sizeof(*sec->what##_map)); \
+    } \
+} while(0)
+    int i, ret;
+    int has_conf = 0;
+    while(1) {
+	while(isspace(*ln)) {
+	    if(*ln == '\n')
+		lno++;
+	    ln++;
+	}
+	if(!*ln)
 	    break;
 	if(*ln == '#') {
 	    while(*++ln && *ln != '\n');
@@ -768,7 +2339,7 @@ static void init(void)
 		if(*ln) {
 		    sec->name = strdup(ln);
 		    if(!sec->name) {
-			fprintf(logf, "%s: %s\n", "sec name", strerror(errno));
+			jlog(JL_ERR, "%s: %s\n", "sec name", strerror(errno));
 			goto err;
 		    }
 		}
@@ -779,7 +2350,7 @@ static void init(void)
 		conf = realloc(conf, ++nconf * sizeof(*conf));
 		if(!conf) {
 		    conf = sec;
-		    fprintf(logf, "%s: %s\n", "expand conf", strerror(errno));
+		    jlog(JL_ERR, "%s: %s\n", "expand conf", strerror(errno));
 		    goto err;
 		}
 		sec = &conf[nconf - 1];
@@ -787,7 +2358,7 @@ static void init(void)
 		if(*ln) {
 		    sec->name = strdup(ln);
 		    if(!sec->name) {
-			fprintf(logf, "%s: %s\n", "sec name", strerror(errno));
+			jlog(JL_ERR, "%s: %s\n", "sec name", strerror(errno));
 			goto err;
 		    }
 		}
@@ -837,41 +2408,38 @@ static void init(void)
 	    dupstr(repl_name);
 	    dupstr(repl_id);
 	    dupstr(repl_uniq);
-#define comp_regex(s, type) do { \
-    if((ret = regcomp(&sec->type, s, REG_EXTENDED | REG_NOSUB))) { \
-	regerror(ret, &sec->type, buf, sizeof(buf)); \
-	fprintf(logf, #type " pattern error: %.*s\n", (int)sizeof(buf), buf); \
-	regfree(&sec->type); \
-	goto err; \
-    } \
+/* patterns are compiled by conf_regcomp(), after EV_JOY_REMAP_ENABLE */
+#define save_regex(s, type) do { \
     sec->type##_str = strdup(s); \
     if(!sec->type##_str) { \
-	fprintf(logf, "%s: %s\n", s, strerror(errno)); \
-	regfree(&sec->type); \
+	jlog(JL_ERR, "%s: %s\n", s, strerror(errno)); \
 	goto err; \
     } \
 } while(0)
 #define dupre(r) do { \
     if(conf[i].r##_str) \
-	comp_regex(conf[i].r##_str, r); \
+	save_regex(conf[i].r##_str, r); \
 } while(0)
 	    dupre(match);
 	    dupre(reject);
+	    dupre(merge);
 	    break;
 	  case KW_MATCH:
 #define parse_regex(type) do { \
     if(sec->type##_str) { \
 	free(sec->type##_str); \
 	sec->type##_str = NULL; \
-	regfree(&sec->type); \
     } \
-    comp_regex(ln, type); \
+    save_regex(ln, type); \
 } while(0)
 	    parse_regex(match);
 	    break;
 	  case KW_REJECT:
 	    parse_regex(reject);
 	    break;
+	  case KW_MERGE:
+	    parse_regex(merge);
+	    break;
 	  case KW_FILTER:
 	    if(*ln)
 		abort_parse("filter takes no parameter");
@@ -1322,6 +2890,89 @@ static void init(void)
 		abort_parse("syn_drop takes no parameter");
 	    sec->syn_drop = 1;
 	    break;
+	  case KW_PERSIST:
+	    if(*ln)
+		abort_parse("persist takes no parameter");
+	    sec->persist = 1;
+	    break;
+	  case KW_FEED:
+	    if(*ln)
+		abort_parse("feed takes no parameter");
+	    sec->feed = 1;
+	    break;
+	  case KW_AUTOFIRE:
+	    while(*ln) {
+		int bt = bnum(&ln);
+		if(bt < 0 || bt >= KEY_CNT)
+		    abort_parse("invalid autofire button");
+		if(*ln++ != '=')
+		    abort_parse("autofire w/o =");
+		double hz = strtod(ln, &ln);
+		if(!(hz >= 0.1 && hz <= 500))
+		    abort_parse("invalid autofire rate");
+		if(*ln && *ln != ',')
+		    abort_parse("invalid autofire entry");
+		if(*ln)
+		    ln++;
+		for(i = 0; i < sec->nautofire; i++)
+		    if(sec->autofire[i].code == bt)
+			break;
+		if(i == MAX_AUTOFIRE)
+		    abort_parse("too many autofire buttons");
+		if(i == sec->nautofire)
+		    sec->nautofire++;
+		sec->autofire[i].code = bt;
+		sec->autofire[i].half_ns = 500000000 / hz;
+	    }
+	    break;
+	  case KW_CHORD:
+	    while(*ln) {
+		int bt = bnum(&ln), nk = 0;
+		unsigned mask = 0;
+		if(bt < 0 || bt >= KEY_CNT)
+		    abort_parse("invalid chord output");
+		if(*ln++ != '=')
+		    abort_parse("chord w/o =");
+		do {
+		    int m, k = bnum(&ln);
+		    if(k < 0 || k >= KEY_CNT)
+			abort_parse("invalid chord button");
+		    for(m = 0; m < sec->nchmember; m++)
+			if(sec->chmember[m] == k)
+			    break;
+		    if(m == MAX_CHORD_MEMBERS)
+			abort_parse("too many chord buttons");
+		    if(m == sec->nchmember)
+			sec->chmember[sec->nchmember++] = k;
+		    if(mask & (1U << m))
+			abort_parse("duplicate chord button");
+		    mask |= 1U << m;
+		    nk++;
+		} while(*ln == '+' && ++ln);
+		if(nk < 2 || nk > MAX_CHORD_KEYS)
+		    abort_parse("chords need 2 to 4 buttons");
+		if(*ln && *ln != ',')
+		    abort_parse("invalid chord entry");
+		if(*ln)
+		    ln++;
+		for(i = 0; i < sec->nchord; i++)
+		    if(sec->chord[i].mask == mask)
+			break;
+		if(i == MAX_CHORD)
+		    abort_parse("too many chords");
+		if(i == sec->nchord)
+		    sec->nchord++;
+		sec->chord[i].code = bt;
+		sec->chord[i].mask = mask;
+	    }
+	    break;
+	  case KW_CHORD_WINDOW: {
+	    double ms = strtod(ln, &ln);
+	    if(*ln || !(ms > 0 && ms <= 1000))
+		abort_parse("invalid chord window");
+	    sec->chord_window = ms * 1000;
+	    break;
+	  }
 	}
 	*e = c;
 	ln = e;
@@ -1331,6 +2982,8 @@ static void init(void)
 	    sec->filter_ax = 0;
 	if(sec->filter_bt < 0)
 	    sec->filter_bt = 0;
+	if(!sec->chord_window)
+	    sec->chord_window = 5000;
 	/* disable individual passthrough for mapped outputs */
 #define dis_ax(axno) do { \
     if(axno >= 0) { \
@@ -1377,18 +3030,23 @@ static void init(void)
 	 * permissions, I'm forcing you to have a pattern */
 	/* if this is just used to rename joysticks, it still needs a dummy pattern */
 	if(!sec->match_str) {
-	    fprintf(logf, "section %s: ", sec->name ? sec->name : "[unnamed]");
-	    abort_parse("match pattern required");
+	    jlog(JL_ERR, "section %s: match pattern required\n",
+		 sec->name ? sec->name : "[unnamed]");
+	    goto err;
 	}
     }
     free(cfg);
     cfg = NULL;
+    if(cache)
+	conf_save(cname, cpath, &st, hash);
+enable:;
     const char *ensec_s = getenv("EV_JOY_REMAP_ENABLE");
     if(ensec_s && *ensec_s) {
 	regex_t re;
+	char msg[256];
 	if((ret = regcomp(&re, ensec_s, REG_EXTENDED | REG_NOSUB))) {
-	    regerror(ret, &re, buf, sizeof(buf));
-	    fprintf(logf, "EV_JOY_REMAP_ENABLE pattern error: %.*s\n", (int)sizeof(buf), buf);
+	    regerror(ret, &re, msg, sizeof(msg));
+	    jlog(JL_ERR, "EV_JOY_REMAP_ENABLE pattern error: %s\n", msg);
 	    regfree(&re);
 	    goto err;
 	}
@@ -1401,18 +3059,27 @@ static void init(void)
 	    }
 	regfree(&re);
 	if(!nconf) {
-	    fputs("No sections enabled for remapper; disabled\n", logf);
+	    jlog(JL_WARN, "No sections enabled for remapper; disabled\n");
 	    errno = 0;
 	    return;
 	}
     }
-    fputs("Installed event device remapper\n", logf);
+    if(!conf_regcomp())
+	goto err;
+    match_init(cache ? cname : NULL, hash);
+    jlog(JL_INFO, "Installed event device remapper\n");
     errno = 0;
     return;
 err:
-    for(sec = conf; nconf; nconf--, sec++)
-	free_conf(sec);
-    free(conf);
+    if(conf_map) {
+	munmap(conf_map, conf_maplen);
+	conf_map = NULL;
+	nconf = 0;
+    } else {
+	for(sec = conf; nconf; nconf--, sec++)
+	    free_conf(sec);
+	free(conf);
+    }
     if(cfg)
 	free(cfg);
     errno = 0;
@@ -1420,6 +3087,9 @@ err:
 
 static void free_conf(struct evjrconf *sec)
 {
+    /* everything's in the mapping */
+    if(conf_map)
+	return;
     if(sec->ax_map)
 	free(sec->ax_map);
     if(sec->bt_map)
@@ -1428,14 +3098,13 @@ static void free_conf(struct evjrconf *sec)
 	free(sec->jsaxmap);
     if(sec->jsbtmap)
 	free(sec->jsbtmap);
-#define free_re(r) do { \
-    if(sec->r##_str) { \
-	regfree(&sec->r); \
-	free(sec->r##_str); \
-    } \
-} while(0)
-    free_re(match);
-    free_re(reject);
+    /* regexes are compiled only after sections are done being freed */
+    if(sec->match_str)
+	free(sec->match_str);
+    if(sec->reject_str)
+	free(sec->reject_str);
+    if(sec->merge_str)
+	free(sec->merge_str);
     if(sec->repl_uniq)
 	free(sec->repl_uniq);
     if(sec->repl_id)
@@ -1469,46 +3138,253 @@ static int js_ev(int q, int is_js)
 	real_close(d);
 	return -1;
     }
-    /* no need to use readdir_r, as different streams use different dirents */
-    const struct dirent *de;
-    int noff = is_js ? 5 : 2;
-    const char *n = is_js ? "event" : "js";
-    while((de = readdir(dp))) {
-	if(memcmp(de->d_name, n, noff) || !isdigit(de->d_name[noff]))
-	    continue;
-	int ret = atoi(de->d_name + noff);
-	closedir(dp);
-	return ret;
+    /* no need to use readdir_r, as different streams use different dirents */
+    const struct dirent *de;
+    int noff = is_js ? 5 : 2;
+    const char *n = is_js ? "event" : "js";
+    while((de = readdir(dp))) {
+	if(memcmp(de->d_name, n, noff) || !isdigit(de->d_name[noff]))
+	    continue;
+	int ret = atoi(de->d_name + noff);
+	closedir(dp);
+	return ret;
+    }
+    closedir(dp);
+    return -1;
+}
+
+/* compile sec's maps into cap's translation tables */
+/* inmin and insum are the device's minimum and minimum + maximum for
+ * AXFL_INVERT/RESCALE axes */
+static void compile_xl(struct evfdcap *cap, const struct evjrconf *sec,
+		       const int *inmin, const int *insum)
+{
+    int i;
+    cap->xl_grow = 1;
+    for(i = 0; i < KEY_CNT; i++) {
+	struct xlkey *x = &cap->xl_key[i];
+	const struct butmap *m = NULL;
+	memset(x, 0, sizeof(*x));
+	x->code = i;
+	if(i < sec->bt_low || i >= sec->bt_low + sec->nbt ||
+	   !((m = &sec->bt_map[i - sec->bt_low])->flags & BTFL_MAP))
+	    x->op = sec->filter_bt ? XL_DROP : XL_MAP;
+	else if(m->target == -1)
+	    x->op = XL_DROP;
+	else if(m->flags & BTFL_AXIS) {
+	    x->op = XL_KEY_AX;
+	    x->mod = 1;
+	    x->onax = m->onax;
+	    x->offax = m->offax;
+	    x->onval = m->onval;
+	    x->offval = m->offval;
+	} else {
+	    x->op = XL_MAP;
+	    x->code = m->target;
+	    if(m->flags & BTFL_INVERT) {
+		x->neg = -1;
+		x->add = 1;
+	    }
+	    x->mod = x->code != i || x->neg;
+	}
+	if(x->op == XL_MAP && cap->tfd >= 0) {
+	    int a;
+	    for(a = 0; a < sec->nchmember; a++)
+		if(sec->chmember[a] == x->code) {
+		    x->op = XL_KEY_CHORD;
+		    x->onax = a;
+		    x->mod = 1;
+		    /* a flush of held presses, and then a chord's keys */
+		    cap->xl_grow = 1 + 2 * MAX_CHORD_KEYS;
+		    break;
+		}
+	    for(a = 0; x->op == XL_MAP && a < sec->nautofire; a++)
+		if(sec->autofire[a].code == x->code) {
+		    x->op = XL_KEY_AF;
+		    x->onax = a;
+		    break;
+		}
+	}
+    }
+    for(i = 0; i < ABS_CNT; i++) {
+	struct xlabs *x = &cap->xl_abs[i];
+	const struct axmap *m = NULL;
+	memset(x, 0, sizeof(*x));
+	x->code = i;
+	if(i >= sec->nax || !((m = &sec->ax_map[i])->flags & AXFL_MAP))
+	    x->op = sec->filter_ax ? XL_DROP : XL_MAP;
+	else if(m->target == -1)
+	    x->op = XL_DROP;
+	else if(m->flags & AXFL_BUTTON) {
+	    x->op = XL_ABS_KEY;
+	    x->mod = 1;
+	    if(cap->xl_grow < 2) /* both sides at once */
+		cap->xl_grow = 2;
+	    x->code = m->target;
+	    x->ncode = m->ntarget;
+	    x->onthresh = m->onthresh;
+	    x->offthresh = m->offthresh;
+	    x->nonthresh = m->nonthresh;
+	    x->noffthresh = m->noffthresh;
+	} else if(m->flags & AXFL_RESCALE) {
+	    x->op = XL_ABS_SCALE;
+	    x->mod = 1;
+	    x->code = m->target;
+	    x->sc.omin = inmin[i];
+	    x->sc.orange = (long)insum[i] - 2 * inmin[i] + 1;
+	    x->sc.nmin = m->ai.minimum;
+	    x->sc.nrange = (long)m->ai.maximum - m->ai.minimum + 1;
+	    x->sc.nsum = m->ai.minimum + m->ai.maximum;
+	    x->sc.invert = !!(m->flags & AXFL_INVERT);
+	    rescale_setup(&x->sc);
+	} else {
+	    x->op = XL_MAP;
+	    x->code = m->target;
+	    if(m->flags & AXFL_INVERT) {
+		x->neg = -1;
+		x->add = insum[i];
+	    }
+	    x->mod = x->code != i || x->neg;
+	}
+    }
+}
+
+/* replace the capture table's top level with one that has page p */
+/* must be called with lock held */
+static struct captab *cap_grow(unsigned p)
+{
+    struct captab *o = cap_tab, *t;
+    unsigned n = o ? o->npg : CAPTAB_NPG;
+    while(n <= p)
+	n *= 2;
+    t = calloc(1, sizeof(*t) + n * sizeof(t->pg[0]));
+    if(!t) {
+	jlog(JL_ERR, "%s: %s\n", "fd tracker", strerror(errno));
+	return NULL;
+    }
+    t->npg = n;
+    if(o)
+	memcpy(t->pg, o->pg, o->npg * sizeof(o->pg[0]));
+    __atomic_store_n(&cap_tab, t, __ATOMIC_RELEASE);
+    return t;
+}
+
+/* set (or clear, if cap is NULL) the capture table entry for fd */
+/* must be called with lock held */
+static int cap_set(int fd, struct evfdcap *cap)
+{
+    struct captab *t = cap_tab;
+    struct evfdcap **pg, *old;
+    unsigned p = (unsigned)fd >> CAPTAB_BITS;
+    if(fd < 0)
+	return -1;
+    if(!t || p >= t->npg) {
+	if(!cap)
+	    return 0;
+	if(!(t = cap_grow(p)))
+	    return -1;
+    }
+    if(!(pg = t->pg[p])) {
+	if(!cap)
+	    return 0;
+	pg = calloc(CAPTAB_PGSZ, sizeof(*pg));
+	if(!pg) {
+	    jlog(JL_ERR, "%s: %s\n", "fd tracker", strerror(errno));
+	    return -1;
+	}
+	__atomic_store_n(&t->pg[p], pg, __ATOMIC_RELEASE);
     }
-    closedir(dp);
-    return -1;
+    old = pg[fd & (CAPTAB_PGSZ - 1)];
+    __atomic_store_n(&pg[fd & (CAPTAB_PGSZ - 1)], cap, __ATOMIC_RELEASE);
+    if(!old != !cap)
+	__atomic_add_fetch(&ncap, cap ? 1 : -1, __ATOMIC_RELEASE);
+    return 0;
 }
 
-/* capture event device and prepare ioctl returns */
-static void init_evdev(int fd, const struct evjrconf *sec)
+/* get a fresh capture for fd from the free list, or a new one */
+/* new ones are added to cap_list, which never shrinks, so it can be
+ * walked without the lock; check cap_of(c->fd) == c for live ones */
+static struct evfdcap *cap_alloc(int fd, const struct evjrconf *sec)
 {
-    /* could use local lock, but it needs to be shared with close() */
-    pthread_mutex_lock(&lock);
     struct evfdcap *cap;
-    if(!(cap = free_ev_fd)) {
-	cap = malloc(sizeof(*cap));
-	if(!cap) {
-	    fprintf(logf, "%s: %s\n", "fd tracker", strerror(errno));
-	    nconf = 0;
-	}
-    } else {
-	/* critical section w/ cap assignment, protected by lock */
+    int i;
+    take_lock();
+    if((cap = free_ev_fd))
 	free_ev_fd = cap->next;
+    else if((cap = malloc(sizeof(*cap)))) {
+	pthread_mutex_init(&cap->lk, NULL);
+	cap->lnext = cap_list;
+	__atomic_store_n(&cap_list, cap, __ATOMIC_RELEASE);
     }
-    if(cap) {
-	memset(cap, 0, sizeof(*cap));
-	cap->fd = fd;
-	cap->conf = sec;
-    }
+    pthread_mutex_unlock(&lock);
     if(!cap) {
-	pthread_mutex_unlock(&lock);
-	return;
+	jlog(JL_ERR, "%s: %s\n", "fd tracker", strerror(errno));
+	nconf = 0;
+	return NULL;
     }
+    memset(&cap->conf, 0, sizeof(*cap) - offsetof(struct evfdcap, conf));
+    cap->fd = fd;
+    cap->conf = sec;
+    for(i = 0; i < MAX_EPOLL; i++)
+	cap->ep[i].fd = -1;
+    cap->tfd = -1;
+    cap->mfd = -1;
+    cap->clkid = CLOCK_REALTIME; /* evdev default */
+    cap->rec_dev = -1;
+    return cap;
+}
+
+/* return a capture to the free list; it must no longer be in the table */
+static void cap_free(struct evfdcap *cap)
+{
+    take_lock();
+    cap->next = free_ev_fd;
+    free_ev_fd = cap;
+    pthread_mutex_unlock(&lock);
+}
+
+/* find the source of each of cap's output axes for EVIOCGABS */
+/* must be redone whenever cap's merged devices change */
+static void gabs_build(struct evfdcap *cap)
+{
+    const struct evjrconf *sec = cap->conf;
+    int ax, i;
+    for(ax = 0; ax < ABS_MAX; ax++) {
+	struct gabs *g = &cap->gabs[ax];
+	g->how = GABS_NONE;
+	g->src = 0;
+	for(i = 0; i < cap->nmerged; i++)
+	    if(ULISSET(cap->merged[i]->absout, ax)) {
+		g->how = GABS_MERGED;
+		g->src = i;
+		break;
+	    }
+	for(i = 0; g->how == GABS_NONE && i < sec->nax; i++)
+	    if((sec->ax_map[i].flags & (AXFL_MAP | AXFL_BUTTON)) == AXFL_MAP &&
+	       sec->ax_map[i].target == ax) {
+		g->how = GABS_AX;
+		g->src = i;
+	    }
+	for(i = 0; g->how == GABS_NONE && i < sec->nbt; i++)
+	    if((sec->bt_map[i].flags & (BTFL_MAP | BTFL_AXIS)) == (BTFL_MAP | BTFL_AXIS) &&
+	       (sec->bt_map[i].onax == ax || sec->bt_map[i].offax == ax))
+		g->how = GABS_BT;
+	if(g->how == GABS_NONE && !sec->filter_ax &&
+	   (ax >= sec->nax || !(sec->ax_map[ax].flags & AXFL_MAP)))
+	    g->how = GABS_PASS;
+    }
+}
+
+static int ev_gkey(struct evfdcap *cap);
+
+/* capture event device and prepare ioctl returns */
+/* a merged device is only prepared, and never has a timer */
+/* returns the capture, or NULL on errors */
+static struct evfdcap *init_evdev(int fd, const struct evjrconf *sec, int merged)
+{
+    struct evfdcap *cap = cap_alloc(fd, sec);
+    if(!cap)
+	return NULL;
     /* set up ID from string */
     if(sec->repl_id) {
 	real_ioctl(fd, EVIOCGID, &cap->repl_id_val);
@@ -1527,7 +3403,7 @@ static void init_evdev(int fd, const struct evjrconf *sec)
 	    }
 	}
 	if(*s) {
-	    fprintf(logf, "joy-remap:  invalid id @ %s\n", s);
+	    jlog(JL_ERR, "joy-remap:  invalid id @ %s\n", s);
 	    /* really, this should set ncconf to 0 and abort all remapping */
 	    /* just like all other parse errors */
 	    /* maybe I should parse it more in init() */
@@ -1539,14 +3415,15 @@ static void init_evdev(int fd, const struct evjrconf *sec)
 	}
     }
     /* adjust button/axis mappings */
-    static unsigned long absin[MINBITS(ABS_MAX)];
-    memset(absin, 0, sizeof(absin));
+    unsigned long absin[MINBITS(ABS_MAX)] = {};
+    /* compile_xl() reads these for every mapped axis, even disabled ones */
+    int inmin[ABS_CNT] = {}, insum[ABS_CNT] = {};
     memset(cap->keysout, 0, sizeof(cap->keysout));
     /* use cap->keystates as temp buffer for keysin */
     memset(cap->keystates, 0, sizeof(cap->keystates));
     if(real_ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(cap->keystates)), cap->keystates) < 0 ||
        real_ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absin)), absin) < 0) {
-	fprintf(logf, "%s: %s\n", "init_evdev", strerror(errno));
+	jlog(JL_ERR, "%s: %s\n", "init_evdev", strerror(errno));
 	goto err;
     }
     int i;
@@ -1559,7 +3436,7 @@ static void init_evdev(int fd, const struct evjrconf *sec)
 	    continue;
 	}
 	if(!ULISSET(cap->keystates, sec->bt_low + i)) {
-	    fprintf(logf, "warning: disabling button %d due to missing %d\n",
+	    jlog(JL_WARN, "warning: disabling button %d due to missing %d\n",
 		    sec->bt_map[i].target, sec->bt_low + i);
 	    continue;
 	}
@@ -1570,7 +3447,7 @@ static void init_evdev(int fd, const struct evjrconf *sec)
 	if((sec->ax_map[i].flags & (AXFL_MAP | AXFL_BUTTON)) != (AXFL_MAP | AXFL_BUTTON))
 	    continue;
 	if(!ULISSET(absin, i)) {
-	    fprintf(logf, "warning: disabling button %d/%d due to missing axis %d\n",
+	    jlog(JL_WARN, "warning: disabling button %d/%d due to missing axis %d\n",
 		    sec->ax_map[i].target, sec->ax_map[i].ntarget, i);
 	    continue;
 	}
@@ -1589,7 +3466,7 @@ static void init_evdev(int fd, const struct evjrconf *sec)
 	    continue;
 	}
 	if(!ULISSET(absin, i)) {
-	    fprintf(logf, "warning: disabling axis %d due to missing %d\n",
+	    jlog(JL_WARN, "warning: disabling axis %d due to missing %d\n",
 		    sec->ax_map[i].target, i);
 	    continue;
 	}
@@ -1600,18 +3477,18 @@ static void init_evdev(int fd, const struct evjrconf *sec)
 	if(sec->ax_map[i].flags & (AXFL_INVERT | AXFL_RESCALE)) {
 	    struct input_absinfo ai;
 	    if(real_ioctl(fd, EVIOCGABS(i), &ai) < 0) {
-		fprintf(logf, "%s: %s\n", "init_evdev", strerror(errno));
+		jlog(JL_ERR, "%s: %s\n", "init_evdev", strerror(errno));
 		goto err;
 	    }
-	    sec->ax_map[i].offthresh = ai.minimum;
-	    sec->ax_map[i].onthresh = ai.minimum + ai.maximum;
+	    inmin[i] = ai.minimum;
+	    insum[i] = ai.minimum + ai.maximum;
 	}
     }
     for(i = 0; i < sec->nbt; i++) {
 	if((sec->bt_map[i].flags & (AXFL_MAP | AXFL_BUTTON)) != (AXFL_MAP | AXFL_BUTTON))
 	    continue;
 	if(!ULISSET(cap->keystates, sec->bt_low + i)) {
-	    fprintf(logf, "warning: disabling axis %d/%d due to missing button %d\n",
+	    jlog(JL_WARN, "warning: disabling axis %d/%d due to missing button %d\n",
 		    sec->bt_map[i].onax, sec->bt_map[i].offax, i);
 	    continue;
 	}
@@ -1634,152 +3511,1099 @@ static void init_evdev(int fd, const struct evjrconf *sec)
     if(!sec->filter_ax)
 	for(i = 0; i < MINBITS(ABS_MAX); i++)
 	    cap->absout[i] |= absin[i];
-    /* critical section, protected well enough by lock */
-    cap->next = ev_fd;
-    ev_fd = cap;
-    pthread_mutex_unlock(&lock);
+    for(i = 0; i < sec->nchord; i++)
+	ULSET(cap->keysout, sec->chord[i].code);
+    if(!merged && (sec->nautofire || sec->nchord) &&
+       (cap->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+	jlog(JL_ERR, "autofire/chord timer: %s\n", strerror(errno));
+    compile_xl(cap, sec, inmin, insum);
+    gabs_build(cap);
+    /* keystates was only a temporary above */
+    cap->ks_stale = ev_gkey(cap) < 0;
+    if(!merged) {
+	take_lock();
+	if(cap_set(fd, cap) < 0) {
+	    pthread_mutex_unlock(&lock);
+	    goto err;
+	}
+	if(rec_fn)
+	    rec_snapshot(cap, fd);
+	pthread_mutex_unlock(&lock);
+    }
+    return cap;
+err:
+    cap_free(cap);
+    return NULL;
+}
+
+/* return NULL if nothing allows fd */
+/* otherwise, return last section which matches */
+static struct evjrconf *allowed_sec(int fd, int evno)
+{
+    struct input_id id;
+    char name[256], ibuf[32];
+    struct evjrconf *sec;
+    unsigned long long nh;
+    int i, nl, il, best;
+
+    if(real_ioctl(fd, EVIOCGNAME(sizeof(name)), name) < 0)
+	strcpy(name, "ERROR: Device name unavailable");
+    if(real_ioctl(fd, EVIOCGID, &id) < 0)
+	memset(&id, 0, sizeof(id));
+    nl = strlen(name);
+    nh = conf_hash(name, nl);
+    if((i = match_get(evno, &id, nh)) > -2)
+	return i < 0 ? NULL : &conf[i];
+    il = sprintf(ibuf, "%04X-%04X-%04X-%04X-%d", (int)id.bustype,
+		 (int)id.vendor, (int)id.product, (int)id.version, evno);
+    /* the last section whose match is exactly either name, if any */
+    if((best = exact_find(name, nl)) < (i = exact_find(ibuf, il)))
+	best = i;
+    /* and any later section which matches */
+    /* if neither name is rejected, and either name matches, it's allowed */
+    for(i = nslow - 1; i >= 0 && slow_sec[i] > best; i--) {
+	sec = &conf[slow_sec[i]];
+	if((sec_match(sec, match, name, nl) || sec_match(sec, match, ibuf, il)) &&
+	   (!sec->reject_str || (!sec_match(sec, reject, name, nl) &&
+				 !sec_match(sec, reject, ibuf, il)))) {
+	    best = slow_sec[i];
+	    break;
+	}
+    }
+    sec = best < 0 ? NULL : &conf[best];
+    match_put(evno, &id, nh, sec ? sec - conf : -1);
+    return sec;
+}
+
+/* js devices:  which event device each one is, and what happened the
+ * last time it was opened.  Games which reopen js devices whenever they
+ * look for pads would otherwise walk /sys and open and match the event
+ * device every time.  Any change in /dev/input (or the fake device
+ * directory) invalidates all of it; the inotify fd is simply drained on
+ * every js open.  Captures still need the event device for its state. */
+enum { JSV_UNKNOWN, JSV_PASS, JSV_REJECT, JSV_CAPTURE };
+/* generation << 16 | verdict << 8 | (event device + 1) */
+static unsigned jsmap[JSDEV_NMINOR];
+static unsigned jsmap_gen = 0;
+static int jsmap_fd = -1; /* -2 if unavailable */
+
+static void jsmap_fork(void)
+{
+    /* the inotify queue is shared with the parent */
+    if(jsmap_fd >= 0)
+	real_close(jsmap_fd);
+    jsmap_fd = -1;
+    jsmap_gen++;
+}
+
+/* returns jsmap entry if valid, or 0; *gen is for jsmap_put() */
+static unsigned jsmap_get(int q, unsigned *gen)
+{
+    int fd = __atomic_load_n(&jsmap_fd, __ATOMIC_ACQUIRE), cleared = 0;
+    char ib[sizeof(struct inotify_event) + NAME_MAX + 1];
+    unsigned e;
+
+    if(fd == -1) {
+	int nfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(nfd >= 0 &&
+	   inotify_add_watch(nfd, fake_dir ? fake_dir : "/dev/input",
+			     IN_CREATE | IN_DELETE | IN_ATTRIB |
+			     IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+	    real_close(nfd);
+	    nfd = -1;
+	}
+	if(nfd < 0)
+	    nfd = -2;
+	if(__atomic_compare_exchange_n(&jsmap_fd, &fd, nfd, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    if(nfd >= 0)
+		pthread_atfork(NULL, NULL, jsmap_fork);
+	    fd = nfd;
+	} else if(nfd >= 0)
+	    real_close(nfd);
+	/* anything cached before the watch is suspect */
+	__atomic_add_fetch(&jsmap_gen, 1, __ATOMIC_ACQ_REL);
+    }
+    if(fd < 0) {
+	*gen = 0;
+	return 0;
+    }
+    while(real_read(fd, ib, sizeof(ib)) > 0)
+	cleared = 1;
+    if(cleared)
+	__atomic_add_fetch(&jsmap_gen, 1, __ATOMIC_ACQ_REL);
+    *gen = __atomic_load_n(&jsmap_gen, __ATOMIC_ACQUIRE) & 0xffff;
+    e = __atomic_load_n(&jsmap[q], __ATOMIC_RELAXED);
+    return e >> 16 == *gen && (e & 0xff00) ? e : 0;
+}
+
+static void jsmap_put(int q, unsigned gen, int evno, int verdict)
+{
+    if(__atomic_load_n(&jsmap_fd, __ATOMIC_RELAXED) >= 0)
+	__atomic_store_n(&jsmap[q], gen << 16 | verdict << 8 | (unsigned char)(evno + 1),
+			 __ATOMIC_RELAXED);
+}
+
+static struct evfdcap *cap_of(int fd)
+{
+    struct captab *t;
+    struct evfdcap **pg;
+    unsigned p = (unsigned)fd >> CAPTAB_BITS;
+    if(!__atomic_load_n(&ncap, __ATOMIC_ACQUIRE) ||
+       !(t = __atomic_load_n(&cap_tab, __ATOMIC_ACQUIRE)) || p >= t->npg)
+	return NULL;
+    pg = __atomic_load_n(&t->pg[p], __ATOMIC_ACQUIRE);
+    if(!pg)
+	return NULL;
+    return __atomic_load_n(&pg[fd & (CAPTAB_PGSZ - 1)], __ATOMIC_ACQUIRE);
+}
+
+/* the capture whose reads are intercepted; fed captures' aren't */
+static inline struct evfdcap *cap_rd(int fd)
+{
+    struct evfdcap *cap = cap_of(fd);
+    return cap && !__atomic_load_n(&cap->fed, __ATOMIC_ACQUIRE) ? cap : NULL;
+}
+
+static void ev_close(int fd);
+static void ep_forget(int epfd);
+
+/* Path pre-check:  every open in the process comes through ev_open(),
+ * and games may open tens of thousands of files while loading, so the
+ * fstat() is skipped for paths which can't lead to a device:  absolute
+ * paths outside of /dev, /proc and the fake device directory, and
+ * relative paths while the current directory is outside of those. */
+/* (chdir count + 1) << 1 | maybe devices, for the current directory */
+static unsigned cwd_dev = 0, cwd_gen = 0;
+
+/* is path p dir or something in it? */
+static int path_in(const char *p, const char *dir, size_t len)
+{
+    return !strncmp(p, dir, len) && (!p[len] || p[len] == '/');
+}
+
+static int abs_maybe_dev(const char *p)
+{
+    /* //dev and /./dev are still /dev */
+    while(p[1] == '/' || (p[1] == '.' && p[2] == '/'))
+	p += p[1] == '/' ? 1 : 2;
+    return path_in(p, "/dev", 4) || path_in(p, "/proc", 5) ||
+	   (fake_dir && path_in(p, fake_dir, fake_len)) || strstr(p, "/../");
+}
+
+static int maybe_dev(int dirfd, const char *p)
+{
+    unsigned g, c;
+    char cwd[PATH_MAX];
+    int en;
+
+    if(check_all)
+	return 1;
+    if(*p == '/')
+	return abs_maybe_dev(p);
+    if(dirfd != AT_FDCWD || strstr(p, ".."))
+	return 1;
+    g = __atomic_load_n(&cwd_gen, __ATOMIC_ACQUIRE);
+    c = __atomic_load_n(&cwd_dev, __ATOMIC_RELAXED);
+    if(c >> 1 == g + 1)
+	return c & 1;
+    en = errno;
+    c = !getcwd(cwd, sizeof(cwd)) || !strcmp(cwd, "/") || abs_maybe_dev(cwd);
+    errno = en;
+    /* if it changed while getting it, the next call tries again */
+    __atomic_store_n(&cwd_dev, (g + 1) << 1 | c, __ATOMIC_RELAXED);
+    return c;
+}
+
+int chdir(const char *path)
+{
+    int ret = real_chdir(path);
+    __atomic_add_fetch(&cwd_gen, 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+int fchdir(int fd)
+{
+    int ret = real_fchdir(fd);
+    __atomic_add_fetch(&cwd_gen, 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* Merged devices:  when a section with a merge pattern captures a device,
+ * every other event device matching the pattern is opened as well, and
+ * read along with it by merge_fill().  Each is translated by the section
+ * which matches it, if any, but never autofires or chords, and its
+ * capture is only reachable through the captured fd's.  The poll()
+ * family waits on an epoll instance holding all of them (and the timer)
+ * in addition to the captured fd. */
+static const struct evjrconf merge_pass; /* for merged devices no section matches */
+
+/* close a merged device */
+static void merge_free(struct evfdcap *m)
+{
+    fake_close(m->fd);
+    real_close(m->fd);
+    cap_free(m);
+}
+
+/* open and attach the devices to merge into fd's capture */
+static void merge_open(int fd, int evno, int fake)
+{
+    struct evfdcap *cap = cap_of(fd), *m[MAX_MERGE];
+    const struct evjrconf *sec = cap->conf, *msec;
+    struct epoll_event eev = { .events = EPOLLIN };
+    struct input_id id;
+    struct stat st;
+    char evn[300], name[256], ibuf[32];
+    int i, j, n = 0, e, mn, ok, mfd;
+
+    for(i = 0; i < EVDEV_NMINOR && n < MAX_MERGE; i++) {
+	if(i == evno)
+	    continue;
+	sprintf(evn, "%.256s/event%d", fake ? fake_dir : "/dev/input", i);
+	if((e = real_open(evn, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+	    continue;
+	if(fake && (fstat(e, &st) || !fake_open(e, evn, &st, &mn))) {
+	    real_close(e);
+	    continue;
+	}
+	if(real_ioctl(e, EVIOCGNAME(sizeof(name)), name) < 0)
+	    strcpy(name, "ERROR: Device name unavailable");
+	if(real_ioctl(e, EVIOCGID, &id) < 0)
+	    memset(&id, 0, sizeof(id));
+	j = sprintf(ibuf, "%04X-%04X-%04X-%04X-%d", (int)id.bustype,
+		    (int)id.vendor, (int)id.product, (int)id.version, i);
+	if((ok = sec_match(sec, merge, name, strlen(name)) || sec_match(sec, merge, ibuf, j)))
+	    jlog(JL_INFO, "[merge/%d] Merging %s (%s) into %d\n", e, evn, name, fd);
+	if(ok) {
+	    msec = allowed_sec(e, i);
+	    ok = !!(m[n] = init_evdev(e, msec ? msec : &merge_pass, 1));
+	    n += ok;
+	}
+	if(!ok) {
+	    fake_close(e);
+	    real_close(e);
+	}
+    }
+    if(!n)
+	return;
+    if((mfd = epoll_create1(EPOLL_CLOEXEC)) >= 0)
+	for(i = 0; i <= n; i++) {
+	    eev.data.fd = i < n ? m[i]->fd : cap->tfd;
+	    if(eev.data.fd >= 0 && real_epoll_ctl(mfd, EPOLL_CTL_ADD, eev.data.fd, &eev) < 0) {
+		real_close(mfd);
+		mfd = -1;
+		break;
+	    }
+	}
+    if(mfd < 0)
+	jlog(JL_ERR, "merge: %s\n", strerror(errno));
+    pthread_mutex_lock(&cap->lk);
+    /* it may have been closed by another thread in the meantime */
+    if(mfd >= 0 && cap_of(fd) == cap) {
+	/* the captured device's own buttons and axes take precedence */
+	for(i = 0; i < n; i++) {
+	    for(j = 0; j < MINBITS(KEY_MAX); j++) {
+		m[i]->keysout[j] &= ~cap->keysout[j];
+		cap->keysout[j] |= m[i]->keysout[j];
+	    }
+	    for(j = 0; j < MINBITS(ABS_MAX); j++) {
+		m[i]->absout[j] &= ~cap->absout[j];
+		cap->absout[j] |= m[i]->absout[j];
+	    }
+	}
+	memcpy(cap->merged, m, n * sizeof(*m));
+	cap->mfd = mfd;
+	__atomic_store_n(&cap->nmerged, n, __ATOMIC_RELEASE);
+	gabs_build(cap);
+	/* the poll() family has to look at it from now on */
+	__atomic_add_fetch(&ntmr, 1, __ATOMIC_RELEASE);
+	n = 0;
+	mfd = -1;
+    }
+    pthread_mutex_unlock(&cap->lk);
+    while(n > 0)
+	merge_free(m[--n]);
+    if(mfd >= 0)
+	real_close(mfd);
+}
+
+/* forget merged device s, which went away */
+static void merge_drop(struct evfdcap *cap, int s)
+{
+    struct evfdcap *m;
+    pthread_mutex_lock(&cap->lk);
+    /* close() may have beaten us to it */
+    if(s >= cap->nmerged) {
+	pthread_mutex_unlock(&cap->lk);
+	return;
+    }
+    m = cap->merged[s];
+    jlog(JL_WARN, "%d: merged device %d is gone\n", cap->fd, m->fd);
+    memmove(cap->merged + s, cap->merged + s + 1,
+	    (cap->nmerged - s - 1) * sizeof(*cap->merged));
+    __atomic_store_n(&cap->nmerged, cap->nmerged - 1, __ATOMIC_RELEASE);
+    gabs_build(cap);
+    pthread_mutex_unlock(&cap->lk);
+    /* closing it also removes it from cap->mfd */
+    merge_free(m);
+}
+
+/* Persistent and fed captures (see the persist and feed keywords):  the
+ * program's fd is replaced by one end of a socket pair, and pst_feed(), a
+ * private thread shared by all of them, copies events from the device to
+ * the other end, and whatever the program writes back to the device.
+ * For fed captures, it also translates them (and runs the autofire/chord
+ * timer), so read() and the poll() family leave the fd alone.  When a
+ * persistent device goes away, the feeder releases what was held, and
+ * inotify tells it when to look for the device to come back.  Other
+ * devices going away just end the stream.  The device is only read
+ * while nothing is left over from the last read, so a program which
+ * doesn't keep up makes the kernel drop events (with SYN_DROPPED), just
+ * as if it read the device itself. */
+#define PST_BUF 96 /* events; must hold a disconnect's releases */
+static struct persist {
+    struct persist *next; /* pst_list or pst_free link */
+    pthread_mutex_t lk; /* for dfd, grab, clkid and cap */
+    struct evfdcap *cap; /* the capture, if the feeder translates (feed) */
+    int persist; /* wait for the device to come back? */
+    int fd; /* the program's fd (for messages) */
+    int dfd; /* the device, or -1 while disconnected */
+    int sfd; /* feeder's end of the socket pair */
+    int acc; /* O_ACCMODE of the program's open */
+    int grab, clkid; /* reapplied on reconnect */
+    int closed; /* program closed its end; freed after the epoll batch */
+    int stalled; /* waiting for the program to read obuf */
+    int olen, ilen; /* bytes left in obuf and ibuf */
+    struct input_event obuf[PST_BUF], ibuf[PST_BUF];
+    unsigned long keys[MINBITS(KEY_MAX)]; /* held keys, as sent */
+    int absval[ABS_CNT]; /* axis values, as sent */
+    struct timespec gone; /* when it disconnected */
+    /* what the device reported at open */
+    char name[256], uniq[64], phys[64];
+    struct input_id id;
+    int version;
+    unsigned long props[MINBITS(INPUT_PROP_MAX)];
+    unsigned long bits[EV_CNT][MINBITS(KEY_MAX)];
+    struct input_absinfo ai[ABS_CNT]; /* value is where the axis rests */
+} *pst_list = NULL, *pst_free = NULL;
+/* protects the lists and the fds below */
+static pthread_mutex_t pst_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pst_efd = -1, pst_ifd = -1; /* feeder's epoll and inotify */
+static int npst = 0; /* entries in pst_list, for close() */
+static int xlate_ev(struct evfdcap *cap, struct input_event *ev, int n);
+static int pendq_pop(struct evfdcap *cap, char *buf, int n, int ev_size);
+static int xl_room(const struct evfdcap *cap, int room);
+static void tmr_service(struct evfdcap *cap);
+static void lat_record(struct evfdcap *cap, const struct input_event *ev, int n);
+
+/* (re)register one of p's fds with the feeder; the low bits of the
+ * pointer say which */
+enum { PST_DEV, PST_SOCK, PST_TMR };
+static void pst_watch(struct persist *p, int which, int op, unsigned events)
+{
+    struct epoll_event eev = {
+	.events = events, .data.u64 = (uintptr_t)p | which
+    };
+    real_epoll_ctl(pst_efd, op, which == PST_DEV ? p->dfd :
+		   which == PST_SOCK ? p->sfd : p->cap->tfd, &eev);
+}
+
+static void pst_out(struct persist *p, int n);
+
+/* send as much of obuf as the socket takes; the device is not read
+ * until the rest is out */
+static void pst_flush(struct persist *p)
+{
+    ssize_t w;
+    if(p->olen) {
+	w = send(p->sfd, p->obuf, p->olen, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(w < 0 && errno != EAGAIN && errno != EINTR) {
+	    p->closed = 1;
+	    return;
+	}
+	if(w > 0) {
+	    p->olen -= w;
+	    memmove(p->obuf, (char *)p->obuf + w, p->olen);
+	    /* translation may have queued more than fit */
+	    if(!p->olen && p->cap) {
+		pst_out(p, 0);
+		return;
+	    }
+	}
+    }
+    if(!p->olen && p->dfd < 0 && !p->persist)
+	shutdown(p->sfd, SHUT_WR);
+    if(!p->olen == !p->stalled)
+	return;
+    p->stalled = !!p->olen;
+    pst_watch(p, PST_SOCK, EPOLL_CTL_MOD, EPOLLIN | (p->stalled ? EPOLLOUT : 0));
+    if(p->dfd >= 0)
+	pst_watch(p, PST_DEV, p->stalled ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, EPOLLIN);
+}
+
+/* send n raw events from obuf, translated first for fed captures */
+static void pst_out(struct persist *p, int n)
+{
+    struct evfdcap *cap;
+    pthread_mutex_lock(&p->lk);
+    if((cap = p->cap)) {
+	if(n && rec_map && cap->rec_dev >= 0)
+	    rec_events(cap, (char *)p->obuf, n);
+	if(n)
+	    n = xlate_ev(cap, p->obuf, n);
+	n += pendq_pop(cap, (char *)(p->obuf + n), PST_BUF - n, sizeof(*p->obuf));
+	STAT_ADD(ev_out, n);
+	if(lat_on)
+	    lat_record(cap, p->obuf, n);
+    }
+    pthread_mutex_unlock(&p->lk);
+    p->olen = n * sizeof(*p->obuf);
+    pst_flush(p);
+}
+
+static struct input_event *pst_ev(struct input_event *e, const struct timespec *ts,
+				  int type, int code, int value)
+{
+    e->time.tv_sec = ts->tv_sec;
+    e->time.tv_usec = ts->tv_nsec / 1000;
+    e->type = type;
+    e->code = code;
+    e->value = value;
+    return e + 1;
+}
+
+/* read the state the program will see after SYN_DROPPED */
+static void pst_state(struct persist *p)
+{
+    struct input_absinfo ai;
+    int i;
+    real_ioctl(p->dfd, EVIOCGKEY(sizeof(p->keys)), p->keys);
+    for(i = 0; i < ABS_CNT; i++)
+	if(ULISSET(p->bits[EV_ABS], i) && real_ioctl(p->dfd, EVIOCGABS(i), &ai) >= 0)
+	    p->absval[i] = ai.value;
+}
+
+/* the device went away:  release everything and wait for it */
+static void pst_gone(struct persist *p)
+{
+    struct input_event *e = p->obuf;
+    struct timespec ts;
+    int i;
+    pthread_mutex_lock(&p->lk);
+    fake_close(p->dfd);
+    /* this also removes it from pst_efd */
+    real_close(p->dfd);
+    p->dfd = -1;
+    pthread_mutex_unlock(&p->lk);
+    jlog(JL_INFO, "[persist/%d] %s %s\n", p->fd, p->name,
+	 p->persist ? "disconnected" : "is gone");
+    clock_gettime(CLOCK_MONOTONIC, &p->gone);
+    clock_gettime(p->clkid, &ts);
+    /* the device is only read with obuf empty */
+    for(i = 0; i < KEY_CNT && e < p->obuf + PST_BUF - ABS_CNT - 1; i++)
+	if(ULISSET(p->keys, i))
+	    e = pst_ev(e, &ts, EV_KEY, i, 0);
+    memset(p->keys, 0, sizeof(p->keys));
+    for(i = 0; i < ABS_CNT; i++)
+	if(ULISSET(p->bits[EV_ABS], i) && p->absval[i] != p->ai[i].value)
+	    e = pst_ev(e, &ts, EV_ABS, i, (p->absval[i] = p->ai[i].value));
+    if(e > p->obuf)
+	e = pst_ev(e, &ts, EV_SYN, SYN_REPORT, 0);
+    pst_out(p, e - p->obuf);
+}
+
+static void pst_from_dev(struct persist *p)
+{
+    const struct input_event *e;
+    /* for fed captures, leave room for translation to grow */
+    struct evfdcap *cap = p->cap;
+    ssize_t r = real_read(p->dfd, p->obuf, (cap ? xl_room(cap, PST_BUF) : PST_BUF) *
+						sizeof(*p->obuf));
+    int resync = 0;
+    if(r < 0 && (errno == EAGAIN || errno == EINTR))
+	return;
+    if(r <= 0) {
+	/* ENODEV for devices; EOF for fake ones */
+	pst_gone(p);
+	return;
+    }
+    for(e = p->obuf; e < p->obuf + r / sizeof(*e); e++)
+	if(e->type == EV_KEY && e->code < KEY_CNT) {
+	    if(e->value)
+		ULSET(p->keys, e->code);
+	    else
+		ULCLR(p->keys, e->code);
+	} else if(e->type == EV_ABS && e->code < ABS_CNT)
+	    p->absval[e->code] = e->value;
+	else if(e->type == EV_SYN && e->code == SYN_DROPPED)
+	    resync = 1;
+    if(resync)
+	pst_state(p);
+    pst_out(p, r / sizeof(*e));
+}
+
+/* force feedback, LEDs and the like; whole events only */
+static void pst_from_prog(struct persist *p)
+{
+    ssize_t r = real_read(p->sfd, (char *)p->ibuf + p->ilen, sizeof(p->ibuf) - p->ilen);
+    if(r < 0 && (errno == EAGAIN || errno == EINTR))
+	return;
+    if(r <= 0) {
+	p->closed = 1;
+	return;
+    }
+    p->ilen += r;
+    r = p->ilen - p->ilen % sizeof(*p->ibuf);
+    /* nothing to be done about errors; they're lost while disconnected */
+    if(p->dfd >= 0 && write(p->dfd, p->ibuf, r) < 0)
+	jlog(JL_ERR, "[persist/%d] write: %s\n", p->fd, strerror(errno));
+    p->ilen -= r;
+    memmove(p->ibuf, (char *)p->ibuf + r, p->ilen);
+}
+
+/* if eventN (just created or changed) is p's device, read it from now on */
+static int pst_try(struct persist *p, const char *evn)
+{
+    char path[300], s[256];
+    struct input_id id;
+    struct timespec now;
+    struct stat st;
+    int fd, mn, ok, acc = fake_dir ? O_RDONLY : p->acc;
+    struct input_event *e;
+
+    sprintf(path, "%.256s/%.20s", fake_dir ? fake_dir : "/dev/input", evn);
+    /* the node may not be readable yet; then there will be an IN_ATTRIB */
+    if((fd = real_open(path, acc | O_NONBLOCK | O_CLOEXEC)) < 0 &&
+       (acc == O_RDONLY || (fd = real_open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0))
+	return 0;
+    if(fstat(fd, &st) ||
+       (fake_dir ? !fake_open(fd, path, &st, &mn) :
+	!S_ISCHR(st.st_mode) || major(st.st_rdev) != INPUT_MAJOR)) {
+	real_close(fd);
+	return 0;
+    }
+    /* the unique ID alone would also match a pad's motion sensors */
+    memset(s, 0, sizeof(s));
+    ok = real_ioctl(fd, EVIOCGNAME(sizeof(s) - 1), s) >= 0 && !strcmp(s, p->name) &&
+	 real_ioctl(fd, EVIOCGID, &id) >= 0 && !memcmp(&id, &p->id, sizeof(id));
+    memset(s, 0, sizeof(s));
+    if(ok && real_ioctl(fd, EVIOCGUNIQ(sizeof(s) - 1), s) < 0)
+	*s = 0;
+    if(!ok || strcmp(s, p->uniq)) {
+	fake_close(fd);
+	real_close(fd);
+	return 0;
+    }
+    pthread_mutex_lock(&p->lk);
+    if(p->grab)
+	real_ioctl(fd, EVIOCGRAB, (void *)1);
+    if(p->clkid != CLOCK_REALTIME)
+	real_ioctl(fd, EVIOCSCLOCKID, &p->clkid);
+    p->dfd = fd;
+    pthread_mutex_unlock(&p->lk);
+    pst_state(p);
+    if(!p->stalled)
+	pst_watch(p, PST_DEV, EPOLL_CTL_ADD, EPOLLIN);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    jlog(JL_INFO, "[persist/%d] %s is back as %s after %ld ms\n", p->fd, p->name, path,
+	 (long)((now.tv_sec - p->gone.tv_sec) * 1000 +
+		(now.tv_nsec - p->gone.tv_nsec) / 1000000));
+    /* make the program ask for the state */
+    if(p->olen + 2 * sizeof(*e) <= sizeof(p->obuf)) {
+	clock_gettime(p->clkid, &now);
+	e = (struct input_event *)((char *)p->obuf + p->olen);
+	e = pst_ev(e, &now, EV_SYN, SYN_DROPPED, 0);
+	e = pst_ev(e, &now, EV_SYN, SYN_REPORT, 0);
+	p->olen = (char *)e - (char *)p->obuf;
+	pst_flush(p);
+    }
+    return 1;
+}
+
+/* a device node was created or changed; must be called with pst_lock held */
+static void pst_rescan(void)
+{
+    char ib[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ie;
+    struct persist *p;
+    ssize_t r;
+    while((r = real_read(pst_ifd, ib, sizeof(ib))) > 0)
+	for(ie = (void *)ib; (char *)ie < ib + r;
+	    ie = (void *)((char *)(ie + 1) + ie->len))
+	    if(ie->len && !memcmp(ie->name, "event", 5) && isdigit(ie->name[5]))
+		for(p = pst_list; p; p = p->next)
+		    if(p->dfd < 0 && p->persist && !p->closed && pst_try(p, ie->name))
+			break;
+}
+
+/* program closed its end; must be called with pst_lock held */
+static void pst_close(struct persist *p)
+{
+    pthread_mutex_lock(&p->lk);
+    if(p->dfd >= 0) {
+	fake_close(p->dfd);
+	real_close(p->dfd);
+	p->dfd = -1;
+    }
+    real_close(p->sfd);
+    pthread_mutex_unlock(&p->lk);
+    jlog(JL_INFO, "[persist/%d] closed %s\n", p->fd, p->name);
+    /* may still be referenced by a stale capture, so never freed */
+    p->next = pst_free;
+    pst_free = p;
+    __atomic_sub_fetch(&npst, 1, __ATOMIC_RELEASE);
+}
+
+static void *pst_feed(void *arg)
+{
+    struct epoll_event ev[16];
+    struct persist *p, **pp;
+    int i, n;
+    while(1) {
+	if((n = real_epoll_wait(pst_efd, ev, 16, -1)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    jlog(JL_ERR, "persist: %s\n", strerror(errno));
+	    return NULL;
+	}
+	for(i = 0; i < n; i++) {
+	    if(!ev[i].data.u64) {
+		pthread_mutex_lock(&pst_lock);
+		pst_rescan();
+		pthread_mutex_unlock(&pst_lock);
+		continue;
+	    }
+	    p = (struct persist *)(uintptr_t)(ev[i].data.u64 & ~(uint64_t)3);
+	    if(p->closed)
+		continue;
+	    switch(ev[i].data.u64 & 3) {
+	      case PST_DEV:
+		if(!p->olen && p->dfd >= 0)
+		    pst_from_dev(p);
+		continue;
+	      case PST_TMR:
+		pthread_mutex_lock(&p->lk);
+		if(p->cap)
+		    tmr_service(p->cap);
+		pthread_mutex_unlock(&p->lk);
+		if(!p->olen)
+		    pst_out(p, 0);
+		continue;
+	    }
+	    if(ev[i].events & EPOLLOUT)
+		pst_flush(p);
+	    if(!p->closed && (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		pst_from_prog(p);
+	}
+	pthread_mutex_lock(&pst_lock);
+	for(pp = &pst_list; (p = *pp); )
+	    if(p->closed) {
+		*pp = p->next;
+		pst_close(p);
+	    } else
+		pp = &p->next;
+	pthread_mutex_unlock(&pst_lock);
+    }
+}
+
+static void pst_prefork(void)
+{
+    pthread_mutex_lock(&pst_lock);
+}
+
+static void pst_parent(void)
+{
+    pthread_mutex_unlock(&pst_lock);
+}
+
+/* the feeder doesn't survive fork(), so the child gets the snapshots */
+static void pst_child(void)
+{
+    struct persist *p;
+    for(p = pst_list; p; p = p->next) {
+	pthread_mutex_init(&p->lk, NULL);
+	if(p->dfd >= 0) {
+	    fake_close(p->dfd);
+	    real_close(p->dfd);
+	}
+	p->dfd = -1;
+	real_close(p->sfd);
+    }
+    pst_list = NULL;
+    npst = 0;
+    if(pst_efd >= 0)
+	real_close(pst_efd);
+    if(pst_ifd >= 0)
+	real_close(pst_ifd);
+    pst_efd = pst_ifd = -1;
+    pthread_mutex_init(&pst_lock, NULL);
+}
+
+/* start the feeder, if needed; must be called with pst_lock held */
+static int pst_start(void)
+{
+    static int atfork = 0;
+    struct epoll_event eev = { .events = EPOLLIN }; /* data 0 is inotify */
+    sigset_t all, old;
+    pthread_t t;
+    int r;
+    if(pst_efd >= 0)
+	return 0;
+    if((pst_efd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+       (pst_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+       inotify_add_watch(pst_ifd, fake_dir ? fake_dir : "/dev/input",
+			 IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0 ||
+       real_epoll_ctl(pst_efd, EPOLL_CTL_ADD, pst_ifd, &eev) < 0)
+	goto err;
+    /* signals are for the program's threads */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    r = pthread_create(&t, NULL, pst_feed, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(r) {
+	errno = r;
+	goto err;
+    }
+    pthread_detach(t);
+    if(!atfork++)
+	pthread_atfork(pst_prefork, pst_parent, pst_child);
+    return 0;
+err:
+    jlog(JL_ERR, "persist: %s\n", strerror(errno));
+    if(pst_efd >= 0)
+	real_close(pst_efd);
+    if(pst_ifd >= 0)
+	real_close(pst_ifd);
+    pst_efd = pst_ifd = -1;
+    return -1;
+}
+
+/* hand the program a socket fed from its device instead of the device;
+ * if fed, the feeder translates for cap, too */
+static void pst_open(int fd, struct evfdcap *cap, int fed)
+{
+    struct persist *p;
+    int i, fl, fdfl, dfd = -1, sv[2] = { -1, -1 };
+
+    pthread_mutex_lock(&pst_lock);
+    if(pst_start() < 0) {
+	pthread_mutex_unlock(&pst_lock);
+	return;
+    }
+    if((p = pst_free))
+	pst_free = p->next;
+    pthread_mutex_unlock(&pst_lock);
+    if(!p && !(p = malloc(sizeof(*p)))) {
+	jlog(JL_ERR, "[persist/%d] %s\n", fd, strerror(errno));
+	return;
+    }
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lk, NULL);
+    p->fd = fd;
+    p->persist = cap->conf->persist;
+    p->clkid = CLOCK_REALTIME;
+    /* the snapshot; fake devices don't have everything */
+    real_ioctl(fd, EVIOCGNAME(sizeof(p->name) - 1), p->name);
+    real_ioctl(fd, EVIOCGUNIQ(sizeof(p->uniq) - 1), p->uniq);
+    real_ioctl(fd, EVIOCGPHYS(sizeof(p->phys) - 1), p->phys);
+    real_ioctl(fd, EVIOCGID, &p->id);
+    if(real_ioctl(fd, EVIOCGVERSION, &p->version) < 0)
+	p->version = EV_VERSION;
+    real_ioctl(fd, EVIOCGPROP(sizeof(p->props)), p->props);
+    for(i = 0; i < EV_CNT; i++)
+	real_ioctl(fd, EVIOCGBIT(i, sizeof(p->bits[i])), p->bits[i]);
+    for(i = 0; i < ABS_CNT; i++)
+	if(ULISSET(p->bits[EV_ABS], i) && real_ioctl(fd, EVIOCGABS(i), &p->ai[i]) >= 0)
+	    p->absval[i] = p->ai[i].value;
+    real_ioctl(fd, EVIOCGKEY(sizeof(p->keys)), p->keys);
+    if((fl = fcntl(fd, F_GETFL)) < 0 || (fdfl = fcntl(fd, F_GETFD)) < 0 ||
+       socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0 ||
+       fcntl(sv[1], F_SETFL, O_NONBLOCK) < 0 ||
+       ((fl & O_NONBLOCK) && fcntl(sv[0], F_SETFL, O_NONBLOCK) < 0) ||
+       (dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+	jlog(JL_ERR, "[persist/%d] %s\n", fd, strerror(errno));
+	goto err;
+    }
+    p->dfd = dfd;
+    p->sfd = sv[1];
+    p->acc = fl & O_ACCMODE;
+    /* ioctls go to dfd from now on, so the swap is invisible */
+    fake_move(fd, dfd);
+    if(fed) {
+	p->cap = cap;
+	__atomic_store_n(&cap->fed, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&cap->pst, p, __ATOMIC_RELEASE);
+    if(dup3(sv[0], fd, (fdfl & FD_CLOEXEC) ? O_CLOEXEC : 0) < 0) {
+	jlog(JL_ERR, "[persist/%d] %s\n", fd, strerror(errno));
+	__atomic_store_n(&cap->pst, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&cap->fed, 0, __ATOMIC_RELEASE);
+	fake_move(dfd, fd);
+	goto err;
+    }
+    real_close(sv[0]);
+    /* the device's file description is now only dfd's */
+    fcntl(dfd, F_SETFL, fl | O_NONBLOCK);
+    pthread_mutex_lock(&pst_lock);
+    p->next = pst_list;
+    pst_list = p;
+    __atomic_add_fetch(&npst, 1, __ATOMIC_RELEASE);
+    pst_watch(p, PST_DEV, EPOLL_CTL_ADD, EPOLLIN);
+    pst_watch(p, PST_SOCK, EPOLL_CTL_ADD, EPOLLIN);
+    if(fed && cap->tfd >= 0)
+	pst_watch(p, PST_TMR, EPOLL_CTL_ADD, EPOLLIN);
+    pthread_mutex_unlock(&pst_lock);
+    jlog(JL_INFO, "[persist/%d] Feeding %sfrom %d\n", fd, fed ? "translated " : "", dfd);
     return;
 err:
-    /* critical section, protected by lock */
-    cap->next = free_ev_fd;
-    free_ev_fd = cap;
-    pthread_mutex_unlock(&lock);
+    if(sv[0] >= 0)
+	real_close(sv[0]);
+    if(sv[1] >= 0)
+	real_close(sv[1]);
+    if(dfd >= 0)
+	real_close(dfd);
+    pthread_mutex_lock(&pst_lock);
+    p->next = pst_free;
+    pst_free = p;
+    pthread_mutex_unlock(&pst_lock);
 }
 
-/* return NULL if nothing allows fd */
-/* otherwise, return last section which matches */
-static struct evjrconf *allowed_sec(int fd, int evno)
+/* the program closed a fed capture; called with the capture's lock held */
+static void pst_detach(struct persist *p)
 {
-    /* this is small enough to be local, but we're locking for buf anyway */
-    static struct input_id id;
-    static char ibuf[25];
-    struct evjrconf *sec;
-
-    /* the lock is for buf & id */
-    pthread_mutex_lock(&lock);
-    if(real_ioctl(fd, EVIOCGNAME(sizeof(buf)), buf) < 0)
-	strcpy(buf, "ERROR: Device name unavailable");
-    if(real_ioctl(fd, EVIOCGID, &id) < 0)
-	memset(&id, 0, sizeof(id));
-    sprintf(ibuf, "%04X-%04X-%04X-%04X-%d", (int)id.bustype,
-	    (int)id.vendor, (int)id.product, (int)id.version, evno);
-    for(sec = conf + nconf - 1; sec >= conf; sec--) {
-	int rej = sec->reject_str && !regexec(&sec->reject, buf, 0, NULL, 0),
-	    nmok = !rej && !regexec(&sec->match, buf, 0, NULL, 0);
-	if(!rej) {
-	    rej = sec->reject_str && !regexec(&sec->reject, ibuf, 0, NULL, 0);
-	    if(rej)
-		nmok = 0;
-	    else if(!nmok)
-		nmok = !regexec(&sec->match, ibuf, 0, NULL, 0);
-	}
-	if(nmok) {
-	    pthread_mutex_unlock(&lock);
-	    return sec;
-	}
-    }
-    pthread_mutex_unlock(&lock);
-    return NULL;
+    pthread_mutex_lock(&p->lk);
+    p->cap = NULL;
+    pthread_mutex_unlock(&p->lk);
 }
 
-static struct evfdcap *cap_of(int fd)
+/* is fd one of the feeder's?  Some programs close everything. */
+static int pst_owns(int fd)
 {
-    struct evfdcap *cap;
-    pthread_mutex_lock(&lock);
-    for(cap = ev_fd; cap; cap = cap->next)
-	if(cap->fd == fd)
-	    break;
-    pthread_mutex_unlock(&lock);
-    return cap;
+    struct persist *p;
+    int ret = fd == pst_efd || fd == pst_ifd;
+    pthread_mutex_lock(&pst_lock);
+    for(p = pst_list; p && !ret; p = p->next)
+	ret = fd == p->sfd || fd == __atomic_load_n(&p->dfd, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pst_lock);
+    return ret;
 }
 
-static void ev_close(int fd);
+/* ioctls on the program's socket; the device answers while it's there */
+static int pst_ioctl(struct persist *p, unsigned long request, void *argp)
+{
+    int ret, len = _IOC_SIZE(request), nr = _IOC_NR(request);
+    pthread_mutex_lock(&p->lk);
+    if(p->dfd >= 0) {
+	ret = real_ioctl(p->dfd, request, argp);
+	if(ret >= 0 && request == EVIOCGRAB)
+	    p->grab = !!argp;
+	else if(ret >= 0 && request == EVIOCSCLOCKID)
+	    p->clkid = *(int *)argp;
+	pthread_mutex_unlock(&p->lk);
+	return ret;
+    }
+    /* pst_try() applies these when the device comes back, so they have to
+     * be set before it can */
+    if(request == EVIOCGRAB) {
+	p->grab = !!argp;
+	pthread_mutex_unlock(&p->lk);
+	return 0;
+    }
+    if(request == EVIOCSCLOCKID) {
+	p->clkid = *(int *)argp;
+	pthread_mutex_unlock(&p->lk);
+	return 0;
+    }
+    pthread_mutex_unlock(&p->lk);
+    if(_IOC_TYPE(request) == 'E' && _IOC_DIR(request) == _IOC_READ) {
+	switch(nr) {
+	  case _IOC_NR(EVIOCGVERSION):
+	    *(int *)argp = p->version;
+	    return 0;
+	  case _IOC_NR(EVIOCGID):
+	    memcpy(argp, &p->id, sizeof(p->id));
+	    return 0;
+	  case _IOC_NR(EVIOCGNAME(0)):
+	    return fake_cp(argp, len, p->name, strlen(p->name) + 1);
+	  case _IOC_NR(EVIOCGUNIQ(0)):
+	    return fake_cp(argp, len, p->uniq, strlen(p->uniq) + 1);
+	  case _IOC_NR(EVIOCGPHYS(0)):
+	    return fake_cp(argp, len, p->phys, strlen(p->phys) + 1);
+	  case _IOC_NR(EVIOCGPROP(0)):
+	    return fake_cp(argp, len, p->props, sizeof(p->props));
+	  case _IOC_NR(EVIOCGKEY(0)):
+	  case _IOC_NR(EVIOCGLED(0)):
+	  case _IOC_NR(EVIOCGSND(0)):
+	  case _IOC_NR(EVIOCGSW(0)):
+	    /* everything was released by pst_gone() */
+	    len = len < sizeof(p->keys) ? len : sizeof(p->keys);
+	    memset(argp, 0, len);
+	    return len;
+	}
+	if(nr >= _IOC_NR(EVIOCGBIT(0, 0)) && nr < _IOC_NR(EVIOCGBIT(EV_CNT, 0)))
+	    return fake_cp(argp, len, p->bits[nr - _IOC_NR(EVIOCGBIT(0, 0))],
+			   sizeof(p->bits[0]));
+	if(nr >= _IOC_NR(EVIOCGABS(0)) && nr < _IOC_NR(EVIOCGABS(ABS_CNT)) &&
+	   ULISSET(p->bits[EV_ABS], nr - _IOC_NR(EVIOCGABS(0)))) {
+	    memcpy(argp, &p->ai[nr - _IOC_NR(EVIOCGABS(0))], sizeof(p->ai[0]));
+	    return 0;
+	}
+    }
+    /* force feedback uploads and the like have to wait */
+    errno = EIO;
+    return -1;
+}
+#define dev_ioctl(cap, r, a) ((cap)->pst ? pst_ioctl((cap)->pst, r, a) : \
+			      real_ioctl((cap)->fd, r, a))
 
 /* common code for multiple nearly identical open() functions */
-static int ev_open(const char *fn, const char *pathname, int fd)
+/* dirfd and pathname are as for openat() */
+static int ev_open(const char *fn, int dirfd, const char *pathname, int fd)
 {
-    if(!nconf || fd < 0)
+    if(fd < 0 || (__atomic_load_n(&conf_loaded, __ATOMIC_ACQUIRE) && !nconf) ||
+       !maybe_dev(dirfd, pathname))
 	return fd;
     struct stat st;
-    int en = errno;
-    if(fstat(fd, &st) || !S_ISCHR(st.st_mode) || major(st.st_rdev) != INPUT_MAJOR) {
+    int en = errno, mn, fake = 0;
+    if(fstat(fd, &st) ||
+       (!(fake = fake_dir && fake_open(fd, pathname, &st, &mn)) &&
+	(!S_ISCHR(st.st_mode) || major(st.st_rdev) != INPUT_MAJOR))) {
 	errno = en;
 	return fd;
     }
+    if(!__atomic_load_n(&conf_loaded, __ATOMIC_ACQUIRE)) {
+	pthread_once(&conf_once, load_conf);
+	__atomic_store_n(&conf_loaded, 1, __ATOMIC_RELEASE);
+	if(!nconf) {
+	    fake_close(fd);
+	    errno = en;
+	    return fd;
+	}
+    }
+    if(!fake)
+	mn = minor(st.st_rdev);
+    /* ev_open is the nested open of a js device's event device */
+    int nested = !strcmp(fn, "ev_open");
+    if(!nested)
+	STAT_ADD(opens, 1);
     const struct evjrconf *sec;
-    if(minor(st.st_rdev) >= JSDEV_MINOR0 &&
-       minor(st.st_rdev) < JSDEV_MINOR0 + JSDEV_NMINOR) {
+    if(mn >= JSDEV_MINOR0 &&
+       mn < JSDEV_MINOR0 + JSDEV_NMINOR) {
+	int q = mn - JSDEV_MINOR0;
+	unsigned gen, jm = jsmap_get(q, &gen);
+	if((jm >> 8 & 0xff) == JSV_REJECT)
+	    goto js_reject;
 	/* note: this is char to avoid gcc warning on %d below */
-	char evno = js_ev(minor(st.st_rdev) - JSDEV_MINOR0, 1);
-	if(evno >= 0) {
-	    int d = real_open("/dev/input", O_PATH);
-	    if(d >= 0) {
-		char evn[10];
-		sprintf(evn, "event%d", evno);
-		int e = real_openat(d, evn, O_RDONLY);
-		real_close(d);
-		struct evfdcap *cap = NULL;
-		if(e >= 0) {
-		    e = ev_open("ev_open", evn, e);
-		    /* FIXME:  only filter if jsremap set in filtering conf block */
-		    if(e < 0) {
+	char evno = jm ? (char)(jm & 0xff) - 1 : fake ? q : js_ev(q, 1);
+	if((jm >> 8 & 0xff) != JSV_PASS && evno >= 0) {
+	    char evn[300];
+	    /* fake event devices are FIFOs, which block without a writer */
+	    sprintf(evn, "%.256s/event%d", fake ? fake_dir : "/dev/input", evno);
+	    int e = real_open(evn, O_RDONLY | (fake ? O_NONBLOCK : 0));
+	    struct evfdcap *cap = NULL;
+	    if(e >= 0) {
+		e = ev_open("ev_open", AT_FDCWD, evn, e);
+		/* FIXME:  only filter if jsremap set in filtering conf block */
+		if(e < 0) {
+		    jsmap_put(q, gen, evno, JSV_REJECT);
+js_reject:
+		    fake_close(fd);
+		    real_close(fd);
+		    STAT_ADD(rejected, 1);
+		    errno = EPERM;
+		    return -1;
+		}
+		cap = cap_of(e);
+		fake_close(e);
+		real_close(e);
+		if(!cap) {
+		    jsmap_put(q, gen, evno, JSV_PASS);
+		    errno = en;
+		    return fd;
+		}
+		if(!cap->conf->jsremap && !cap->conf->jsrename) {
+		    ev_close(e); /* FIXME:  spurious closing msg */
+		    jsmap_put(q, gen, evno, JSV_PASS);
+		    errno = en;
+		    return fd;
+		}
+		jsmap_put(q, gen, evno, JSV_CAPTURE);
+		/* move capture from e to fd */
+		take_lock();
+		cap_set(e, NULL);
+		cap->fd = fd;
+		cap->is_js = 1;
+		cap->clkid = -1;
+		if(cap_set(fd, cap) < 0) {
+		    pthread_mutex_unlock(&lock);
+		    cap_free(cap);
+		    errno = en;
+		    return fd;
+		}
+		pthread_mutex_unlock(&lock);
+		if(cap->conf->jsremap) {
+		    cap->js_extra = malloc(sizeof(*cap->js_extra));
+		    if(!cap->js_extra) {
+			/* FIXME:  just bomb out completely */
+			/* or at least also do an ev_close() */
+			fake_close(fd);
 			real_close(fd);
-			errno = EPERM;
 			return -1;
 		    }
-		    cap = cap_of(e);
-		    real_close(e);
-		    if(!cap->conf->jsremap && !cap->conf->jsrename) {
-			ev_close(e); /* FIXME:  spurious closing msg */
-			errno = en;
-			return fd;
-		    }
-		    cap->fd = fd;
-		    cap->is_js = 1;
-		    if(cap->conf->jsremap) {
-			cap->js_extra = malloc(sizeof(*cap->js_extra));
-			if(!cap->js_extra) {
-			    /* FIXME:  just bomb out completely */
-			    /* or at least also do an ev_close() */
-			    real_close(fd);
-			    return -1;
+		    real_ioctl(fd, JSIOCGAXMAP, &cap->js_extra->in_ax_map);
+		    real_ioctl(fd, JSIOCGBTNMAP, &cap->js_extra->in_btn_map);
+		    memset(cap->js_extra->out_ax_map, 0xff, sizeof(cap->js_extra->out_ax_map));
+		    memset(cap->js_extra->out_btn_map, 0xff, sizeof(cap->js_extra->out_btn_map));
+		    struct js_extra *jx = cap->js_extra;
+		    int idx, i;
+		    if(cap->conf->jsaxmap)
+			for(i = idx = 0; i < cap->conf->jsaxmap[0] && idx < ABS_CNT; i++) {
+			    jx->out_ax_map[cap->conf->jsaxmap[i + 1]] = i;
+			    jx->ax_list[idx++] = cap->conf->jsaxmap[i + 1];
 			}
-			real_ioctl(fd, JSIOCGAXMAP, &cap->js_extra->in_ax_map);
-			real_ioctl(fd, JSIOCGBTNMAP, &cap->js_extra->in_btn_map);
-			memset(cap->js_extra->out_ax_map, 0xff, sizeof(cap->js_extra->out_ax_map));
-			memset(cap->js_extra->out_btn_map, 0xff, sizeof(cap->js_extra->out_btn_map));
-			int idx, i;
-			if(cap->conf->jsaxmap)
-			    for(i = 0; i < cap->conf->jsaxmap[0]; i++)
-				cap->js_extra->out_ax_map[cap->conf->jsaxmap[i + 1]] = i;
-			else
-			    for(i = idx = 0; i < ABS_CNT; i++)
-				if(ULISSET(cap->absout, i))
-				    cap->js_extra->out_ax_map[i] = idx++;
-			if(cap->conf->jsbtmap)
-			    for(i = 0; i < cap->conf->jsbtmap[0]; i++)
-				cap->js_extra->out_btn_map[cap->conf->jsbtmap[i + 1] - BTN_MISC] = i;
-			else
-			    for(i = BTN_MISC, idx = 0; i < KEY_MAX; i++)
-				if(ULISSET(cap->keysout, i))
-				    cap->js_extra->out_btn_map[i - BTN_MISC] = idx++;
-		    }
-		    fprintf(logf, "[%s/%d] %s %s\n",
-			    fn, fd,
-			    cap->conf->jsremap ? "Intercepted" : "Renaming",
-			    pathname);
+		    else
+			for(i = idx = 0; i < ABS_CNT; i++)
+			    if(ULISSET(cap->absout, i)) {
+				jx->out_ax_map[i] = idx;
+				jx->ax_list[idx++] = i;
+			    }
+		    jx->nax = idx;
+		    if(cap->conf->jsbtmap)
+			for(i = idx = 0; i < cap->conf->jsbtmap[0] &&
+			                 idx < KEY_MAX - BTN_MISC + 1; i++) {
+			    jx->out_btn_map[cap->conf->jsbtmap[i + 1] - BTN_MISC] = i;
+			    jx->btn_list[idx++] = cap->conf->jsbtmap[i + 1];
+			}
+		    else
+			for(i = BTN_MISC, idx = 0; i < KEY_MAX; i++)
+			    if(ULISSET(cap->keysout, i)) {
+				jx->out_btn_map[i - BTN_MISC] = idx;
+				jx->btn_list[idx++] = i;
+			    }
+		    jx->nbtn = idx;
+		    /* rename-only devices are still read as event devices */
+		    if(rec_map && cap->rec_dev >= 0)
+			rec_tag(cap, REC_JS);
 		}
-	    }
-	}
+		STAT_ADD(captured, 1);
+		jlog(JL_INFO, "[%s/%d] %s %s\n",
+		     fn, fd,
+		     cap->conf->jsremap ? "Intercepted" : "Renaming",
+		     pathname);
+	    } else
+		jsmap_put(q, gen, evno, JSV_PASS);
+	} else if(!jm)
+	    jsmap_put(q, gen, evno, JSV_PASS);
 	errno = en;
 	return fd;
     }
-    if(minor(st.st_rdev) < EVDEV_MINOR0 || minor(st.st_rdev) >= EVDEV_MINOR0 + EVDEV_NMINOR) {
+    if(mn < EVDEV_MINOR0 || mn >= EVDEV_MINOR0 + EVDEV_NMINOR) {
 	errno = en;
 	return fd;
     }
     sec = NULL;
-    if(nconf && !(sec = allowed_sec(fd, minor(st.st_rdev) - EVDEV_MINOR0))) {
+    if(nconf && !(sec = allowed_sec(fd, mn - EVDEV_MINOR0))) {
 	/* if any enabled sections filter, filter this device. */
 	for(sec = conf; sec < conf + nconf; sec++)
 	    if(sec->filter_dev)
@@ -1788,16 +4612,29 @@ static int ev_open(const char *fn, const char *pathname, int fd)
 	    errno = en;
 	    return fd;
 	}
-	if(strcmp(fn, "ev_open"))
-	    fprintf(logf, "[%s/%d] Rejecting open of %s\n", fn, fd, pathname);
+	if(!nested) {
+	    jlog(JL_INFO, "[%s/%d] Rejecting open of %s\n", fn, fd, pathname);
+	    STAT_ADD(rejected, 1);
+	}
+	fake_close(fd);
 	real_close(fd);
 	errno = EPERM;
 	return -1;
     }
     if(sec) {
-	init_evdev(fd, sec);
-	if(strcmp(fn, "ev_open"))
-	    fprintf(logf, "[%s/%d] Intercepted %s\n", fn, fd, pathname);
+	init_evdev(fd, sec, 0);
+	if(!nested) {
+	    jlog(JL_INFO, "[%s/%d] Intercepted %s\n", fn, fd, pathname);
+	    if(cap_of(fd)) {
+		STAT_ADD(captured, 1);
+		if(sec->merge_str)
+		    merge_open(fd, mn - EVDEV_MINOR0, fake);
+		if(sec->feed && sec->merge_str)
+		    jlog(JL_WARN, "[%s/%d] merged devices can't be fed\n", fn, fd);
+		if(sec->persist || (sec->feed && !sec->merge_str))
+		    pst_open(fd, cap_of(fd), sec->feed && !sec->merge_str);
+	    }
+	}
     }
     errno = en;
     return fd;
@@ -1827,7 +4664,7 @@ int open(const char *pathname, int flags, ...)
 	va_end(va);
     }
     DIS_SYSCALL;
-    int ret = ev_open("open", pathname, real_open(pathname, flags, mode));
+    int ret = ev_open("open", AT_FDCWD, pathname, real_open(pathname, flags, mode));
     EN_SYSCALL;
     return ret;
 }
@@ -1843,7 +4680,7 @@ int open64(const char *pathname, int flags, ...)
 	va_end(va);
     }
     DIS_SYSCALL;
-    int ret = ev_open("open64", pathname, real_open64(pathname, flags, mode));
+    int ret = ev_open("open64", AT_FDCWD, pathname, real_open64(pathname, flags, mode));
     EN_SYSCALL;
     return ret;
 }
@@ -1858,7 +4695,7 @@ int open64(const char *pathname, int flags, ...)
 static long __attribute((used)) opensys(long scno, const char *path, int flags, mode_t mode)
 {
     DIS_SYSCALL;
-    int ret = ev_open("opensys", path, syscall(SYS_open, path, flags, mode));
+    int ret = ev_open("opensys", AT_FDCWD, path, syscall(SYS_open, path, flags, mode));
     EN_SYSCALL;
     return ret;
 }
@@ -1867,7 +4704,7 @@ static long __attribute((used)) opensys(long scno, const char *path, int flags,
 static long __attribute((used)) openatsys(long scno, int dirfd, const char *path, int flags, mode_t mode)
 {
     DIS_SYSCALL;
-    int ret = ev_open("openatsys", path, syscall(SYS_openat, dirfd, path, flags, mode));
+    int ret = ev_open("openatsys", dirfd, path, syscall(SYS_openat, dirfd, path, flags, mode));
     EN_SYSCALL;
     return ret;
 }
@@ -1925,7 +4762,7 @@ int openat(int dirfd, const char *pathname, int flags, ...)
 	va_end(va);
     }
     DIS_SYSCALL;
-    int ret = ev_open("openat", pathname, real_openat(dirfd, pathname, flags, mode));
+    int ret = ev_open("openat", dirfd, pathname, real_openat(dirfd, pathname, flags, mode));
     EN_SYSCALL;
     return ret;
 }
@@ -1940,7 +4777,7 @@ int openat64(int dirfd, const char *pathname, int flags, ...)
 	va_end(va);
     }
     DIS_SYSCALL;
-    int ret = ev_open("openat64", pathname, real_openat64(dirfd, pathname, flags, mode));
+    int ret = ev_open("openat64", dirfd, pathname, real_openat64(dirfd, pathname, flags, mode));
     EN_SYSCALL;
     return ret;
 }
@@ -1977,8 +4814,10 @@ static void ev_dup(int fd, int nfd)
 	memcpy(n->js_extra, o->js_extra, sizeof(*n->js_extra));
     }
     n->fd = nfd;
-    n->next = ev_fd;
-    ev_fd = n;
+    if(cap_set(nfd, n) < 0) {
+	n->next = free_ev_fd;
+	free_ev_fd = n;
+    }
     pthread_mutex_unlock(&lock);
     fprintf(logf, "dupped %d into %d\n", fd, nfd);
 }
@@ -2001,320 +4840,1465 @@ int dup2(int fd, int nfd)
     ev_dup(fd, nfd);
     return nfd;
 }
-#endif
+#endif
+
+/* Latency histograms:  if EV_JOY_REMAP_LATENCY is set, read() compares
+ * every event it returns with the current time in the device's event
+ * clock.  For events straight from the device, this is the delay added
+ * by the shim plus however long the event sat in the kernel before the
+ * program asked for it; compare the latter with the program's polling
+ * interval.  Events which were held back (chords) or generated (autofire)
+ * include that time as well.  js time stamps are in jiffies, which can't
+ * be compared to any clock, so js devices are not measured. */
+static const char * const lat_tname[LAT_NT] = { "syn", "key", "abs", "other" };
+
+/* print the histograms, one line per event type seen */
+static void lat_dump(struct evfdcap *cap)
+{
+    const struct lathist *h = &cap->lat;
+    char line[LAT_NB * 20], *p;
+    int t, b, p50, p99;
+    for(t = 0; t < LAT_NT; t++) {
+	unsigned n = 0, cnt[LAT_NB], sum = 0;
+	/* counters may be updated by other threads while printing */
+	for(b = 0; b < LAT_NB; b++)
+	    n += (cnt[b] = __atomic_load_n(&h->cnt[t][b], __ATOMIC_RELAXED));
+	if(!n)
+	    continue;
+	p = line;
+	p50 = p99 = -1;
+	for(b = 0; b < LAT_NB; b++) {
+	    if(!cnt[b])
+		continue;
+	    sum += cnt[b];
+	    if(p50 < 0 && sum * 2ULL >= n)
+		p50 = b;
+	    if(p99 < 0 && sum * 100ULL >= n * 99ULL)
+		p99 = b;
+	    if(b < LAT_NB - 1)
+		p += sprintf(p, " <%luus:%u", 1UL << b, cnt[b]);
+	    else
+		p += sprintf(p, " >=%luus:%u", 1UL << (b - 1), cnt[b]);
+	}
+	jlog(JL_INFO, "%d: %s latency: n=%u p50<%luus p99<%luus%s\n", cap->fd,
+		lat_tname[t], n, 1UL << p50, 1UL << p99, line);
+    }
+    if(h->early)
+	jlog(JL_WARN, "%d: %u events time stamped in the future\n", cap->fd,
+		h->early);
+}
+
+/* Common code for multiple nearly identical close calls */
+/* Basically just disable intercept */
+static void ev_close(int fd)
+{
+    struct evfdcap *c;
+    int i;
+    /* most closes are of fds that were never captured; skip the lock */
+    if(!cap_of(fd))
+	return;
+    take_lock();
+    /* recheck, in case another thread got here first */
+    if((c = cap_of(fd)))
+	cap_set(fd, NULL);
+    pthread_mutex_unlock(&lock);
+    if(!c)
+	return;
+    /* merge_open() and epoll_pend() may still be looking at it */
+    pthread_mutex_lock(&c->lk);
+    /* the feeder must be done with it before it's reused */
+    if(c->fed)
+	pst_detach(c->pst);
+    if(c->pendq_head != c->pendq_tail)
+	__atomic_sub_fetch(&npend, 1, __ATOMIC_RELEASE);
+    if(c->tmr_on && !c->fed)
+	__atomic_sub_fetch(&ntmr, 1, __ATOMIC_RELEASE);
+    for(i = 0; i < MAX_EPOLL; i++)
+	if(c->ep[i].fd >= 0) {
+	    __atomic_store_n(&c->ep[i].fd, -1, __ATOMIC_RELEASE);
+	    __atomic_sub_fetch(&nepoll, 1, __ATOMIC_RELEASE);
+	}
+    if(c->tfd >= 0)
+	real_close(c->tfd);
+    for(i = 0; i < c->nmerged; i++)
+	merge_free(c->merged[i]);
+    c->nmerged = 0;
+    if(c->mfd >= 0) {
+	real_close(c->mfd);
+	__atomic_sub_fetch(&ntmr, 1, __ATOMIC_RELEASE);
+    }
+    if(lat_on)
+	lat_dump(c);
+    if(rec_map && c->rec_dev >= 0)
+	rec_tag(c, REC_CLOSE);
+    if(c->js_extra)
+	free(c->js_extra);
+    pthread_mutex_unlock(&c->lk);
+    cap_free(c);
+    jlog(JL_INFO, "closing %d\n", fd);
+}
+
+int close(int fd)
+{
+    /* some programs close everything; don't read whatever reuses it */
+    if(fd >= 0 && fd == __atomic_load_n(&jsmap_fd, __ATOMIC_RELAXED))
+	__atomic_store_n(&jsmap_fd, -2, __ATOMIC_RELEASE);
+    if(__atomic_load_n(&npst, __ATOMIC_ACQUIRE) && pst_owns(fd)) {
+	errno = EBADF;
+	return -1;
+    }
+    if(__atomic_load_n(&nepoll, __ATOMIC_ACQUIRE))
+	ep_forget(fd);
+    ev_close(fd);
+    fake_close(fd);
+    return real_close(fd);
+}
+
+/* most programs never close their devices, so dump latency at exit, too */
+/* also remove the statistics file, trim the recording, and write out the
+ * rest of the log; the mappings stay, though */
+__attribute__((destructor))
+static void fini(void)
+{
+    struct evfdcap *c;
+    char fn[40];
+    if(stats) {
+	sprintf(fn, JRSTAT_PATH, stats->pid);
+	unlink(fn);
+    }
+    if(rec_map) {
+	size_t sz = __atomic_load_n(&rec_off, __ATOMIC_RELAXED);
+	if(ftruncate(rec_fd, sz < rec_size ? sz : rec_size))
+	    jlog(JL_ERR, "recording: %s\n", strerror(errno));
+    }
+    if(lat_on)
+	for(c = __atomic_load_n(&cap_list, __ATOMIC_ACQUIRE); c; c = c->lnext)
+	    if(cap_of(c->fd) == c)
+		lat_dump(c);
+    log_flush();
+}
+
+/* fopen seems to be what c++ uses */
+#if CAP_FOPEN
+/* requires fread, fclose intercept as well, and probably more */
+/* however, gcc uses read(), so only fclose() for now */
+FILE *fopen(const char *pathname, const char *mode)
+{
+    DIS_SYSCALL;
+    FILE *res = real_fopen(pathname, mode);
+    EN_SYSCALL;
+    if(!res)
+	return res;
+    int en = errno;
+    int fd = fileno(res);
+    errno = en;
+    if(fd < 0)
+	return res;
+    if(ev_open("fopen", AT_FDCWD, pathname, fd) < 0) {
+	fclose(res);
+	return NULL;
+    }
+    return res;
+}
+
+FILE *fopen64(const char *pathname, const char *mode)
+{
+    DIS_SYSCALL;
+    FILE *res = real_fopen64(pathname, mode);
+    EN_SYSCALL;
+    if(!res)
+	return res;
+    int en = errno;
+    int fd = fileno(res);
+    errno = en;
+    if(fd < 0)
+	return res;
+    if(ev_open("fopen64", AT_FDCWD, pathname, fd) < 0) {
+	fclose(res);
+	return NULL;
+    }
+    return res;
+}
+
+int fclose(FILE *f)
+{
+    if(!f)
+	return real_fclose(f);
+    int fd = fileno(f);
+    if(fd < 0)
+	return real_fclose(f);
+    ev_close(fd);
+    return real_fclose(f);
+}
+#endif
+
+/* Autofire and chords both need to do things when no event arrives, so
+ * each capture which uses them has a private timerfd.  Expired timers are
+ * handled by read(), which queues any resulting events like other
+ * synthetic events.  The poll() family (see below) reports the captured
+ * fd as readable when its timer is readable, so it doesn't matter that
+ * nothing is queued yet. */
+#define ts_before(a, b) ((a)->tv_sec < (b)->tv_sec || \
+			 ((a)->tv_sec == (b)->tv_sec && (a)->tv_nsec < (b)->tv_nsec))
+#define tv_before(a, b) ((a)->tv_sec < (b)->tv_sec || \
+			 ((a)->tv_sec == (b)->tv_sec && (a)->tv_usec < (b)->tv_usec))
+static void ts_add(struct timespec *ts, long ns)
+{
+    ts->tv_nsec += ns;
+    while(ts->tv_nsec >= 1000000000) {
+	ts->tv_nsec -= 1000000000;
+	ts->tv_sec++;
+    }
+}
+
+/* current time in the device's event time stamp clock */
+static void ev_now(const struct evfdcap *cap, struct timeval *tv)
+{
+    struct timespec ts;
+    clock_gettime(cap->clkid < 0 ? CLOCK_MONOTONIC : cap->clkid, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/* set the timer for the earliest autofire toggle or chord flush, or
+ * disarm it */
+static void tmr_arm(struct evfdcap *cap)
+{
+    struct itimerspec its = {};
+    int i, on = 0;
+    for(i = 0; i < cap->conf->nautofire; i++)
+	if((cap->af_held & (1 << i)) &&
+	   (!on || ts_before(&cap->af[i].next, &its.it_value))) {
+	    its.it_value = cap->af[i].next;
+	    on = 1;
+	}
+    if(cap->ch_npend && (!on || ts_before(&cap->ch_deadline, &its.it_value))) {
+	its.it_value = cap->ch_deadline;
+	on = 1;
+    }
+    timerfd_settime(cap->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    if(on != cap->tmr_on) {
+	__atomic_store_n(&cap->tmr_on, on, __ATOMIC_RELAXED);
+	/* the feeder runs fed captures' timers */
+	if(!cap->fed)
+	    __atomic_add_fetch(&ntmr, on ? 1 : -1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Autofire:  while an autofire button is held, its output is toggled every
+ * half period. */
+/* process an autofire button press or release (after inversion) */
+/* returns 1 if the event should be dropped */
+static int af_key(struct evfdcap *cap, int a, int value)
+{
+    struct afstate *af = &cap->af[a];
+    int drop = 0;
+    if(value == 1) {
+	if(cap->af_held & (1 << a))
+	    return 1;
+	cap->af_held |= 1 << a;
+	af->out = 1;
+	clock_gettime(CLOCK_MONOTONIC, &af->next);
+	ts_add(&af->next, cap->conf->autofire[a].half_ns);
+    } else if(value == 0) {
+	if(!(cap->af_held & (1 << a)))
+	    return 0;
+	cap->af_held &= ~(1 << a);
+	/* if it's currently toggled off, there's nothing to release */
+	drop = !af->out;
+	af->out = 0;
+    } else /* key repeat makes no sense here */
+	return 1;
+    tmr_arm(cap);
+    return drop;
+}
+
+/* Chords:  presses of buttons which are part of a chord are held back
+ * (in ch_ev) until either a chord is complete, the held back presses can
+ * no longer be part of a chord, one of them is released, or the window
+ * has passed.  The window is measured using event time stamps, and is
+ * enforced by the timer if no other event arrives in time.  When a chord
+ * is complete, its buttons' presses and releases are replaced by the
+ * chord's output, which is released as soon as any of them is released. */
+/* is t more than the chord window after the first held back press? */
+static int ch_expired(const struct evfdcap *cap, const struct timeval *t)
+{
+    const struct timeval *t0 = &cap->ch_ev[0].time;
+    return (t->tv_sec - t0->tv_sec) * 1000000L + t->tv_usec - t0->tv_usec >
+	cap->conf->chord_window;
+}
+
+/* send held back presses, or the chord they make up */
+/* returns # of events placed in out */
+static int ch_flush(struct evfdcap *cap, struct input_event *out)
+{
+    const struct evjrconf *sec = cap->conf;
+    int c, n = cap->ch_npend;
+    if(!n)
+	return 0;
+    cap->ch_npend = 0;
+    for(c = 0; c < sec->nchord; c++)
+	if(sec->chord[c].mask == cap->ch_pend) {
+	    out[0] = cap->ch_ev[n - 1];
+	    out[0].code = sec->chord[c].code;
+	    cap->ch_held |= cap->ch_pend;
+	    cap->ch_active |= 1 << c;
+	    n = 1;
+	    break;
+	}
+    if(c == sec->nchord)
+	memcpy(out, cap->ch_ev, n * sizeof(*out));
+    cap->ch_pend = 0;
+    return n;
+}
+
+/* process a chord member button event (after inversion) */
+/* returns # of events to send instead, placed in out (up to
+ * MAX_CHORD_KEYS + 1) */
+static int ch_key(struct evfdcap *cap, int m, const struct input_event *ev,
+		  struct input_event *out)
+{
+    const struct evjrconf *sec = cap->conf;
+    unsigned bit = 1U << m, pend;
+    int c, n = 0, full = -1, more = 0;
+    if(cap->ch_npend && ch_expired(cap, &ev->time))
+	n = ch_flush(cap, out);
+    if(ev->value == 1) {
+	if((cap->ch_pend | cap->ch_held) & bit)
+	    return n;
+	pend = cap->ch_pend | bit;
+	for(c = 0; c < sec->nchord; c++)
+	    if(sec->chord[c].mask == pend)
+		full = c;
+	    else if((sec->chord[c].mask & pend) == pend)
+		more = 1;
+	if(!more && full < 0) {
+	    /* not part of any chord with what's held back */
+	    n += ch_flush(cap, out + n);
+	    pend = bit;
+	    more = 1; /* every member is part of some chord */
+	}
+	if(!cap->ch_npend) {
+	    /* the window starts at the event's time stamp, not now */
+	    struct timeval now;
+	    long age = 0;
+	    if(cap->clkid >= 0) {
+		ev_now(cap, &now);
+		age = (now.tv_sec - ev->time.tv_sec) * 1000000L +
+		    now.tv_usec - ev->time.tv_usec;
+		if(age < 0)
+		    age = 0;
+	    }
+	    clock_gettime(CLOCK_MONOTONIC, &cap->ch_deadline);
+	    if(age < sec->chord_window)
+		ts_add(&cap->ch_deadline, (sec->chord_window - age) * 1000L);
+	}
+	cap->ch_ev[cap->ch_npend++] = *ev;
+	cap->ch_pend = pend;
+	/* complete now, unless a longer chord might still be coming */
+	if(full >= 0 && !more)
+	    n += ch_flush(cap, out + n);
+	tmr_arm(cap);
+	return n;
+    }
+    if(ev->value == 0) {
+	if(cap->ch_pend & bit) {
+	    /* a tap; send it as is, unless what's held back is a chord that
+	     * was waiting for a longer one */
+	    n += ch_flush(cap, out + n);
+	    tmr_arm(cap);
+	}
+	if(cap->ch_held & bit) {
+	    cap->ch_held &= ~bit;
+	    for(c = 0; c < sec->nchord; c++)
+		if((cap->ch_active & (1 << c)) && (sec->chord[c].mask & bit)) {
+		    cap->ch_active &= ~(1 << c);
+		    out[n] = *ev;
+		    out[n++].code = sec->chord[c].code;
+		}
+	    return n;
+	}
+    } else if((cap->ch_pend | cap->ch_held) & bit) /* repeat */
+	return n;
+    out[n++] = *ev;
+    return n;
+}
+
+/* this is where most of the translation takes place:  modify read events */
+/* note that I do not intercept other forms of read as no known program uses them */
+/* e.g. readv, pread, preadv, aio_read, fread, fscanf, getc/fgetc, fgets, syscall */
+/* if one event turns into several, the rest are placed in extra[] */
+/* returns the number of extra events (up to XL_MAX_EXTRA) */
+#define XL_MAX_EXTRA MAX_CHORD_KEYS
+static int process_ev_read(struct input_event *ev, struct evfdcap *cap,
+			   int *_mod, int *_drop, struct input_event *extra)
+{
+    int drop = 0, mod; /* drop it?  copy it back? */
+    int nextra = 0;
+    if(ev->type == EV_KEY) {
+	if(ev->code >= KEY_CNT) { /* only possible via jsremap */
+	    *_mod = 0;
+	    *_drop = cap->conf->filter_bt;
+	    return 0;
+	}
+	const struct xlkey *x = &cap->xl_key[ev->code];
+	mod = x->mod;
+	switch(x->op) {
+	  case XL_MAP:
+	    ev->code = x->code;
+	    ev->value = (ev->value ^ x->neg) - x->neg + x->add;
+	    break;
+	  case XL_DROP:
+	    drop = 1;
+	    break;
+	  case XL_KEY_AF:
+	    ev->code = x->code;
+	    ev->value = (ev->value ^ x->neg) - x->neg + x->add;
+	    drop = af_key(cap, x->onax, ev->value);
+	    break;
+	  case XL_KEY_CHORD: {
+	    struct input_event o[MAX_CHORD_KEYS + 1];
+	    int n;
+	    ev->code = x->code;
+	    ev->value = (ev->value ^ x->neg) - x->neg + x->add;
+	    if(!(n = ch_key(cap, x->onax, ev, o)))
+		drop = 1;
+	    else {
+		*ev = o[0];
+		nextra = n - 1;
+		memcpy(extra, o + 1, nextra * sizeof(*o));
+	    }
+	    break;
+	  }
+	  case XL_KEY_AX: {
+	    int pressed = ev->value;
+	    int ax = pressed ? x->onax : x->offax;
+	    if(ax < 0)
+		drop = 1;
+	    else {
+		ev->type = EV_ABS;
+		ev->code = ax;
+		cap->axval[ax] = ev->value = pressed ? x->onval : x->offval;
+	    }
+	    break;
+	  }
+	}
+    } else if(ev->type == EV_ABS) {
+	if(ev->code >= ABS_CNT) { /* only possible via jsremap */
+	    *_mod = 0;
+	    *_drop = cap->conf->filter_ax;
+	    return 0;
+	}
+	struct xlabs *x = &cap->xl_abs[ev->code];
+	mod = x->mod;
+	switch(x->op) {
+	  case XL_MAP:
+	    ev->code = x->code;
+	    ev->value = (ev->value ^ x->neg) - x->neg + x->add;
+	    break;
+	  case XL_DROP:
+	    drop = 1;
+	    break;
+	  case XL_ABS_SCALE:
+	    ev->code = x->code;
+	    ev->value = rescale(&x->sc, ev->value);
+	    break;
+	  case XL_ABS_KEY: {
+	    ev->type = EV_KEY;
+
+	    int pressed = !!(x->state & AXFL_PRESSED);
+	    int npressed = !(x->state & AXFL_NPRESSED);
+	    int tog, ntog; /* did the target/ntarget state change? */
+	    if(ev->value >= x->onthresh)
+		tog = !pressed;
+	    else if(ev->value < x->offthresh)
+		tog = pressed;
+	    else
+		tog = 0;
+	    if(ev->value <= x->nonthresh)
+		ntog = !npressed;
+	    else if(ev->value > x->noffthresh)
+		ntog = npressed;
+	    else
+		ntog = 0;
+	    /* if tog and ntog, ntog is sent as an extra event; the
+	     * caller either squeezes it into the read buffer or
+	     * queues it for the next read() */
+	    if(tog) {
+		ev->code = x->code;
+		ev->value = !pressed;
+		x->state ^= AXFL_PRESSED;
+	    }
+	    if(ntog) {
+		struct input_event *nev = ev;
+		if(tog) {
+		    *extra = *ev;
+		    nev = extra;
+		    nextra = 1;
+		}
+		nev->code = x->ncode;
+		nev->value = !npressed;
+		x->state ^= AXFL_NPRESSED;
+	    }
+	    if(!tog && !ntog)
+		drop = 1;
+	    break;
+	  }
+	}
+    } else
+	mod = 0;
+    *_mod = mod;
+    *_drop = drop;
+    return nextra;
+}
+
+/* EVIOCGKEY is answered from keystates, which follows the key events
+ * sent to the program (or queued for it) as they are translated or
+ * generated.  It's only computed from the device's state by ev_gkey() at
+ * open and after the device drops events. */
+#define ks_note(cap, e) do { \
+    if((e)->type == EV_KEY && (e)->code < KEY_CNT) { \
+	if((e)->value) \
+	    ULSET((cap)->keystates, (e)->code); \
+	else \
+	    ULCLR((cap)->keystates, (e)->code); \
+    } \
+} while(0)
+
+/* Synthetic events which don't fit into the caller's buffer are queued
+ * per fd, and returned by subsequent read()s before reading the device
+ * again.  Since the device itself may have nothing more to say, the
+ * poll() family (see below) is also intercepted to report the fd as
+ * readable while anything is queued. */
+/* queue n events, or none if they don't all fit */
+static void pendq_push(struct evfdcap *cap, const union xev *e, int n)
+{
+    unsigned tail = cap->pendq_tail;
+    if(tail - cap->pendq_head + n > PENDQ_SZ) {
+	jlog(JL_WARN, "%d: synthetic event queue full; dropping\n", cap->fd);
+	return;
+    }
+    if(tail == cap->pendq_head)
+	__atomic_add_fetch(&npend, 1, __ATOMIC_RELEASE);
+    while(n-- > 0)
+	cap->pendq[tail++ % PENDQ_SZ] = *e++;
+    __atomic_store_n(&cap->pendq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* dequeue up to n events of size ev_size into buf */
+/* returns number of events dequeued */
+static int pendq_pop(struct evfdcap *cap, char *buf, int n, int ev_size)
+{
+    unsigned head = cap->pendq_head, tail = cap->pendq_tail;
+    int i;
+    for(i = 0; i < n && head != tail; i++, head++)
+	memcpy(buf + i * ev_size, &cap->pendq[head % PENDQ_SZ], ev_size);
+    __atomic_store_n(&cap->pendq_head, head, __ATOMIC_RELEASE);
+    if(i && head == tail)
+	__atomic_sub_fetch(&npend, 1, __ATOMIC_RELEASE);
+    return i;
+}
+
+/* anything queued?  safe to call from any thread */
+static inline int pendq_ready(const struct evfdcap *cap)
+{
+    return __atomic_load_n(&cap->pendq_head, __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&cap->pendq_tail, __ATOMIC_ACQUIRE);
+}
+
+/* how many events may be read from the device and translated at once,
+ * if the translation has to fit into room events as well as the queue */
+/* pendq_push() can only drop whole pushes, which would break up frames,
+ * so reads are kept small enough that it never has to */
+/* room includes whatever is already queued; at least 1 is returned */
+static int xl_room(const struct evfdcap *cap, int room)
+{
+    int n = (room < PENDQ_SZ ? room : PENDQ_SZ) -
+	    (int)(cap->pendq_tail - cap->pendq_head);
+    return n < cap->xl_grow ? 1 : n / cap->xl_grow;
+}
+
+
+/* store translated event e (member m of union xev) at out if that doesn't
+ * overwrite anything unread (including in, unless done with it), or
+ * queue it */
+#define xl_out(e, m, done) do { \
+    if(!queued && out < in + (done)) \
+	*out++ = (e); \
+    else { \
+	union xev q; \
+	q.m = (e); \
+	queued = 1; \
+	pendq_push(cap, &q, 1); \
+    } \
+} while(0)
+
+/* translate a buffer of event device events in place */
+/* this is a single pass with separate read and write cursors, so dropped
+ * events just leave the write cursor behind rather than being memmove()d
+ * out of the buffer one at a time */
+/* returns the number of events left in the buffer */
+static int xlate_ev(struct evfdcap *cap, struct input_event *ev, int n)
+{
+    const struct evjrconf *sec = cap->conf;
+    struct input_event *in, *out = ev, *end = ev + n;
+    struct input_event extra[XL_MAX_EXTRA];
+    int queued = 0; /* once anything is queued, everything after it is */
+    int nmod = 0, ndrop = 0, ninj = 0;
+    for(in = ev; in < end; in++) {
+	int mod, drop, nx, i;
+	/* held back chord presses whose window has passed go first */
+	if(cap->ch_npend && ch_expired(cap, &in->time)) {
+	    nx = ch_flush(cap, extra);
+	    tmr_arm(cap);
+	    ninj += nx;
+	    for(i = 0; i < nx; i++) {
+		ks_note(cap, &extra[i]);
+		xl_out(extra[i], ev, 0);
+	    }
+	}
+	if(in->type == EV_SYN && in->code == SYN_DROPPED)
+	    cap->ks_stale = 1;
+	nx = process_ev_read(in, cap, &mod, &drop, extra);
+	nmod += mod && !drop;
+	ndrop += drop;
+	ninj += nx;
+	/* the best way to drop the event would be to remove it entirely.
+	 * Is this safe?  Maybe.  If the program expects data, and insists
+	 * on it, it may crash.  Also, if removing an event reduces the
+	 * return length to 0, another read() should be done on the device.
+	 * It probably doesn't matter if the device is blocking or not,
+	 * since the behavior will mostly match what the program expects.
+	 * Well, except for the now superfluous SYN_REPORT events. */
+	/* I used to instead convert to SYN_DROPPED.  Is this safe?  not
+	 * if SYN is dropped via EVIOCSMASK, or if the program has special
+	 * behavior on seeing SYN_DROPPED events. */
+	/* Now I allow a choice */
+	/* FIXME:  add option to drop SYN_REPORT if all prior events dropped */
+	if(drop) {
+	    if(!sec->syn_drop)
+		continue;
+	    in->code = SYN_DROPPED;
+	    in->type = EV_SYN;
+	    in->value = 0;
+	}
+	ks_note(cap, in);
+	if(!queued && out <= in) {
+	    if(out != in)
+		*out = *in;
+	    out++;
+	} else
+	    xl_out(*in, ev, 1);
+	/* use slots freed up by earlier drops if possible */
+	for(i = 0; i < nx; i++) {
+	    ks_note(cap, &extra[i]);
+	    xl_out(extra[i], ev, 1);
+	}
+    }
+    STAT_ADD(ev_in, n);
+    STAT_ADD(ev_mod, nmod);
+    STAT_ADD(ev_drop, ndrop);
+    STAT_ADD(ev_inject, ninj);
+    return out - ev;
+}
+
+/* map a translated event to a js number; returns -1 if there is none */
+static int js_number(const struct evfdcap *cap, const struct input_event *ev)
+{
+    int newnum;
+    if(ev->type == EV_KEY) {
+	if(ev->code < BTN_MISC ||
+	   (newnum = cap->js_extra->out_btn_map[ev->code - BTN_MISC]) == 0xffff)
+	    return -1;
+    } else if((newnum = cap->js_extra->out_ax_map[ev->code]) == 0xff)
+	return -1;
+    return newnum;
+}
+
+/* convert a translated event to js; returns 0 if it has no js number */
+static int ev_to_js(const struct evfdcap *cap, const struct input_event *ev,
+		    int init, struct js_event *js)
+{
+    int num = js_number(cap, ev);
+    if(num < 0)
+	return 0;
+    js->time = ev->time.tv_sec * 1000 + ev->time.tv_usec / 1000;
+    js->type = init | (ev->type == EV_KEY ? JS_EVENT_BUTTON : JS_EVENT_AXIS);
+    js->value = ev->value;
+    js->number = num;
+    return 1;
+}
 
-/* Common code for multiple nearly identical close calls */
-/* Basically just disable intercept */
-static void ev_close(int fd)
+/* translate a buffer of js device events in place; see xlate_ev() */
+static int xlate_js(struct evfdcap *cap, struct js_event *jev, int n)
 {
-    pthread_mutex_lock(&lock);
-    struct evfdcap **p;
-    for(p = &ev_fd; *p; p = &(*p)->next)
-	if((*p)->fd == fd) {
-	    struct evfdcap *c = *p;
-	    /* critical section, protected by lock */
-	    *p = c->next;
-	    /* critical section, protected by lock */
-	    c->next = free_ev_fd;
-	    if(c->js_extra)
-		free(c->js_extra);
-	    free_ev_fd = c;
-	    fprintf(logf, "closing %d\n", fd);
-	    break;
+    struct js_event *in, *out = jev, *end = jev + n, js;
+    struct input_event ev = {}, extra[XL_MAX_EXTRA];
+    int queued = 0;
+    int nmod = 0, ndrop = 0, ninj = 0;
+    for(in = jev; in < end; in++) {
+	int mod, drop, nx, i;
+	/* only used for chord windows */
+	ev.time.tv_sec = in->time / 1000;
+	ev.time.tv_usec = in->time % 1000 * 1000;
+	if(cap->ch_npend && ch_expired(cap, &ev.time)) {
+	    nx = ch_flush(cap, extra);
+	    tmr_arm(cap);
+	    ninj += nx;
+	    for(i = 0; i < nx; i++)
+		if(ev_to_js(cap, &extra[i], 0, &js))
+		    xl_out(js, js, 0);
 	}
-    pthread_mutex_unlock(&lock);
+	/* FIXME:  value probably needs adjusting for axes */
+	ev.value = in->value;
+	if((in->type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON) {
+	    ev.type = EV_KEY;
+	    ev.code = cap->js_extra->in_btn_map[in->number];
+	} else if((in->type & ~JS_EVENT_INIT) == JS_EVENT_AXIS) {
+	    ev.type = EV_ABS;
+	    ev.code = cap->js_extra->in_ax_map[in->number];
+	}
+	nx = process_ev_read(&ev, cap, &mod, &drop, extra);
+	int newnum = 0;
+	if(!drop) {
+	    /* js may also shift and drop numbers */
+	    if((newnum = js_number(cap, &ev)) < 0)
+		drop = 1;
+	    else if(newnum != in->number)
+		mod = 1;
+	}
+	nmod += mod && !drop;
+	ndrop += drop;
+	ninj += nx;
+	/* JS offers no SYN_DROPPED, so just drop entirely */
+	if(!drop) {
+	    if(mod) {
+		in->type = (in->type & JS_EVENT_INIT) |
+		    (ev.type == EV_KEY ? JS_EVENT_BUTTON : JS_EVENT_AXIS);
+		/* FIXME:  value probably needs adjusting for axes */
+		in->value = ev.value;
+		in->number = newnum;
+	    }
+	    if(!queued && out <= in) {
+		if(out != in)
+		    *out = *in;
+		out++;
+	    } else
+		xl_out(*in, js, 1);
+	}
+	for(i = 0; i < nx; i++)
+	    if(ev_to_js(cap, &extra[i], in->type & JS_EVENT_INIT, &js))
+		xl_out(js, js, 1);
+    }
+    STAT_ADD(ev_in, n);
+    STAT_ADD(ev_mod, nmod);
+    STAT_ADD(ev_drop, ndrop);
+    STAT_ADD(ev_inject, ninj);
+    return out - jev;
 }
 
-int close(int fd)
+/* queue a generated event, plus SYN_REPORT for event devices */
+static void pendq_push_ev(struct evfdcap *cap, const struct input_event *ev)
 {
-    ev_close(fd);
-    return real_close(fd);
+    union xev q[2];
+    ks_note(cap, ev);
+    if(cap->js_extra) {
+	if(ev_to_js(cap, ev, 0, &q[0].js))
+	    pendq_push(cap, q, 1);
+	return;
+    }
+    q[0].ev = q[1].ev = *ev;
+    q[1].ev.type = EV_SYN;
+    q[1].ev.code = SYN_REPORT;
+    q[1].ev.value = 0;
+    pendq_push(cap, q, 2);
 }
 
-/* fopen seems to be what c++ uses */
-#if CAP_FOPEN
-/* requires fread, fclose intercept as well, and probably more */
-/* however, gcc uses read(), so only fclose() for now */
-FILE *fopen(const char *pathname, const char *mode)
+/* queue any autofire toggles and chord timeouts that are due */
+static void tmr_service(struct evfdcap *cap)
 {
-    DIS_SYSCALL;
-    FILE *res = real_fopen(pathname, mode);
-    EN_SYSCALL;
-    if(!res)
-	return res;
-    int en = errno;
-    int fd = fileno(res);
-    errno = en;
-    if(fd < 0)
-	return res;
-    if(ev_open("fopen", pathname, fd) < 0) {
-	fclose(res);
-	return NULL;
+    unsigned long long ticks;
+    struct timespec now;
+    struct input_event ev = { .type = EV_KEY }, ch[MAX_CHORD_KEYS];
+    int i, n, en = errno;
+    if(real_read(cap->tfd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+	errno = en;
+	return;
     }
-    return res;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ev_now(cap, &ev.time);
+    for(i = 0; i < cap->conf->nautofire; i++) {
+	struct afstate *af = &cap->af[i];
+	if(!(cap->af_held & (1 << i)) || ts_before(&now, &af->next))
+	    continue;
+	af->out = !af->out;
+	ts_add(&af->next, cap->conf->autofire[i].half_ns);
+	/* if the program fell behind, don't try to catch up */
+	if(ts_before(&af->next, &now)) {
+	    af->next = now;
+	    ts_add(&af->next, cap->conf->autofire[i].half_ns);
+	}
+	ev.code = cap->conf->autofire[i].code;
+	ev.value = af->out;
+	pendq_push_ev(cap, &ev);
+	STAT_ADD(ev_inject, 1);
+    }
+    if(cap->ch_npend && !ts_before(&now, &cap->ch_deadline)) {
+	n = ch_flush(cap, ch);
+	for(i = 0; i < n; i++)
+	    pendq_push_ev(cap, &ch[i]);
+	STAT_ADD(ev_inject, n);
+    }
+    tmr_arm(cap);
+    errno = en;
 }
 
-FILE *fopen64(const char *pathname, const char *mode)
+/* when autofire or chords are active on a blocking fd, read() has to wait
+ * for either the device or the timer.  Returns 1 if the timer is ready,
+ * and -1 on errors (e.g. EINTR), which read() should return. */
+static int tmr_wait(struct evfdcap *cap, int fd)
 {
-    DIS_SYSCALL;
-    FILE *res = real_fopen64(pathname, mode);
-    EN_SYSCALL;
-    if(!res)
-	return res;
-    int en = errno;
-    int fd = fileno(res);
+    struct pollfd pfd[2] = {
+	{ .fd = fd, .events = POLLIN },
+	{ .fd = cap->tfd, .events = POLLIN }
+    };
+    int en = errno, fl = fcntl(fd, F_GETFL);
+    if(fl < 0 || (fl & O_NONBLOCK)) {
+	errno = en;
+	return 0;
+    }
+    if(real_poll(pfd, 2, -1) < 0)
+	return -1;
     errno = en;
-    if(fd < 0)
-	return res;
-    if(ev_open("fopen64", pathname, fd) < 0) {
-	fclose(res);
-	return NULL;
+    return !!(pfd[1].revents & POLLIN);
+}
+
+/* read exactly len bytes, even from a non-blocking fd */
+/* only used to complete partial events, which devices never return */
+static int read_rest(int fd, char *buf, int len)
+{
+    while(len > 0) {
+	int r = real_read(fd, buf, len);
+	if(r < 0 && errno != EINTR && errno != EAGAIN)
+	    return r;
+	if(r > 0) {
+	    len -= r;
+	    buf += r;
+	}
     }
-    return res;
+    return 0;
 }
 
-int fclose(FILE *f)
+/* add n events about to be returned by read() to the histograms */
+/* lock-free; threads reading the same fd just add to the same counters */
+static void lat_record(struct evfdcap *cap, const struct input_event *ev, int n)
 {
-    if(!f)
-	return real_fclose(f);
-    int fd = fileno(f);
-    if(fd < 0)
-	return real_fclose(f);
-    ev_close(fd);
-    return real_fclose(f);
+    struct timeval now;
+    time_t next;
+    if(cap->js_extra)
+	return;
+    ev_now(cap, &now);
+    for(; n > 0; n--, ev++) {
+	long long us = (now.tv_sec - ev->time.tv_sec) * 1000000LL +
+	               now.tv_usec - ev->time.tv_usec;
+	int t = ev->type == EV_SYN ? LAT_SYN : ev->type == EV_KEY ? LAT_KEY :
+	        ev->type == EV_ABS ? LAT_ABS : LAT_OTHER, b;
+	if(us < 0) {
+	    __atomic_add_fetch(&cap->lat.early, 1, __ATOMIC_RELAXED);
+	    continue;
+	}
+	b = us ? 64 - __builtin_clzll(us) : 0;
+	if(b >= LAT_NB)
+	    b = LAT_NB - 1;
+	__atomic_add_fetch(&cap->lat.cnt[t][b], 1, __ATOMIC_RELAXED);
+    }
+    /* only one thread gets to do the periodic dump */
+    if(lat_period && now.tv_sec >= (next = cap->lat_next) &&
+       __atomic_compare_exchange_n(&cap->lat_next, &next, now.tv_sec + lat_period,
+				   0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+       next)
+	lat_dump(cap);
 }
-#endif
 
-/* this is where most of the translation takes place:  modify read events */
-/* note that I do not intercept other forms of read as no known program uses them */
-/* e.g. readv, pread, preadv, aio_read, fread, fscanf, getc/fgetc, fgets, syscall */
-static void process_ev_read(struct input_event *ev, const struct evjrconf *sec,
-			    struct evfdcap *cap, int *_mod, int *_drop)
+/* Captures with merged devices are read here rather than directly by
+ * read():  whatever the captured device and the merged devices have is
+ * translated, and queued one SYN_REPORT-terminated frame at a time,
+ * oldest first.  If nothing is there, this waits for any of them or the
+ * timer, unless the fd is non-blocking or wait is 0.  Returns 1 if read()
+ * should look at the queue again, or else what read() should return. */
+#define MERGE_RD (PENDQ_SZ / 2 / (MAX_MERGE + 1)) /* events per device */
+static int merge_fill(struct evfdcap *cap, int fd, int wait)
 {
-    int drop = 0, mod = 0; /* drop it?  copy it back? */
-    if(ev->type == EV_KEY) {
-	drop = sec->filter_bt;
-	const struct butmap *m = &sec->bt_map[ev->code - sec->bt_low];
-	if(ev->code >= sec->bt_low && ev->code < sec->bt_low + sec->nbt &&
-	   (m->flags & BTFL_MAP)) {
-	    if((drop = m->target == -1))
-		;
-	    else if(!(m->flags & BTFL_AXIS)) {
-		mod = ev->code != m->target || (m->flags & BTFL_INVERT);
-		ev->code = m->target;
-		if(m->flags & BTFL_INVERT)
-		    ev->value = 1 - ev->value;
-	    } else {
-		int pressed = ev->value;
-		int ax = pressed ? m->onax : m->offax;
-		if(ax < 0)
-		    drop = 1;
-		else {
-		    ev->type = EV_ABS;
-		    ev->code = ax;
-		    cap->axval[ax] = ev->value = pressed ? m->onval : m->offval;
-		    mod = 1;
-		}
-	    }
+    struct evfdcap *c[MAX_MERGE + 1];
+    struct pollfd pfd[MAX_MERGE + 2];
+    /* merged devices' translation at most doubles them (axis to buttons) */
+    struct input_event ev[MAX_MERGE + 1][MERGE_RD * 2];
+    int n[MAX_MERGE + 1], pos[MAX_MERGE + 1];
+    int s, e, best, np, ns = cap->nmerged + 1, gone = 0, fl, en = errno;
+    ssize_t r;
+
+    c[0] = cap;
+    memcpy(c + 1, cap->merged, (ns - 1) * sizeof(*c));
+    for(s = 0; s < ns; s++) {
+	pfd[s].fd = c[s]->fd;
+	pfd[s].events = POLLIN;
+    }
+    np = ns;
+    if(cap->tmr_on) {
+	pfd[np].fd = cap->tfd;
+	pfd[np++].events = POLLIN;
+    }
+    if(!(r = real_poll(pfd, np, 0)) && wait &&
+       (fl = fcntl(fd, F_GETFL)) >= 0 && !(fl & O_NONBLOCK))
+	r = real_poll(pfd, np, -1);
+    if(r <= 0) {
+	if(!r)
+	    errno = EAGAIN;
+	return -1;
+    }
+    for(s = 0; s < ns; s++) {
+	n[s] = pos[s] = 0;
+	if(!pfd[s].revents)
+	    continue;
+	r = xl_room(c[s], MERGE_RD * 2);
+	r = real_read(c[s]->fd, ev[s], (r < MERGE_RD ? r : MERGE_RD) * sizeof(**ev));
+	if(r > 0 && r % sizeof(**ev)) {
+	    if(read_rest(c[s]->fd, (char *)ev[s] + r, sizeof(**ev) - r % sizeof(**ev)) < 0)
+		r = -1;
+	    else
+		r += sizeof(**ev) - r % sizeof(**ev);
 	}
-    } else if(ev->type == EV_ABS) {
-	drop = sec->filter_ax;
-	struct axmap *m = &sec->ax_map[ev->code];
-	if(ev->code >= 0 && ev->code < sec->nax && (m->flags & AXFL_MAP)) {
-	    if((drop = m->target == -1))
-		;
-	    else if(!(m->flags & AXFL_BUTTON)) {
-		mod = ev->code != m->target || (m->flags & (AXFL_INVERT | AXFL_RESCALE));
-		ev->code = m->target;
-		if(m->flags & AXFL_RESCALE) {
-		    ev->value = (ev->value - m->offthresh) * ((long)m->ai.maximum - m->ai.minimum + 1) / ((long)m->onthresh - 2 * m->offthresh + 1) + m->ai.minimum;
-		    if(m->flags & AXFL_INVERT)
-			ev->value = m->ai.minimum + m->ai.maximum - ev->value;
-		} else if(m->flags & AXFL_INVERT)
-			ev->value = m->onthresh - ev->value;
-	    } else {
-		mod = 1;
-		ev->type = EV_KEY;
-
-		int pressed = !!(m->flags & AXFL_PRESSED);
-		int npressed = !(m->flags & AXFL_NPRESSED);
-		int tog, ntog; /* did the target/ntarget state change? */
-		if(ev->value >= m->onthresh)
-		    tog = !pressed;
-		else if(ev->value < m->offthresh)
-		    tog = pressed;
-		else
-		    tog = 0;
-		if(ev->value <= m->nonthresh)
-		    ntog = !npressed;
-		else if(ev->value > m->noffthresh)
-		    ntog = npressed;
-		else
-		    ntog = 0;
-		/* can't send multiple events right now, so if tog and
-		 * ntog, only tog is honored */
-		/* sending multiple events will require intercepting
-		 * poll(2), select(2), and probably others in the
-		 * same family (ppoll, pselect, epoll?, aliases) */
-		/* the only time it's easy is if the buffer size is
-		 * big enough to just insert them, or if we can rely
-		 * on the program looping until 0 returned */
-		/* most devices send lots of axis events, so probably
-		 * ntog will eventually be honored */
-		if(tog) {
-		    ev->code = m->target;
-		    ev->value = !pressed;
-		    m->flags ^= AXFL_PRESSED;
-		} else if(ntog) {
-		    ev->code = m->ntarget;
-		    ev->value = !npressed;
-		    m->flags ^= AXFL_NPRESSED;
-		} else
-		    drop = 1;
+	if(r < 0 && (errno == EAGAIN || errno == EINTR)) {
+	    errno = en;
+	    continue;
+	}
+	if(r <= 0) {
+	    /* the captured device is first, so nothing is lost */
+	    if(!s)
+		return r;
+	    gone |= 1 << s;
+	    continue;
+	}
+	if(!s && rec_map && cap->rec_dev >= 0)
+	    rec_events(cap, (char *)ev[s], r / sizeof(**ev));
+	n[s] = xlate_ev(c[s], ev[s], r / sizeof(**ev));
+	/* whatever xlate_ev() queued goes right after it; cap's own queue
+	 * was empty, or this wouldn't have been called */
+	n[s] += pendq_pop(c[s], (char *)(ev[s] + n[s]), MERGE_RD * 2 - n[s],
+			  sizeof(**ev));
+    }
+    while(1) {
+	for(best = -1, s = 0; s < ns; s++)
+	    if(pos[s] < n[s] &&
+	       (best < 0 || tv_before(&ev[s][pos[s]].time, &ev[best][pos[best]].time)))
+		best = s;
+	if(best < 0)
+	    break;
+	for(e = pos[best]; e < n[best]; e++)
+	    if(ev[best][e].type == EV_SYN && ev[best][e].code == SYN_REPORT) {
+		e++;
+		break;
 	    }
+	for(; pos[best] < e; pos[best]++) {
+	    union xev q;
+	    q.ev = ev[best][pos[best]];
+	    pendq_push(cap, &q, 1);
 	}
     }
-    *_mod = mod;
-    *_drop = drop;
-    return;
+    for(s = ns - 1; s > 0; s--)
+	if(gone & (1 << s))
+	    merge_drop(cap, s - 1);
+    return 1;
 }
 
-
-ssize_t read(int fd, void *buf, size_t count)
+ssize_t read(int fd, void *_buf, size_t count)
 {
+    struct evfdcap *cap = cap_rd(fd);
+    if(!cap)
+	return real_read(fd, _buf, count);
+    char *buf = _buf;
+    STAT_ADD(reads, 1);
+    int ev_size = cap->js_extra ? sizeof(struct js_event) : sizeof(struct input_event);
     /* this is complicated if the caller read less than even multiple of
      * sizeof(ev).  Need to force a read of even multiple from device and
      * keep the excess read for future returns */
     /* very unlikely to ever happen */
     int ret_adj = 0;
-    struct evfdcap *cap = cap_of(fd);
-    if(cap && cap->excess_read) {
+    if(cap->excess_read) {
 	ret_adj = count < cap->excess_read ? count : cap->excess_read;
-	memcpy(buf, cap->ebuf, ret_adj);
-	if(ret_adj < cap->excess_read)
-	    memmove(cap->ebuf, cap->ebuf + ret_adj, cap->excess_read - ret_adj);
+	memcpy(buf, (char *)&cap->ebuf + ev_size - cap->excess_read, ret_adj);
 	cap->excess_read -= ret_adj;
 	count -= ret_adj;
 	if(!count)
 	    return ret_adj;
 	buf += ret_adj;
     }
-    ssize_t ret = real_read(fd, buf, count);
-    if(ret < 0 || !cap)
-	return ret;
-    const struct evjrconf *sec = cap->conf;
-    int nread = ret;
-    struct input_event ev;
-    struct js_event jev = {}; /* init to shut gcc up */
-    int ev_size = cap->js_extra ? sizeof(jev) : sizeof(ev);
-    void *evp = cap->js_extra ? (void *)&jev : (void *)&ev;
-    while(nread > 0) {
-	if(nread < ev_size) {
-	    int todo = cap->excess_read = ev_size - nread;
-	    while(todo > 0) {
-		int r = real_read(fd, cap->ebuf + cap->excess_read - todo, todo);
-		if(r < 0 && errno != EINTR && errno != EAGAIN) {
-		    cap->excess_read = 0;
-		    return r;
-		}
-		if(r > 0)
-		    todo -= r;
+    while(1) {
+	if(cap->tmr_on)
+	    tmr_service(cap);
+	/* queued events come before anything new from the device */
+	if(cap->pendq_head != cap->pendq_tail) {
+	    if(count >= ev_size) {
+		int n = pendq_pop(cap, buf, count / ev_size, ev_size);
+		STAT_ADD(ev_out, n);
+		if(lat_on)
+		    lat_record(cap, (struct input_event *)buf, n);
+		return n * ev_size + ret_adj;
 	    }
-	    memcpy(evp, buf, nread);
-	    memcpy(((char *)&evp) + nread, cap->ebuf, cap->excess_read);
-	} else
-	    memcpy(evp, buf, ev_size);
-	/* now jev/ev has an event. */
-	int mod, drop;
-	if(!cap->js_extra) {
-	    process_ev_read(&ev, sec, cap, &mod, &drop);
-	    /* the best way to drop the event would be to remove it entirely.
-	     * Is this safe?  Maybe.  If the program expects data, and insists
-	     * on it, it may crash.  Also, if removing an event reduces the
-	     * return length to 0, another read() should be done on the device.
-	     * It probably doesn't matter if the device is blocking or not,
-	     * since the behavior will mostly match what the program expects.
-	     * Well, except for the now superfluous SYN_REPORT events. */
-	    /* I used to instead convert to SYN_DROPPED.  Is this safe?  not
-	     * if SYN is dropped via EVIOCSMASK, or if the program has special
-	     * behavior on seeing SYN_DROPPED events. */
-	    /* Now I allow a choice */
-	    /* FIXME:  add option to drop SYN_REPORT if all prior events dropped */
-	    if(drop) {
-		if(sec->syn_drop) {
-		    ev.code = SYN_DROPPED;
-		    ev.type = EV_SYN;
-		    ev.value = 0;
-		    mod = 1;
-		} else {
-		    mod = 0;
-		    ret -= sizeof(ev);
-		    if(nread > sizeof(ev)) {
-			memmove(buf, buf + sizeof(ev), nread - sizeof(ev));
-			buf -= sizeof(ev);
-		    }
-		    if(ret <= 0) {
-			cap->excess_read = 0;
-			return read(fd, buf, count);
-		    }
+	    pendq_pop(cap, (char *)&cap->ebuf, 1, ev_size);
+	    memcpy(buf, &cap->ebuf, count);
+	    cap->excess_read = ev_size - count;
+	    return count + ret_adj;
+	}
+	if(cap->nmerged) {
+	    int r = merge_fill(cap, fd, !ret_adj);
+	    if(r <= 0)
+		return ret_adj ? ret_adj : r;
+	    continue;
+	}
+	if(cap->tmr_on) {
+	    int r = tmr_wait(cap, fd);
+	    if(r < 0)
+		return ret_adj ? ret_adj : r;
+	    if(r)
+		continue;
+	}
+	/* if there isn't room for a full event, read one into ebuf and
+	 * return what fits */
+	int tail = count < ev_size;
+	char *rbuf = tail ? (char *)&cap->ebuf : buf;
+	/* don't read more than the queue can absorb if it all grows */
+	size_t rlen = tail ? 1 : count / ev_size;
+	if(cap->xl_grow > 1 && rlen > PENDQ_SZ / cap->xl_grow)
+	    rlen = xl_room(cap, PENDQ_SZ);
+	ssize_t ret = real_read(fd, rbuf, rlen * ev_size);
+	if(ret <= 0)
+	    return ret_adj ? ret_adj : ret;
+	if(ret % ev_size) {
+	    int r = read_rest(fd, rbuf + ret, ev_size - ret % ev_size);
+	    if(r < 0)
+		return ret_adj ? ret_adj : r;
+	    ret += ev_size - ret % ev_size;
+	}
+	if(rec_map && cap->rec_dev >= 0)
+	    rec_events(cap, rbuf, ret / ev_size);
+	int nev = cap->js_extra ? xlate_js(cap, (struct js_event *)rbuf, ret / ev_size) :
+	                          xlate_ev(cap, (struct input_event *)rbuf, ret / ev_size);
+	if(nev) {
+	    STAT_ADD(ev_out, nev);
+	    if(lat_on)
+		lat_record(cap, (struct input_event *)rbuf, nev);
+	    if(!tail)
+		return nev * ev_size + ret_adj;
+	    memcpy(buf, rbuf, count);
+	    cap->excess_read = ev_size - count;
+	    return count + ret_adj;
+	}
+	/* everything was dropped.  Don't return 0 (EOF); if there was
+	 * already something to return, return that, otherwise read more */
+	if(ret_adj)
+	    return ret_adj;
+    }
+}
+
+/* Intercept the poll() family so that fds with queued synthetic events
+ * are reported as readable, and so that autofire/chord timers wake up
+ * callers waiting on the captured fd.  If nothing is queued and no timer
+ * is armed anywhere, which is nearly always the case, these just pass
+ * through after checking npend and ntmr.  Otherwise, if any of the
+ * caller's fds have something queued, the real call is made with a zero
+ * timeout and the queued fds are merged in.  Armed timers, or the epoll
+ * fd standing in for merged devices and the timer, are added to the real
+ * call, and reported as their captured fd. */
+#define POLLRD (POLLIN | POLLRDNORM)
+#define tmr_active(cap) __atomic_load_n(&(cap)->tmr_on, __ATOMIC_RELAXED)
+/* the extra fd to wait on for cap, and the one to do so right now */
+#define cap_wfd(cap) ((cap)->mfd >= 0 ? (cap)->mfd : (cap)->tfd)
+#define cap_xfd(cap) ((cap)->mfd >= 0 ? (cap)->mfd : tmr_active(cap) ? (cap)->tfd : -1)
+
+static int poll_merge(struct pollfd *fds, nfds_t nfds, int ret)
+{
+    struct evfdcap *cap;
+    nfds_t i;
+    if(ret < 0)
+	return ret;
+    for(i = 0; i < nfds; i++)
+	if((fds[i].events & POLLRD) && (cap = cap_rd(fds[i].fd)) && pendq_ready(cap)) {
+	    if(!fds[i].revents)
+		ret++;
+	    fds[i].revents |= fds[i].events & POLLRD;
+	}
+    return ret;
+}
+
+/* poll() and ppoll() when something is going on */
+static int poll_slow(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo,
+		     const sigset_t *sigmask)
+{
+    static const struct timespec zero_ts = {};
+    struct evfdcap *cap;
+    nfds_t i, nx = 0, mx;
+    int ret, np = 0, xfd;
+    for(i = 0; i < nfds; i++)
+	if((fds[i].events & POLLRD) && (cap = cap_rd(fds[i].fd))) {
+	    if(pendq_ready(cap))
+		np++;
+	    if(cap_xfd(cap) >= 0)
+		nx++;
+	}
+    if(np)
+	tmo = &zero_ts;
+    if(!nx)
+	return poll_merge(fds, nfds, real_ppoll(fds, nfds, tmo, sigmask));
+    struct pollfd xfds[nfds + nx];
+    nfds_t owner[nx];
+    memcpy(xfds, fds, nfds * sizeof(*fds));
+    /* timers may have been armed since */
+    for(i = 0, mx = nx, nx = 0; i < nfds && nx < mx; i++)
+	if((fds[i].events & POLLRD) && (cap = cap_rd(fds[i].fd)) &&
+	   (xfd = cap_xfd(cap)) >= 0) {
+	    xfds[nfds + nx].fd = xfd;
+	    xfds[nfds + nx].events = POLLIN;
+	    xfds[nfds + nx].revents = 0;
+	    owner[nx++] = i;
+	}
+    ret = real_ppoll(xfds, nfds + nx, tmo, sigmask);
+    if(ret < 0)
+	return ret;
+    for(i = 0; i < nx; i++)
+	if(xfds[nfds + i].revents & POLLIN)
+	    xfds[owner[i]].revents |= fds[owner[i]].events & POLLRD;
+    ret = 0;
+    for(i = 0; i < nfds; i++)
+	if((fds[i].revents = xfds[i].revents))
+	    ret++;
+    return poll_merge(fds, nfds, ret);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if(!__atomic_load_n(&npend, __ATOMIC_ACQUIRE) &&
+       !__atomic_load_n(&ntmr, __ATOMIC_ACQUIRE))
+	return real_poll(fds, nfds, timeout);
+    struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+    return poll_slow(fds, nfds, timeout < 0 ? NULL : &ts, NULL);
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
+	  const sigset_t *sigmask)
+{
+    if(!__atomic_load_n(&npend, __ATOMIC_ACQUIRE) &&
+       !__atomic_load_n(&ntmr, __ATOMIC_ACQUIRE))
+	return real_ppoll(fds, nfds, tmo_p, sigmask);
+    return poll_slow(fds, nfds, tmo_p, sigmask);
+}
+
+/* what select_pre() found */
+struct selx {
+    fd_set pend; /* read fds with queued events */
+    fd_set af; /* read fds whose timer or merged devices were added */
+    int np, nx; /* # of fds in each */
+};
+
+/* finds read fds with queued events, and adds active autofire timers and
+ * merged devices to readfds.  Returns the nfds to use for the real call. */
+static int select_pre(int nfds, fd_set *readfds, fd_set *writefds,
+		      fd_set *exceptfds, struct selx *x)
+{
+    struct evfdcap *cap;
+    int fd, n = nfds, xfd;
+    x->np = x->nx = 0;
+    if(!readfds)
+	return nfds;
+    if(nfds > FD_SETSIZE)
+	nfds = n = FD_SETSIZE;
+    FD_ZERO(&x->pend);
+    FD_ZERO(&x->af);
+    for(fd = 0; fd < nfds; fd++) {
+	if(!FD_ISSET(fd, readfds) || !(cap = cap_rd(fd)))
+	    continue;
+	if(pendq_ready(cap)) {
+	    FD_SET(fd, &x->pend);
+	    x->np++;
+	}
+	if((xfd = cap_xfd(cap)) >= 0 && xfd < FD_SETSIZE) {
+	    FD_SET(fd, &x->af);
+	    x->nx++;
+	    if(n <= xfd) {
+		/* the kernel will look at bits the caller didn't ask for */
+		for(; n <= xfd; n++) {
+		    FD_CLR(n, readfds);
+		    if(writefds)
+			FD_CLR(n, writefds);
+		    if(exceptfds)
+			FD_CLR(n, exceptfds);
 		}
 	    }
-	    if(mod) {
-		memcpy(buf, &ev, cap->excess_read ? nread : sizeof(ev));
-		if(cap->excess_read)
-		    memcpy(cap->ebuf, (char *)&ev + nread, cap->excess_read);
+	    FD_SET(xfd, readfds);
+	}
+    }
+    return n;
+}
+
+static int select_post(int nfds, fd_set *readfds, const struct selx *x, int ret)
+{
+    struct evfdcap *cap;
+    int fd, xfd;
+    if(ret < 0)
+	return ret;
+    if(nfds > FD_SETSIZE)
+	nfds = FD_SETSIZE;
+    if(x->nx)
+	for(fd = 0; fd < nfds; fd++) {
+	    if(!FD_ISSET(fd, &x->af) || !(cap = cap_rd(fd)) || (xfd = cap_wfd(cap)) < 0 ||
+	       !FD_ISSET(xfd, readfds))
+		continue;
+	    FD_CLR(xfd, readfds);
+	    ret--;
+	    if(!FD_ISSET(fd, readfds)) {
+		FD_SET(fd, readfds);
+		ret++;
 	    }
-	    nread -= sizeof(ev);
-	    buf += sizeof(ev);
-	} else {
-	    /* FIXME:  value probably needs adjusting for axes */
-	    ev.value = jev.value;
-	    if((jev.type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON) {
-		ev.type = EV_KEY;
-		ev.code = cap->js_extra->in_btn_map[jev.number];
-	    } else if((jev.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS) {
-		ev.type = EV_ABS;
-		ev.code = cap->js_extra->in_ax_map[jev.number];
+	}
+    if(x->np)
+	for(fd = 0; fd < nfds; fd++)
+	    if(FD_ISSET(fd, &x->pend) && !FD_ISSET(fd, readfds)) {
+		FD_SET(fd, readfds);
+		ret++;
 	    }
-	    process_ev_read(&ev, sec, cap, &mod, &drop);
-	    int newnum = 0;
-	    if(!drop) {
-		/* js may also shift and drop numbers */
-		if(ev.type == EV_KEY) {
-		    if(ev.code < BTN_MISC ||
-		       (newnum = cap->js_extra->out_btn_map[ev.code - BTN_MISC]) == 0xffff)
-			drop = 1;
-		} else if((newnum = cap->js_extra->out_ax_map[ev.code]) == 0xff)
-		    drop = 1;
-		if(newnum != jev.number)
-		    mod = 1;
+    return ret;
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+	   struct timeval *timeout)
+{
+    struct selx x;
+    struct timeval zero_tv = {};
+    int n;
+    if((!__atomic_load_n(&npend, __ATOMIC_ACQUIRE) &&
+        !__atomic_load_n(&ntmr, __ATOMIC_ACQUIRE)) ||
+       ((n = select_pre(nfds, readfds, writefds, exceptfds, &x)), !x.np && !x.nx))
+	return real_select(nfds, readfds, writefds, exceptfds, timeout);
+    return select_post(nfds, readfds, &x,
+		       real_select(n, readfds, writefds, exceptfds,
+				   x.np ? &zero_tv : timeout));
+}
+
+int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+	    const struct timespec *timeout, const sigset_t *sigmask)
+{
+    static const struct timespec zero_ts = {};
+    struct selx x;
+    int n;
+    if((!__atomic_load_n(&npend, __ATOMIC_ACQUIRE) &&
+        !__atomic_load_n(&ntmr, __ATOMIC_ACQUIRE)) ||
+       ((n = select_pre(nfds, readfds, writefds, exceptfds, &x)), !x.np && !x.nx))
+	return real_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+    return select_post(nfds, readfds, &x,
+		       real_pselect(n, readfds, writefds, exceptfds,
+				    x.np ? &zero_ts : timeout, sigmask));
+}
+
+/* epoll only reports what the caller registered, so remember that */
+/* The autofire/chord timer (or the epoll fd standing in for merged devices
+ * and the timer) is registered along with the captured fd, using the
+ * caller's data, so epoll_wait() reports it as the captured fd.  Up to
+ * MAX_EPOLL epoll instances per fd are remembered, for epoll_pend(); any
+ * more still get the timer, but not queued events. */
+/* where epfd is in cap->ep[], or -1; the lock is only needed to be sure */
+static int ep_find(struct evfdcap *cap, int epfd)
+{
+    int i;
+    for(i = 0; i < MAX_EPOLL; i++)
+	if(__atomic_load_n(&cap->ep[i].fd, __ATOMIC_ACQUIRE) == epfd)
+	    return i;
+    return -1;
+}
+
+/* epfd is being closed; don't confuse it with whatever reuses its number */
+static void ep_forget(int epfd)
+{
+    struct evfdcap *cap;
+    int e;
+    for(cap = __atomic_load_n(&cap_list, __ATOMIC_ACQUIRE); cap; cap = cap->lnext) {
+	if(ep_find(cap, epfd) < 0)
+	    continue;
+	pthread_mutex_lock(&cap->lk);
+	if((e = ep_find(cap, epfd)) >= 0) {
+	    __atomic_store_n(&cap->ep[e].fd, -1, __ATOMIC_RELEASE);
+	    __atomic_sub_fetch(&nepoll, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cap->lk);
+    }
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    int ret = real_epoll_ctl(epfd, op, fd, event);
+    struct evfdcap *cap;
+    if(ret < 0 || !cap_rd(fd))
+	return ret;
+    int en = errno;
+    if((cap = cap_rd(fd))) {
+	pthread_mutex_lock(&cap->lk);
+	int xfd = cap_wfd(cap), e = ep_find(cap, epfd);
+	if(e < 0 && op != EPOLL_CTL_DEL) {
+	    if((e = ep_find(cap, -1)) >= 0)
+		__atomic_add_fetch(&nepoll, 1, __ATOMIC_RELEASE);
+	    else
+		jlog(JL_WARN, "[epoll/%d] %d is in more than %d epoll sets; "
+		     "queued events won't wake this one\n", epfd, fd, MAX_EPOLL);
+	}
+	if(xfd >= 0) {
+	    struct epoll_event tev = {};
+	    if(op != EPOLL_CTL_DEL) {
+		tev.events = EPOLLIN | (event->events & EPOLLET);
+		tev.data = event->data;
 	    }
-	    if(drop) {
-		/* JS offers no SYN_DROPPED, so just drop entirely */
-		ret -= sizeof(jev);
-		if(nread > sizeof(jev)) {
-		    memmove(buf, buf + sizeof(jev), nread - sizeof(jev));
-		    buf -= sizeof(jev);
-		}
-		if(ret <= 0) {
-		    cap->excess_read = 0;
-		    return read(fd, buf, count);
+	    /* ADD may have to be MOD, and MOD may have to be ADD */
+	    if(op == EPOLL_CTL_DEL || !(event->events & EPOLLIN))
+		real_epoll_ctl(epfd, EPOLL_CTL_DEL, xfd, &tev);
+	    else if(real_epoll_ctl(epfd, EPOLL_CTL_ADD, xfd, &tev) < 0)
+		real_epoll_ctl(epfd, EPOLL_CTL_MOD, xfd, &tev);
+	}
+	if(e >= 0 && op != EPOLL_CTL_DEL) {
+	    cap->ep[e].ev = *event;
+	    __atomic_store_n(&cap->ep[e].fd, epfd, __ATOMIC_RELEASE);
+	} else if(e >= 0) {
+	    __atomic_store_n(&cap->ep[e].fd, -1, __ATOMIC_RELEASE);
+	    __atomic_sub_fetch(&nepoll, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cap->lk);
+    }
+    errno = en;
+    return ret;
+}
+
+/* merge queued fds registered with epfd into events, and merge the
+ * duplicates caused by autofire timers and merged devices */
+/* if events is NULL, just returns the # of fds with queued events */
+static int epoll_pend(int epfd, struct epoll_event *events, int maxevents, int ret)
+{
+    struct evfdcap *cap;
+    const struct epoll_event *ev;
+    int i, j, e, n = 0;
+    if(ret < 0)
+	return ret;
+    for(cap = __atomic_load_n(&cap_list, __ATOMIC_ACQUIRE); cap; cap = cap->lnext) {
+	if(ep_find(cap, epfd) < 0)
+	    continue;
+	pthread_mutex_lock(&cap->lk);
+	/* it may have been closed or reregistered since */
+	if(cap_of(cap->fd) != cap || (e = ep_find(cap, epfd)) < 0 ||
+	   !((ev = &cap->ep[e].ev)->events & EPOLLIN)) {
+	    pthread_mutex_unlock(&cap->lk);
+	    continue;
+	}
+	if(!events) {
+	    if(pendq_ready(cap))
+		n++;
+	    pthread_mutex_unlock(&cap->lk);
+	    continue;
+	}
+	for(i = 0; i < ret; i++)
+	    if(events[i].data.u64 == ev->data.u64)
+		break;
+	if(cap_wfd(cap) >= 0 && i < ret)
+	    for(j = i + 1; j < ret; j++)
+		if(events[j].data.u64 == ev->data.u64) {
+		    events[i].events |= events[j].events;
+		    memmove(events + j, events + j + 1, (ret - j - 1) * sizeof(*events));
+		    ret--;
+		    j--;
 		}
-	    } else if(mod) {
-		jev.type = (jev.type & JS_EVENT_INIT) |
-		    (ev.type == EV_KEY ? JS_EVENT_BUTTON : JS_EVENT_AXIS);
-		/* FIXME:  value probably needs adjusting for axes */
-		jev.value = ev.value;
-		jev.number = newnum;
-		memcpy(buf, &jev, cap->excess_read ? nread : sizeof(jev));
-		if(cap->excess_read)
-		    memcpy(cap->ebuf, (char *)&jev + nread, cap->excess_read);
+	if(pendq_ready(cap)) {
+	    if(i < ret)
+		events[i].events |= EPOLLIN;
+	    else if(ret < maxevents) {
+		events[ret].events = EPOLLIN;
+		events[ret++].data = ev->data;
 	    }
-	    nread -= sizeof(jev);
-	    buf += sizeof(jev);
 	}
+	pthread_mutex_unlock(&cap->lk);
+    }
+    return events ? ret : n;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    if(!__atomic_load_n(&npend, __ATOMIC_ACQUIRE) &&
+       !__atomic_load_n(&ntmr, __ATOMIC_ACQUIRE))
+	return real_epoll_wait(epfd, events, maxevents, timeout);
+    if(epoll_pend(epfd, NULL, 0, 0))
+	timeout = 0;
+    return epoll_pend(epfd, events, maxevents,
+		      real_epoll_wait(epfd, events, maxevents, timeout));
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout,
+		const sigset_t *sigmask)
+{
+    if(!__atomic_load_n(&npend, __ATOMIC_ACQUIRE) &&
+       !__atomic_load_n(&ntmr, __ATOMIC_ACQUIRE))
+	return real_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+    if(epoll_pend(epfd, NULL, 0, 0))
+	timeout = 0;
+    return epoll_pend(epfd, events, maxevents,
+		      real_epoll_pwait(epfd, events, maxevents, timeout, sigmask));
+}
+
+/* compute what EVIOCGKEY returns for cap into cap->keystates from the
+ * device's state */
+/* this code mostly matches init_evdev()'s GKEY mask initializer */
+/* except that it has to handle INVERT as needed */
+static int ev_gkey(struct evfdcap *cap)
+{
+    const struct evjrconf *sec = cap->conf;
+    int ret, i;
+    memset(&cap->keystates, 0, sizeof(cap->keystates));
+    ret = dev_ioctl(cap, EVIOCGKEY(sizeof(cap->keystates_in)), cap->keystates_in);
+    if(ret < 0)
+	return ret;
+    cap->ks_stale = 0;
+    for(i = 0; i < sec->nbt; i++) {
+	if((sec->bt_map[i].flags & (BTFL_MAP | BTFL_AXIS)) != BTFL_MAP)
+	    continue;
+	if(!ULISSET(cap->keystates_in, sec->bt_low + i) == !(sec->bt_map[i].flags & BTFL_INVERT)) {
+	    if(sec->bt_map[i].flags & BTFL_INVERT)
+		ULCLR(cap->keystates_in, sec->bt_low + i);
+	    continue;
+	}
+	if(sec->bt_map[i].target >= 0)
+	    ULSET(cap->keystates, sec->bt_map[i].target);
+	ULCLR(cap->keystates_in, sec->bt_low + i);
     }
-    return ret + ret_adj;
+    for(i = 0; i < sec->nax; i++)
+	if((sec->ax_map[i].flags & (AXFL_MAP | AXFL_BUTTON)) == (AXFL_MAP | AXFL_BUTTON)) {
+	    if(sec->ax_map[i].target >= 0)
+		ULCLR(cap->keystates_in, sec->ax_map[i].target);
+	    if(sec->ax_map[i].ntarget >= 0)
+		ULCLR(cap->keystates_in, sec->ax_map[i].ntarget);
+	    /* one-sided maps leave the other target at -1 */
+	    if((cap->xl_abs[i].state & AXFL_PRESSED) && sec->ax_map[i].target >= 0)
+		ULSET(cap->keystates, sec->ax_map[i].target);
+	    if((cap->xl_abs[i].state & AXFL_NPRESSED) && sec->ax_map[i].ntarget >= 0)
+		ULSET(cap->keystates, sec->ax_map[i].ntarget);
+	}
+    if(!sec->filter_bt)
+	for(i = 0; i < MINBITS(KEY_MAX); i++)
+	    cap->keystates[i] |= cap->keystates_in[i];
+    /* held back chord presses and toggled off autofire buttons
+     * haven't been sent as pressed, but chords have */
+    for(i = 0; i < sec->nchmember; i++)
+	if((cap->ch_pend | cap->ch_held) & (1U << i))
+	    ULCLR(cap->keystates, sec->chmember[i]);
+    for(i = 0; i < sec->nchord; i++)
+	if(cap->ch_active & (1 << i))
+	    ULSET(cap->keystates, sec->chord[i].code);
+    for(i = 0; i < sec->nautofire; i++)
+	if((cap->af_held & (1 << i)) && !cap->af[i].out)
+	    ULCLR(cap->keystates, sec->autofire[i].code);
+    return ret;
 }
 
 /* The rest of the translation takes place here: modifying ioctl returns */
@@ -2336,12 +6320,13 @@ int ioctl(int fd, unsigned long request, ...)
 	errno = en;
 	return real_ioctl(fd, request, argp);
     }
+    STAT_ADD(ioctl[!!cap->is_js][_IOC_NR(request)], 1);
     const struct evjrconf *sec = cap->conf;
     if(!cap->is_js) {
 #define cpstr(n, s) do { \
     if(!s) \
-	return real_ioctl(fd, request, argp); \
-    fprintf(logf, "%d: EVIOC" n " -> %s\n", fd, s); \
+	return dev_ioctl(cap, request, argp); \
+    jlog(JL_DBG, "%d: EVIOC" n " -> %s\n", fd, s); \
     len = strlen(s); \
     if(++len < _IOC_SIZE(request)) \
 	memcpy(argp, s, len); \
@@ -2350,7 +6335,7 @@ int ioctl(int fd, unsigned long request, ...)
 } while(0)
 #define cpmem(n, m) do { \
     len = _IOC_SIZE(request); \
-    fprintf(logf, "%d: altered EVIOC" n " -> %d/%d\n", fd, (int)len, (int)sizeof(m)); \
+    jlog(JL_DBG, "%d: altered EVIOC" n " -> %d/%d\n", fd, (int)len, (int)sizeof(m)); \
     if(len > sizeof(m)) { \
 	/* some pass len in bits to GBITS instead of len in bytes */ \
 	/* memset((char *)argp + sizeof(m), 0, len - sizeof(m)); */ \
@@ -2365,48 +6350,31 @@ int ioctl(int fd, unsigned long request, ...)
 	  case _IOC_NR(EVIOCGID):
 	    if(!sec->repl_id)
 		break;
-	    fprintf(logf, "%d: altered ID\n", fd);
+	    jlog(JL_DBG, "%d: altered ID\n", fd);
 	    /* cap->repl_id_val was filled in by init_evdev() */
 	    memcpy(argp, &cap->repl_id_val, sizeof(cap->repl_id_val));
 	    return 0;
 	  case _IOC_NR(EVIOCGUNIQ(0)):
 	    cpstr("GUNIQ", sec->repl_uniq);
 	    return len;
-	  case _IOC_NR(EVIOCGKEY(0)):
-	    /* this code mostly matches init_evdev()'s GKEY mask initializer */
-	    /* except that it has to handle INVERT as needed */
-	    memset(&cap->keystates, 0, sizeof(cap->keystates));
-	    ret = real_ioctl(fd, EVIOCGKEY(sizeof(cap->keystates_in)), cap->keystates_in);
-	    if(ret < 0)
+	  case _IOC_NR(EVIOCGKEY(0)): {
+	    /* some programs do this every frame, so it's not logged */
+	    unsigned long ks[MINBITS(KEY_MAX)];
+	    if(cap->ks_stale && (ret = ev_gkey(cap)) < 0)
 		return ret;
-	    for(i = 0; i < sec->nbt; i++) {
-		if((sec->bt_map[i].flags & (BTFL_MAP | BTFL_AXIS)) != BTFL_MAP)
-		    continue;
-		if(!ULISSET(cap->keystates_in, sec->bt_low + i) == !(sec->bt_map[i].flags & BTFL_INVERT)) {
-		    if(sec->bt_map[i].flags & BTFL_INVERT)
-			ULCLR(cap->keystates_in, sec->bt_low + i);
-		    continue;
-		}
-		if(sec->bt_map[i].target >= 0)
-		    ULSET(cap->keystates, sec->bt_map[i].target);
-		ULCLR(cap->keystates_in, sec->bt_low + i);
+	    memcpy(ks, cap->keystates, sizeof(ks));
+	    /* merged devices only add what the captured device doesn't have */
+	    for(i = 0; i < cap->nmerged; i++) {
+		struct evfdcap *m = cap->merged[i];
+		int j;
+		if(!m->ks_stale || ev_gkey(m) >= 0)
+		    for(j = 0; j < MINBITS(KEY_MAX); j++)
+			ks[j] |= m->keystates[j] & m->keysout[j];
 	    }
-	    for(i = 0; i < sec->nax; i++)
-		if((sec->ax_map[i].flags & (AXFL_MAP | AXFL_BUTTON)) == (AXFL_MAP | AXFL_BUTTON)) {
-		    if(sec->ax_map[i].target >= 0)
-			ULCLR(cap->keystates_in, sec->ax_map[i].target);
-		    if(sec->ax_map[i].ntarget >= 0)
-			ULCLR(cap->keystates_in, sec->ax_map[i].ntarget);
-		    if(sec->ax_map[i].flags & AXFL_PRESSED)
-			ULSET(cap->keystates, sec->ax_map[i].target);
-		    if(sec->ax_map[i].flags & AXFL_NPRESSED)
-			ULSET(cap->keystates, sec->ax_map[i].ntarget);
-		}
-	    if(!sec->filter_bt)
-		for(i = 0; i < MINBITS(KEY_MAX); i++)
-		    cap->keystates[i] |= cap->keystates_in[i];
-	    cpmem("GKEY()", cap->keystates);
+	    len = _IOC_SIZE(request) < sizeof(ks) ? _IOC_SIZE(request) : sizeof(ks);
+	    memcpy(argp, ks, len);
 	    return len;
+	  }
 	  case _IOC_NR(EVIOCGBIT(EV_ABS, 0)):
 	    /* filled in by init_evdev() */
 	    cpmem("GBIT(EV_ABS)", cap->absout);
@@ -2415,43 +6383,78 @@ int ioctl(int fd, unsigned long request, ...)
 	    /* filled in by init_evdev() */
 	    cpmem("GBIT(EV_KEY)", cap->keysout);
 	    return len;
+	  case _IOC_NR(EVIOCSCLOCKID):
+	    /* chord windows and generated events use the same clock */
+	    ret = dev_ioctl(cap, request, argp);
+	    if(ret >= 0)
+		cap->clkid = *(int *)argp;
+	    /* merged devices' frames are ordered by time stamp */
+	    for(i = 0; ret >= 0 && i < cap->nmerged; i++)
+		if(real_ioctl(cap->merged[i]->fd, request, argp) >= 0)
+		    cap->merged[i]->clkid = *(int *)argp;
+	    return ret;
 	  default:
+	    if(cap->nmerged && _IOC_NR(request) >= _IOC_NR(EVIOCGBIT(0, 0)) &&
+	       _IOC_NR(request) <= _IOC_NR(EVIOCGBIT(EV_MAX, 0))) {
+		/* other event types:  report the union */
+		unsigned char bits[KEY_CNT / 8];
+		int r, j;
+		len = _IOC_SIZE(request) < sizeof(bits) ? _IOC_SIZE(request) : sizeof(bits);
+		if((ret = dev_ioctl(cap, request, argp)) < 0)
+		    return ret;
+		for(i = 0; i < cap->nmerged; i++) {
+		    r = real_ioctl(cap->merged[i]->fd,
+				   EVIOCGBIT(_IOC_NR(request) - _IOC_NR(EVIOCGBIT(0, 0)), len),
+				   bits);
+		    for(j = 0; j < r; j++)
+			((unsigned char *)argp)[j] |= bits[j];
+		    if(r > ret)
+			ret = r;
+		}
+		return ret;
+	    }
 	    if(_IOC_NR(request) >= _IOC_NR(EVIOCGABS(0)) &&
 	       _IOC_NR(request) < _IOC_NR(EVIOCGABS(ABS_MAX))) {
 		/* return absinfo for *target*, unlike read which uses index */
 		/* also rescale and invert as needed */
 		int ax = _IOC_NR(request) - _IOC_NR(EVIOCGABS(0));
-		for(i = 0; i < sec->nax; i++)
-		    if((sec->ax_map[i].flags & (AXFL_MAP | AXFL_BUTTON)) == AXFL_MAP &&
-		       sec->ax_map[i].target == ax) {
-			int ret = real_ioctl(fd, EVIOCGABS(i), argp);
-			if(ret >= 0 && (sec->ax_map[i].flags & AXFL_RESCALE)) {
-			    const struct axmap *m = &sec->ax_map[i];
-			    long value = ((struct input_absinfo *)argp)->value;
-			    memcpy(argp, &m->ai, sizeof(m->ai));
-			    value = (value - m->offthresh) * ((long)m->ai.maximum - m->ai.minimum + 1) / ((long)m->onthresh - 2 * m->offthresh + 1) + m->ai.minimum;
-			    if(m->flags & AXFL_INVERT)
-				value = m->ai.minimum + m->ai.maximum - value;
-			    ((struct input_absinfo *)argp)->value = value;
-			} else if(ret >= 0 && (sec->ax_map[i].flags & AXFL_INVERT)) {
-			    struct input_absinfo *ai = argp;
-			    ai->value = sec->ax_map[i].onthresh - ai->value;
-			}
-			return ret;
+		const struct gabs *g = &cap->gabs[ax];
+		/* merged devices' axes come from them */
+		if(g->how == GABS_MERGED) {
+		    if(g->src >= cap->nmerged) {
+			errno = EINVAL;
+			return -1;
 		    }
-		for(i = 0; i < sec->nbt; i++)
-		    if((sec->bt_map[i].flags & (BTFL_MAP | BTFL_AXIS)) == (BTFL_MAP | BTFL_AXIS) &&
-		       (sec->bt_map[i].onax == ax || sec->bt_map[i].offax == ax)) {
-			/* FIXME:  support rescaling? */
-			struct input_absinfo ai = {
-			    .minimum = -1, .maximum = 1, .value = cap->axval[i]
-			    /* resolution? */
-			};
-			cpmem("GABS", ai);
-			return 0;
+		    cap = cap->merged[g->src];
+		    sec = cap->conf;
+		    fd = cap->fd;
+		    g = &cap->gabs[ax];
+		}
+		i = g->src;
+		switch(g->how) {
+		  case GABS_AX:
+		    ret = dev_ioctl(cap, EVIOCGABS(i), argp);
+		    if(ret >= 0 && (sec->ax_map[i].flags & AXFL_RESCALE)) {
+			int value = ((struct input_absinfo *)argp)->value;
+			memcpy(argp, &sec->ax_map[i].ai, sizeof(sec->ax_map[i].ai));
+			((struct input_absinfo *)argp)->value = rescale(&cap->xl_abs[i].sc, value);
+		    } else if(ret >= 0 && (sec->ax_map[i].flags & AXFL_INVERT)) {
+			struct input_absinfo *ai = argp;
+			ai->value = cap->xl_abs[i].add - ai->value;
 		    }
-		if(!sec->filter_ax && (ax >= sec->nax || !(sec->ax_map[ax].flags & AXFL_MAP)))
-		    return real_ioctl(fd, request, argp);
+		    return ret;
+		  case GABS_BT: {
+		    /* FIXME:  support rescaling? */
+		    struct input_absinfo ai = {
+			.minimum = -1, .maximum = 1, .value = cap->axval[ax]
+			/* resolution? */
+		    };
+		    cpmem("GABS", ai);
+		    return 0;
+		  }
+		  case GABS_PASS:
+		    return dev_ioctl(cap, request, argp);
+		}
 		errno = EINVAL;
 		return -1;
 	    }
@@ -2466,55 +6469,33 @@ int ioctl(int fd, unsigned long request, ...)
 	    return len;
 
 	  /**** all of the below only activate for jsremap ****/
-	  /* the following are computed instead of stored for now */
+	  /* the answers were built along with the js_extra maps */
 	  case _IOC_NR(JSIOCGAXES):
-	    if(sec->jsaxmap)
-		idx = sec->jsaxmap[0];
-	    else
-		for(i = 0; i < ABS_CNT; i++)
-		    if(ULISSET(cap->absout, i))
-			idx++;
+	    idx = cap->js_extra->nax;
 	    cpmem("GAXES", idx);
 	    return 0;
 	  case _IOC_NR(JSIOCGBUTTONS):
-	    if(sec->jsbtmap)
-		idx = sec->jsbtmap[0];
-	    else
-		for(i = BTN_MISC; i < KEY_MAX; i++)
-		    if(ULISSET(cap->keysout, i))
-			idx++;
+	    idx = cap->js_extra->nbtn;
 	    cpmem("GBUTTONS", idx);
 	    return 0;
 	  case _IOC_NR(JSIOCGAXMAP): /* set mapping not supported */
-	    if(sec->jsaxmap)
-		for(i = 0; i < sec->jsaxmap[0] && i < _IOC_SIZE(request); i++)
-		    ((__u8 *)argp)[i] = sec->jsaxmap[i + 1];
-	    else
-		for(i = 0; i < ABS_CNT; i++)
-		    if(ULISSET(cap->absout, i)) {
-			if(idx < _IOC_SIZE(request))
-			    ((__u8 *)argp)[idx] = i;
-			idx++;
-		    }
-	    fprintf(logf, "%d: altered JSIOCGAXMAP\n", fd);
+	    i = cap->js_extra->nax;
+	    if(i > _IOC_SIZE(request))
+		i = _IOC_SIZE(request);
+	    memcpy(argp, cap->js_extra->ax_list, i);
+	    jlog(JL_DBG, "%d: altered JSIOCGAXMAP\n", fd);
 	    return 0;
 	  case _IOC_NR(JSIOCGBTNMAP): /* set mapping not supported */
-	    if(sec->jsbtmap)
-		for(i = 0; i < sec->jsbtmap[0] && i < _IOC_SIZE(request) / 2; i++)
-		    ((__u16 *)argp)[i] = sec->jsbtmap[i + 1];
-	    else
-		for(i = BTN_MISC; i < KEY_MAX; i++)
-		    if(ULISSET(cap->keysout, i)) {
-			if(idx < _IOC_SIZE(request) / 2)
-			    ((__u16 *)argp)[idx] = i;
-			idx++;
-		    }
-	    fprintf(logf, "%d: altered JSIOCGBTNMAP\n", fd);
+	    i = cap->js_extra->nbtn;
+	    if(i > _IOC_SIZE(request) / 2)
+		i = _IOC_SIZE(request) / 2;
+	    memcpy(argp, cap->js_extra->btn_list, i * 2);
+	    jlog(JL_DBG, "%d: altered JSIOCGBTNMAP\n", fd);
 	    return 0;  /* FIXME:  -1/EINVAL if buttons out of range */
 	  /* set/get correction not supported; use rescale/event cal for that */
 	}
     }
-    return real_ioctl(fd, request, argp);
+    return dev_ioctl(cap, request, argp);
 }
 
 #if 0
@@ -2534,7 +6515,7 @@ void *dlopen(const char *filename, int flags)
     /* I should probably also have an env override to disable this code */
     if(!memcmp(s, "libc.so", 7) || !memcmp(s, "libpthread.so", 13) ||
        !memcmp(s, "libdl.so", 8)) {
-	fprintf(logf, "Disallowing dlopen of %s/%x\n", filename, flags);
+	jlog(JL_WARN, "Disallowing dlopen of %s/%x\n", filename, flags);
 	/* ugh.  RTLD_DEFAULT, the best value, is NULL, so it looks like a failure */
 	/* it's the only one that actually works, though, since mono eventually gives up */
 	return RTLD_DEFAULT;